@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/* Logging */
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_bench, LOG_LEVEL_DBG);
+
+/* MagTag common includes, no MagTag hardware needed */
+#include "magtag-common/latency.h"
+#include "magtag-common/lightdb_coalesce.h"
+#include "magtag-common/startup.h"
+
+/* Golioth platform includes */
+#include <net/golioth/system_client.h>
+#include <qcbor/qcbor.h>
+
+/*
+ * Upload benchmark, meant for native_posix against utility/golioth_standin.py
+ * but just as happy on a MagTag talking to the real cloud. The main thread
+ * pushes CBOR records to LightDB Stream back to back, and a timer changes a
+ * LightDB State document that goes out through the coalesced writer.
+ */
+
+#define BENCH_PATH	"bench"
+
+static struct golioth_client *client = GOLIOTH_SYSTEM_CLIENT_GET();
+
+/* Stream pushes since the last report */
+struct push_stats {
+	uint32_t count;
+	uint32_t failed;
+	uint64_t bytes;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint64_t sum_us;
+};
+
+static struct lightdb_coalesce bench_doc;
+static atomic_t lightdb_changes;
+static atomic_t lightdb_acked;
+static atomic_t lightdb_failed;
+
+static int encode_doc(char *buf, size_t len)
+{
+	int n = snprintk(buf, len, "{\"seq\":%ld,\"up\":%lld}",
+			atomic_get(&lightdb_changes), k_uptime_get());
+
+	return n < len ? 0 : -ENOMEM;
+}
+
+static int lightdb_ack(struct golioth_req_rsp *rsp)
+{
+	if (rsp->err) {
+		atomic_inc(&lightdb_failed);
+		return rsp->err;
+	}
+	/* Measured from the first change of the burst this write carried */
+	latency_record(LATENCY_LIGHTDB_ACK, (uint32_t)(uintptr_t)rsp->user_data);
+	atomic_inc(&lightdb_acked);
+	return 0;
+}
+
+static void lightdb_timer_handler(struct k_timer *timer)
+{
+	atomic_inc(&lightdb_changes);
+	lightdb_coalesce_mark(&bench_doc, (void *)(uintptr_t)k_cycle_get_32());
+}
+
+K_TIMER_DEFINE(lightdb_timer, lightdb_timer_handler, NULL);
+
+/* One stream record, {"seq": n, "up": uptime ms, "pad": bytes} */
+static int encode_record(uint32_t seq, uint8_t *buf, size_t len)
+{
+	static const uint8_t pad[CONFIG_BENCH_STREAM_PAD_BYTES];
+	QCBOREncodeContext ec;
+	UsefulBufC out;
+
+	QCBOREncode_Init(&ec, (UsefulBuf){ buf, len });
+	QCBOREncode_OpenMap(&ec);
+	QCBOREncode_AddUInt64ToMap(&ec, "seq", seq);
+	QCBOREncode_AddUInt64ToMap(&ec, "up", k_uptime_get());
+	QCBOREncode_AddBytesToMap(&ec, "pad", (UsefulBufC){ pad, sizeof(pad) });
+	QCBOREncode_CloseMap(&ec);
+
+	if (QCBOREncode_Finish(&ec, &out) != QCBOR_SUCCESS) {
+		return -ENOMEM;
+	}
+	return out.len;
+}
+
+static void push_stats_add(struct push_stats *s, int err, size_t len, uint32_t us)
+{
+	if (err) {
+		s->failed++;
+		return;
+	}
+	if (s->count == 0 || us < s->min_us) {
+		s->min_us = us;
+	}
+	if (us > s->max_us) {
+		s->max_us = us;
+	}
+	s->count++;
+	s->bytes += len;
+	s->sum_us += us;
+}
+
+static void report(const struct push_stats *s, int64_t elapsed_ms)
+{
+	LOG_INF("stream: %u pushes (%u failed) in %lld ms, %lld pushes/s, %llu B/s",
+			s->count, s->failed, elapsed_ms,
+			(int64_t)s->count * MSEC_PER_SEC / elapsed_ms,
+			s->bytes * MSEC_PER_SEC / elapsed_ms);
+	if (s->count) {
+		LOG_INF("stream: ack min=%u us avg=%u us max=%u us",
+				s->min_us, (uint32_t)(s->sum_us / s->count), s->max_us);
+	}
+	LOG_INF("lightdb: %ld changes, %ld writes acked, %ld failed",
+			atomic_set(&lightdb_changes, 0),
+			atomic_set(&lightdb_acked, 0),
+			atomic_set(&lightdb_failed, 0));
+}
+
+void main(void)
+{
+	static uint8_t buf[CONFIG_BENCH_STREAM_PAD_BYTES + 32];
+	struct push_stats stats = {};
+	uint32_t seq = 0;
+	int64_t since;
+
+	LOG_DBG("Start MagTag upload benchmark");
+
+	lightdb_coalesce_init(&bench_doc, client, BENCH_PATH, encode_doc, lightdb_ack);
+
+	startup_network(client, NULL);
+	startup_wait_connected(K_FOREVER);
+
+	if (CONFIG_BENCH_LIGHTDB_PERIOD_MS) {
+		k_timer_start(&lightdb_timer, K_MSEC(CONFIG_BENCH_LIGHTDB_PERIOD_MS),
+				K_MSEC(CONFIG_BENCH_LIGHTDB_PERIOD_MS));
+	}
+
+	since = k_uptime_get();
+	while (true) {
+		int len = encode_record(seq++, buf, sizeof(buf));
+
+		if (len < 0) {
+			LOG_ERR("Failed to encode record: %d", len);
+			return;
+		}
+
+		/* Returns once the push is acknowledged */
+		uint32_t start = k_cycle_get_32();
+		int err = golioth_stream_push(client, BENCH_PATH,
+				GOLIOTH_CONTENT_FORMAT_APP_CBOR, buf, len);
+
+		push_stats_add(&stats, err, len, k_cyc_to_us_floor32(k_cycle_get_32() - start));
+		if (err) {
+			/* Don't spin while disconnected */
+			k_sleep(K_SECONDS(1));
+		}
+
+		int64_t elapsed = k_uptime_get() - since;
+		if (elapsed >= CONFIG_BENCH_REPORT_S * MSEC_PER_SEC) {
+			report(&stats, elapsed);
+			stats = (struct push_stats){};
+			since += elapsed;
+		}
+
+		k_sleep(K_MSEC(CONFIG_BENCH_STREAM_PERIOD_MS));
+	}
+}
@@ -11,33 +11,31 @@ LOG_MODULE_REGISTER(golioth_magtag, LOG_LEVEL_DBG);
 
 /* Golioth platform includes */
 #include <net/golioth/system_client.h>
-#include <samples/common/net_connect.h>
 #include <zephyr/net/coap.h>
 
 /* MagTag specific hardware includes */
 #include "magtag-common/magtag_epaper.h"
 #include "magtag-common/ws2812_control.h"
 #include "magtag-common/accel.h"
+#include "magtag-common/accel_stats.h"
+#include "magtag-common/accel_batch.h"
 #include "magtag-common/buttons.h"
+#include "magtag-common/json-helper.h"
+#include "magtag-common/latency.h"
+#include "magtag-common/outbox.h"
+#include "magtag-common/lightdb_coalesce.h"
+#include "magtag-common/startup.h"
+#include "magtag-common/metrics.h"
 
-#define DEBOUNCE_MS	200
-volatile uint64_t debounce = 0;
+#ifndef CONFIG_MAGTAG_NAME
+#define CONFIG_MAGTAG_NAME "MagTag"
+#endif
 
-#define BUTTON_ACTION_ARRAY_SIZE	16
-#define BUTTON_ACTION_LEN		1
-K_MSGQ_DEFINE(button_action_msgq,
-		BUTTON_ACTION_LEN,
-		BUTTON_ACTION_ARRAY_SIZE,
-		1);
+#define LEDS_ENDPOINT	"leds"
+#define OUTBOX_RETRY_S	10
 
 /* Golioth */
 static struct golioth_client *client = GOLIOTH_SYSTEM_CLIENT_GET();
-static K_SEM_DEFINE(connected, 0, 1);
-
-static void golioth_on_connect(struct golioth_client *client)
-{
-	k_sem_give(&connected);
-}
 
 static int lightdb_handler(struct golioth_req_rsp *rsp)
 {
@@ -48,28 +46,45 @@ static int lightdb_handler(struct golioth_req_rsp *rsp)
 	return 0;
 }
 
-static int record_accelerometer(const struct device *sensor)
+/* user_data carries the cycle stamp of the press that caused the write */
+static int leds_sync_handler(struct golioth_req_rsp *rsp)
 {
-	struct sensor_value accel[3];
-	fetch_and_display(sensor, accel);
-	char str[160];
-	snprintk(str, sizeof(str) - 1,
-			"{\"x\":%f,\"y\":%f,\"z\":%f}",
-			sensor_value_to_double(&accel[0]),
-			sensor_value_to_double(&accel[1]),
-			sensor_value_to_double(&accel[2])
-			);
-	int err = golioth_stream_push_cb(client, "accel",
-				GOLIOTH_CONTENT_FORMAT_APP_JSON,
-				str, strlen(str),
-				lightdb_handler, NULL);
-	if (err) {
-		return err;
+	if (rsp->err) {
+		return lightdb_handler(rsp);
+	}
+	if (rsp->user_data) {
+		latency_record(LATENCY_LIGHTDB_ACK, (uint32_t)(uintptr_t)rsp->user_data);
 	}
 	return 0;
 }
 
+/* All LED states in one LightDB document, written once per burst of presses */
+static struct lightdb_coalesce leds_writer;
+
+static struct accel_stats_acc accel_acc;
+K_MSGQ_DEFINE(accel_stats_msgq, sizeof(struct accel_stats), 2, 4);
+
+/* Feed FIFO samples into the window statistics, queue each finished window */
+static void accel_work_handler(struct k_work *work)
+{
+	struct accel_sample batch[16];
+	struct accel_stats summary;
+	size_t n;
+
+	while ((n = accel_get_samples(batch, ARRAY_SIZE(batch))) > 0) {
+		for (size_t i=0; i<n; i++) {
+			if (accel_stats_feed(&accel_acc, &batch[i],
+					CONFIG_MAGTAG_ACCEL_STATS_WINDOW_MS, &summary)) {
+				k_msgq_put(&accel_stats_msgq, &summary, K_NO_WAIT);
+			}
+		}
+	}
+}
+
+K_WORK_DEFINE(accel_work, accel_work_handler);
+
 /* Timers for sound (PWM not yet implemented in ESP32s2 */
+#include <zephyr/drivers/gpio.h>
 #define ACTIVATE_NODE DT_ALIAS(activate)
 #define SOUND_NODE DT_ALIAS(sound)
 static const struct gpio_dt_spec act = GPIO_DT_SPEC_GET(ACTIVATE_NODE, gpios);
@@ -92,10 +107,31 @@ void end_note_timer_handler(struct k_timer *dummy)
 K_TIMER_DEFINE(end_note_timer, end_note_timer_handler, NULL);
 uint16_t notes[4] = {764,580,470,400};
 
+/**
+ * @brief Handle button presses and update LEDs
+ *
+ * This function will update the on/off state of the LED by setting turning the
+ * actual LED on or off and writing the new value to LightDB state
+ */
 void button_action_work_handler(struct k_work *work) {
-	while (k_msgq_num_used_get(&button_action_msgq)) {
-		uint8_t i;
-		k_msgq_get(&button_action_msgq, &i, K_NO_WAIT);
+	struct button_event evt;
+	uint32_t first_cycles = 0;
+	bool changed = false;
+
+	while (buttons_get_event(&evt, K_NO_WAIT) == 0) {
+		if (evt.type != BUTTON_EVT_PRESS) {
+			continue;
+		}
+
+		if (!changed) {
+			/* Measure latency from the first press in this batch */
+			first_cycles = evt.cycles;
+			/* The ePaper isn't touched, the LightDB ack is timed on its own */
+			latency_begin(first_cycles, BIT(LATENCY_LED_BLIT));
+		}
+
+		uint8_t i = evt.button;
+		LOG_INF("Button %c pressed", 'A'+i);
 		int8_t toggle_val = led_states[i].state > 0 ? 0 : 1;
 		led_states[i].state = toggle_val;
 		/* update local LED output immediately */
@@ -104,142 +140,120 @@ void button_action_work_handler(struct k_work *work) {
 		gpio_pin_set_dt(&act, 1);
 		k_timer_start(&make_sound_timer, K_USEC(notes[i]), K_USEC(notes[i]));
 		k_timer_start(&end_note_timer, K_MSEC(200), K_NO_WAIT);
+		changed = true;
+	}
 
-		/* Build the endpoint with the correct LED number */
-		uint8_t endpoint[32];
-		snprintk(endpoint, sizeof(endpoint)-1, "Button_%c", 'A'+i);
-		/* convert the toggle_val digit into a string */
-		char false_buf[6] = "false";
-		char true_buf[5] = "true";
-		char *state_p = toggle_val==0 ? false_buf : true_buf;
-
-		/* Update the LightDB state endpoint on the Golioth Cloud */
-		int err = golioth_lightdb_set_cb(client, endpoint,
-				GOLIOTH_CONTENT_FORMAT_APP_JSON,
-				state_p, strlen(state_p),
-				lightdb_handler, NULL);
-		if (err) {
-			LOG_WRN("Failed to update Button_%c: %d", 'A'+i, err);
-		}
+	if (changed) {
+		/* Rapid presses end up in a single write of all LEDs */
+		lightdb_coalesce_mark(&leds_writer, (void *)(uintptr_t)first_cycles);
 	}
 }
 
 K_WORK_DEFINE(button_action_work, button_action_work_handler);
 
-/**
- * @brief Handle button presses and update LEDs
- *
- * This function will update the on/off state of the LED by setting turning the
- * actual LED on or off and writing the new value to LightDB state
- *
- * @param dev 	device struct
- * @param cb 	callback struct
- * @param pins 	pinmask representing buttons that are pressed
- */
-void button_pressed(const struct device *dev, struct gpio_callback *cb,
-		    uint32_t pins)
+/* Runs on the startup thread, the display takes a few seconds to clear */
+static void display_init(void)
 {
-	if (debounce > k_uptime_ticks())
-	{
-		/* too soon to register another button press */
-		return;
-	}
-	else
-	{
-		/* register the timeout value for the next press */
-		debounce = sys_clock_timeout_end_calc(K_MSEC(DEBOUNCE_MS));
-	}
+	epaper_init();
+	epaper_Write(CONFIG_MAGTAG_NAME, strlen(CONFIG_MAGTAG_NAME), 14, -1, 2);
+	EPD_2IN9D_Sleep();
+}
 
-	/* Array to check which button was pressed */
-	uint32_t button_result[] = {
-		pins & BIT(button0.pin),
-		pins & BIT(button1.pin),
-		pins & BIT(button2.pin),
-		pins & BIT(button3.pin)
-	};
-
-	/* Process each button press that was detected */
-	for (uint8_t i=0; i<4; i++) {
-		if (button_result[i] != 0)
-		{
-			LOG_INF("Button %c pressed", 'A'+i);
-			k_msgq_put(&button_action_msgq, &i, K_NO_WAIT);
-		}
-	}
+/* Runs on the startup thread, a refresh would stall the system workqueue */
+static void show_connected(void)
+{
+	/* write successful connection message to screen */
+	LOG_INF("Connected to Golioth!: %s", CONFIG_MAGTAG_NAME);
+	epaper_autowrite("Connected to Golioth!", 21);
+	EPD_2IN9D_Sleep();
+}
 
-	k_work_submit(&button_action_work);
+/* Runs once, after both the first connection and the display bring-up */
+static void connected_work_handler(struct k_work *work)
+{
+	startup_run(show_connected);
 }
 
+K_WORK_DEFINE(connected_work, connected_work_handler);
+
 void main(void)
 {
 	LOG_DBG("Start MagTag demo");
 
-	#ifdef CONFIG_MAGTAG_NAME
 	LOG_INF("Device name: %s", CONFIG_MAGTAG_NAME);
-	#else
-	#define CONFIG_MAGTAG_NAME "MagTag"
-	#endif
 
-	/* Init leds and set two blue pixels to show until we connect to Golioth */
-	ws2812_init();
-	leds_immediate(BLACK, BLUE, BLUE, BLACK);
+	/* Writes left over from before a reboot go out once connected */
+	outbox_init();
 
-	/* Initialize MagTag hardware */
-	ws2812_init();
-	/* show two blue pixels to show until we connect to Golioth */
-	leds_immediate(BLACK, BLUE, BLUE, BLACK);
-	epaper_init();
-	if (IS_ENABLED(CONFIG_GOLIOTH_SAMPLES_COMMON)) {
-		net_connect();
-	}
+	/* Health records, starting before the network so its up time is counted */
+	metrics_init(client);
 
-	client->on_connect = golioth_on_connect;
-	golioth_system_client_start();
+	/* Clear the display and connect in the background */
+	startup_run(display_init);
+	startup_network(client, NULL);
+	startup_when_connected(&connected_work);
 
-	/* wait until we've connected to golioth */
-	k_sem_take(&connected, K_FOREVER);
+	/* Initialize MagTag hardware, usable right away whether online or not */
+	ws2812_init();
 
 	/* Accelerometer */
 	accelerometer_init();
+	accel_fifo_init(&accel_work);
 
 	/* buttons */
-	buttons_init(button_pressed);
+	lightdb_coalesce_init(&leds_writer, client, LEDS_ENDPOINT,
+			led_settings_encode, leds_sync_handler);
+	buttons_init(&button_action_work);
 
 	/* Setup pins for sound */
 	gpio_pin_configure_dt(&act, GPIO_OUTPUT_ACTIVE);
 	gpio_pin_configure_dt(&snd, GPIO_OUTPUT_ACTIVE);
 	gpio_pin_set_dt(&act, 0);
 
-	/* ePaper */
-	epaper_Write(CONFIG_MAGTAG_NAME, strlen(CONFIG_MAGTAG_NAME), 14, -1, 2);
-
-	/* write successful connection message to screen */
-	LOG_INF("Connected to Golioth!: %s", CONFIG_MAGTAG_NAME);
-	epaper_autowrite("Connected to Golioth!", 21);
-	EPD_2IN9D_Sleep();
-	
-	led_states[0].color = RED; led_states[0].state = 1;
-	led_states[1].color = GREEN; led_states[1].state = 1;
-	led_states[2].color = BLUE; led_states[2].state = 1;
-	led_states[3].color = YELLOW; led_states[3].state = 1;
+	led_states[0].color = colors[RED]; led_states[0].state = 1;
+	led_states[1].color = colors[GREEN]; led_states[1].state = 1;
+	led_states[2].color = colors[BLUE]; led_states[2].state = 1;
+	led_states[3].color = colors[YELLOW]; led_states[3].state = 1;
 	ws2812_blit(strip, led_states, STRIP_NUM_PIXELS);
 
-	/* write starting button values to LightDB state */
-	uint8_t endpoint[32];
-	for (uint8_t i=0; i<4; i++) {
-		snprintk(endpoint, sizeof(endpoint)-1, "Button_%c", 'A'+i);
-		int err = golioth_lightdb_set(client,
-				  endpoint,
-				  GOLIOTH_CONTENT_FORMAT_APP_JSON,
-				  "true", 4);
-		if (err) {
-			LOG_WRN("Failed to update Button_%c: %d", 'A'+i, err);
-		}
-	}
+	/* write starting LED values to LightDB state, stored until connected */
+	lightdb_coalesce_mark(&leds_writer, NULL);
 
 	int err;
+
+	static struct accel_batch batch;
+	static uint8_t buf[ACCEL_BATCH_BUF_SIZE];
+	struct accel_stats summary;
 	while (true) {
-		record_accelerometer(sensor);
-		k_sleep(K_SECONDS(5));
+		/* Collect window summaries until the batch is due, retry stored writes meanwhile */
+		k_timeout_t wait = outbox_pending() ? K_SECONDS(OUTBOX_RETRY_S) :
+			accel_batch_timeout(&batch);
+		if (k_msgq_get(&accel_stats_msgq, &summary, wait) == 0) {
+			accel_batch_add(&batch, &summary);
+		}
+		if (outbox_pending() && golioth_is_connected(client)) {
+			outbox_flush(client);
+		}
+		if (!accel_batch_ready(&batch)) {
+			continue;
+		}
+
+		int len = accel_batch_encode(batch.items, batch.count, buf, sizeof(buf));
+		batch.count = 0;
+		if (len < 0) {
+			continue;
+		}
+
+		/* Send now if nothing older is waiting, otherwise queue behind it */
+		err = -ENOTCONN;
+		if (outbox_pending() == 0 && golioth_is_connected(client)) {
+			err = golioth_stream_push(client, "accel",
+					GOLIOTH_CONTENT_FORMAT_APP_CBOR, buf, len);
+		}
+		if (err) {
+			LOG_WRN("Failed to push accel batch: %d, storing", err);
+			outbox_put(OUTBOX_STREAM, "accel", GOLIOTH_CONTENT_FORMAT_APP_CBOR,
+					buf, len);
+		}
 	}
 }
@@ -12,19 +12,13 @@ LOG_MODULE_REGISTER(golioth_magtag, LOG_LEVEL_DBG);
 /* MagTag specific hardware includes */
 #include "magtag-common/magtag_epaper.h"
 #include "magtag-common/ws2812_control.h"
+#include "magtag-common/startup.h"
 
 /* Golioth platform includes */
 #include <net/golioth/system_client.h>
-#include <samples/common/net_connect.h>
 #include <zephyr/net/coap.h>
 
 static struct golioth_client *client = GOLIOTH_SYSTEM_CLIENT_GET();
-static K_SEM_DEFINE(connected, 0, 1);
-
-static void golioth_on_connect(struct golioth_client *client)
-{
-	k_sem_give(&connected);
-}
 
 void main(void)
 {
@@ -32,19 +26,16 @@ void main(void)
 
 	/* Initialize MagTag hardware */
 	ws2812_init();
-	/* show two blue pixels to show until we connect to Golioth */
-	leds_immediate(BLACK, BLUE, BLUE, BLACK);
-	epaper_init();
-
-	if (IS_ENABLED(CONFIG_GOLIOTH_SAMPLES_COMMON)) {
-		net_connect();
-	}
+	/* breathe two blue pixels until we connect to Golioth */
+	ws2812_status(LED_STATUS_CONNECTING);
 
-	client->on_connect = golioth_on_connect;
-	golioth_system_client_start();
+	/* clear the display while the network comes up */
+	startup_run(epaper_init);
+	startup_network(client, NULL);
 
 	/* wait until we've connected to golioth */
-	k_sem_take(&connected, K_FOREVER);
+	startup_wait_local(K_FOREVER);
+	startup_wait_connected(K_FOREVER);
 
 	/* turn LEDs green to indicate connection */
 	leds_immediate(GREEN, GREEN, GREEN, GREEN);
@@ -40,10 +40,37 @@ void fetch_and_display(const struct device *sensor, struct sensor_value accel[3]
 	if (rc < 0) {
 		LOG_ERR("ERROR: Update failed: %d", rc);
 	} else {
-		LOG_INF("#%u @ %u ms: %sx %f , y %f , z %f",
-		       count, k_uptime_get_32(), overrun,
-		       sensor_value_to_double(&accel[0]),
-		       sensor_value_to_double(&accel[1]),
-		       sensor_value_to_double(&accel[2]));
+		char g[3][12];
+
+		for (uint8_t i=0; i<3; i++) {
+			accel_fmt_fixed(g[i], sizeof(g[i]), accel_ms2_to_ug(&accel[i]), 6);
+		}
+		LOG_INF("#%u @ %u ms: %sx %s g, y %s g, z %s g",
+		       count, k_uptime_get_32(), overrun, g[0], g[1], g[2]);
     }
 }
+
+/**
+ * @brief Print a fixed-point integer as a decimal without %f support
+ *
+ * e.g. 1234 with 3 decimals is "1.234", -5 with 3 decimals is "-0.005"
+ *
+ * @param decimals digits after the point, at most 9
+ *
+ * @return snprintk() result
+ */
+int accel_fmt_fixed(char *buf, size_t len, int32_t value, uint8_t decimals)
+{
+	static const uint32_t scale[] = {
+		1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+		1000000000,
+	};
+	uint32_t mag = value < 0 ? -(uint32_t)value : (uint32_t)value;
+
+	if (decimals == 0) {
+		return snprintk(buf, len, "%d", value);
+	}
+	decimals = MIN(decimals, ARRAY_SIZE(scale) - 1);
+	return snprintk(buf, len, "%s%u.%0*u", value < 0 ? "-" : "",
+			mag / scale[decimals], decimals, mag % scale[decimals]);
+}
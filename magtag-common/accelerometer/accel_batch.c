@@ -0,0 +1,103 @@
+#include "magtag-common/accel_batch.h"
+#include <qcbor/qcbor.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_accel_batch, LOG_LEVEL_DBG);
+
+/*
+ * A batch goes out as one CBOR array of summary maps. Each map carries the
+ * age of its window in ms at encode time, because the cloud stamps the whole
+ * push with a single arrival time.
+ */
+
+static void encode_summary(QCBOREncodeContext *ec, const struct accel_stats *s,
+		uint32_t now)
+{
+	static const char * const axis_names[3] = { "x", "y", "z" };
+
+	QCBOREncode_OpenMap(ec);
+	QCBOREncode_AddUInt64ToMap(ec, "age", now - s->start);
+	QCBOREncode_AddUInt64ToMap(ec, "n", s->count);
+	QCBOREncode_AddUInt64ToMap(ec, "ms", s->duration_ms);
+	QCBOREncode_AddUInt64ToMap(ec, "peak", s->peak);
+	for (uint8_t i=0; i<3; i++) {
+		const struct accel_axis_stats *a = &s->axis[i];
+
+		QCBOREncode_OpenMapInMap(ec, axis_names[i]);
+		QCBOREncode_AddInt64ToMap(ec, "mean", a->mean);
+		QCBOREncode_AddUInt64ToMap(ec, "var", a->variance);
+		QCBOREncode_AddUInt64ToMap(ec, "rms", a->rms);
+		QCBOREncode_AddInt64ToMap(ec, "min", a->min);
+		QCBOREncode_AddInt64ToMap(ec, "max", a->max);
+		QCBOREncode_CloseMap(ec);
+	}
+	QCBOREncode_CloseMap(ec);
+}
+
+/**
+ * @brief Encode n window summaries as a CBOR array
+ *
+ * @return length written, or -ENOMEM if buf was too small
+ */
+int accel_batch_encode(const struct accel_stats *items, size_t n, uint8_t *buf, size_t len)
+{
+	QCBOREncodeContext ec;
+	UsefulBufC out;
+	uint32_t now = k_uptime_get_32();
+
+	QCBOREncode_Init(&ec, (UsefulBuf){ buf, len });
+	QCBOREncode_OpenArray(&ec);
+	for (size_t i=0; i<n; i++) {
+		encode_summary(&ec, &items[i], now);
+	}
+	QCBOREncode_CloseArray(&ec);
+
+	QCBORError qerr = QCBOREncode_Finish(&ec, &out);
+	if (qerr != QCBOR_SUCCESS) {
+		LOG_ERR("Failed to encode batch of %zu: %d", n, qerr);
+		return -ENOMEM;
+	}
+	return out.len;
+}
+
+/**
+ * @brief Add a summary to the batch
+ *
+ * @return true when the batch is full and should be pushed
+ */
+bool accel_batch_add(struct accel_batch *batch, const struct accel_stats *stats)
+{
+	if (batch->count == 0) {
+		batch->first_ms = k_uptime_get();
+	}
+	if (batch->count < ARRAY_SIZE(batch->items)) {
+		batch->items[batch->count++] = *stats;
+	}
+	return batch->count == ARRAY_SIZE(batch->items);
+}
+
+/**
+ * @brief Time left before the batch is due, K_FOREVER while it is empty
+ *
+ * A batch is due CONFIG_MAGTAG_ACCEL_BATCH_MS after its first summary, so a
+ * slow trickle of summaries is not held back for too long.
+ */
+k_timeout_t accel_batch_timeout(const struct accel_batch *batch)
+{
+	if (batch->count == 0) {
+		return K_FOREVER;
+	}
+
+	int64_t left = batch->first_ms + CONFIG_MAGTAG_ACCEL_BATCH_MS - k_uptime_get();
+
+	return left > 0 ? K_MSEC(left) : K_NO_WAIT;
+}
+
+/**
+ * @brief Whether the batch is full, or its first summary has waited long enough
+ */
+bool accel_batch_ready(const struct accel_batch *batch)
+{
+	return batch->count == ARRAY_SIZE(batch->items) ||
+		(batch->count > 0 &&
+		 k_uptime_get() - batch->first_ms >= CONFIG_MAGTAG_ACCEL_BATCH_MS);
+}
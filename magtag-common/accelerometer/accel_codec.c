@@ -0,0 +1,79 @@
+#include "magtag-common/accel_codec.h"
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_accel_codec, LOG_LEVEL_DBG);
+
+static size_t put_varint(uint8_t *buf, uint32_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		buf[n++] = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = v;
+	return n;
+}
+
+static uint32_t zigzag(int32_t v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+/* Round to the nearest multiple of scale, halves away from zero */
+static int32_t quantize(int16_t v, uint16_t scale)
+{
+	if (v < 0) {
+		return -(int32_t)((-v + scale / 2) / scale);
+	}
+	return (v + scale / 2) / scale;
+}
+
+/**
+ * @brief Encode samples as deltas from the previous sample
+ *
+ * Values are rounded to the nearest multiple of scale first, and the deltas
+ * are taken between rounded values so the error never accumulates.
+ *
+ * @return length written, -EINVAL for a zero scale, or -ENOMEM if buf was
+ * too small (ACCEL_CODEC_MAX_BYTES(n) is always enough)
+ */
+int accel_codec_encode(const struct accel_sample *samples, size_t n, uint16_t scale,
+		uint8_t *buf, size_t len)
+{
+	int32_t prev[3] = { 0, 0, 0 };
+	uint32_t prev_ts = 0;
+	uint8_t tmp[5 + 3 * 5];
+	size_t pos = 0;
+
+	if (scale == 0) {
+		return -EINVAL;
+	}
+	if (len < 10) {
+		return -ENOMEM;
+	}
+	pos += put_varint(&buf[pos], n);
+	pos += put_varint(&buf[pos], scale);
+
+	for (size_t i=0; i<n; i++) {
+		const struct accel_sample *s = &samples[i];
+		const int32_t q[3] = {
+			quantize(s->x, scale), quantize(s->y, scale), quantize(s->z, scale)
+		};
+		size_t used = 0;
+
+		/* The first timestamp is sent whole, as a delta from 0 */
+		used += put_varint(&tmp[used], s->timestamp - prev_ts);
+		for (uint8_t a=0; a<3; a++) {
+			used += put_varint(&tmp[used], zigzag(q[a] - prev[a]));
+			prev[a] = q[a];
+		}
+		prev_ts = s->timestamp;
+
+		if (pos + used > len) {
+			return -ENOMEM;
+		}
+		memcpy(&buf[pos], tmp, used);
+		pos += used;
+	}
+	return pos;
+}
@@ -0,0 +1,449 @@
+#include "magtag-common/accel.h"
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_accel_fifo, LOG_LEVEL_DBG);
+
+/*
+ * The Zephyr LIS2DH driver only reads one sample at a time, so the FIFO is
+ * driven directly over I2C. The driver still probes and powers the part,
+ * this code then takes over the control registers. INT1 (irq-gpios in the
+ * devicetree) fires on the FIFO watermark and the samples are drained in a
+ * single burst read from the system workqueue.
+ */
+#define LIS2DH_NODE		DT_COMPAT_GET_ANY_STATUS_OKAY(st_lis2dh)
+
+#define LIS2DH_CTRL_REG1	0x20
+#define LIS2DH_CTRL_REG3	0x22
+#define LIS2DH_CTRL_REG4	0x23
+#define LIS2DH_CTRL_REG5	0x24
+#define LIS2DH_OUT_X_L		0x28
+#define LIS2DH_FIFO_CTRL_REG	0x2E
+#define LIS2DH_FIFO_SRC_REG	0x2F
+
+#define LIS2DH_AUTOINCREMENT	0x80	/* sub-address MSB for burst reads */
+#define LIS2DH_XYZ_EN		0x07
+#define LIS2DH_I1_WTM		BIT(2)
+#define LIS2DH_BDU_HR_2G	(BIT(7) | BIT(3))	/* 12-bit, +/-2 g, 1 mg/LSB */
+#define LIS2DH_FIFO_EN		BIT(6)
+#define LIS2DH_FIFO_MODE_STREAM	(2 << 6)
+#define LIS2DH_FIFO_WTM		BIT(7)
+#define LIS2DH_FIFO_OVRN	BIT(6)
+#define LIS2DH_FIFO_FSS_MASK	0x1F
+#define LIS2DH_FIFO_DEPTH	32
+
+#define ACCEL_RING_MASK		(CONFIG_MAGTAG_ACCEL_RING_SIZE - 1)
+
+BUILD_ASSERT((CONFIG_MAGTAG_ACCEL_RING_SIZE & ACCEL_RING_MASK) == 0,
+		"MAGTAG_ACCEL_RING_SIZE must be a power of two");
+
+static const struct i2c_dt_spec accel_i2c = I2C_DT_SPEC_GET(LIS2DH_NODE);
+static const struct gpio_dt_spec accel_int = GPIO_DT_SPEC_GET(LIS2DH_NODE, irq_gpios);
+static struct gpio_callback accel_int_cb_data;
+
+/* Supported output data rates and their CTRL_REG1 ODR field */
+static const struct {
+	uint16_t hz;
+	uint8_t odr;
+} odr_table[] = {
+	{ 1, 1 }, { 10, 2 }, { 25, 3 }, { 50, 4 }, { 100, 5 }, { 200, 6 }, { 400, 7 },
+};
+
+static uint16_t sample_hz;
+static uint8_t sample_odr;
+static struct k_work *consumer_work;
+
+/*
+ * Samples waiting for consumers. Filled from the system workqueue, read from
+ * any thread. When consumers fall behind the oldest samples are overwritten.
+ */
+static struct accel_sample ring[CONFIG_MAGTAG_ACCEL_RING_SIZE];
+static uint32_t ring_head;
+static uint32_t ring_tail;
+static struct k_spinlock ring_lock;
+static struct accel_fifo_stats stats;
+
+/* Data rate for hz rounded up to the next LIS2DH rate, which goes in *rounded */
+static uint8_t odr_for_hz(uint16_t hz, uint16_t *rounded)
+{
+	for (uint8_t i=0; i<ARRAY_SIZE(odr_table); i++) {
+		if (odr_table[i].hz >= hz) {
+			*rounded = odr_table[i].hz;
+			return odr_table[i].odr;
+		}
+	}
+	*rounded = odr_table[ARRAY_SIZE(odr_table) - 1].hz;
+	return odr_table[ARRAY_SIZE(odr_table) - 1].odr;
+}
+
+static void ring_push(const struct accel_sample *batch, uint8_t count, bool overrun)
+{
+	k_spinlock_key_t key = k_spin_lock(&ring_lock);
+	for (uint8_t i=0; i<count; i++) {
+		if (ring_head - ring_tail >= CONFIG_MAGTAG_ACCEL_RING_SIZE) {
+			ring_tail++;
+			stats.dropped++;
+		}
+		ring[ring_head++ & ACCEL_RING_MASK] = batch[i];
+	}
+	stats.batches++;
+	stats.samples += count;
+	if (overrun) {
+		stats.overruns++;
+	}
+	k_spin_unlock(&ring_lock, key);
+}
+
+/* Move everything in the FIFO to the ring, call from the workqueue only */
+static void fifo_drain(void)
+{
+	uint8_t raw[LIS2DH_FIFO_DEPTH * 6];
+	struct accel_sample batch[LIS2DH_FIFO_DEPTH];
+	uint8_t src;
+
+	int err = i2c_reg_read_byte_dt(&accel_i2c, LIS2DH_FIFO_SRC_REG, &src);
+	if (err) {
+		LOG_ERR("Failed to read FIFO status: %d", err);
+		return;
+	}
+
+	/* FSS reads 31 with the overrun flag set when all 32 slots are full */
+	uint8_t count = (src & LIS2DH_FIFO_FSS_MASK) + ((src & LIS2DH_FIFO_OVRN) ? 1 : 0);
+	if (count == 0) {
+		return;
+	}
+
+	err = i2c_burst_read_dt(&accel_i2c, LIS2DH_OUT_X_L | LIS2DH_AUTOINCREMENT,
+			raw, count * 6);
+	if (err) {
+		LOG_ERR("Failed to read FIFO: %d", err);
+		return;
+	}
+
+	/* The newest sample was taken about now, the rest one period apart */
+	uint32_t now = k_uptime_get_32();
+	for (uint8_t i=0; i<count; i++) {
+		const uint8_t *s = &raw[i * 6];
+
+		batch[i].timestamp = now - ((uint32_t)(count - 1 - i) * 1000) / sample_hz;
+		/* Left justified 12-bit data, 1 mg/LSB */
+		batch[i].x = (int16_t)sys_get_le16(&s[0]) >> 4;
+		batch[i].y = (int16_t)sys_get_le16(&s[2]) >> 4;
+		batch[i].z = (int16_t)sys_get_le16(&s[4]) >> 4;
+	}
+
+	ring_push(batch, count, src & LIS2DH_FIFO_OVRN);
+
+	if (consumer_work) {
+		k_work_submit(consumer_work);
+	}
+}
+
+static int accel_write_reg(uint8_t reg, uint8_t val)
+{
+	int err = i2c_reg_write_byte_dt(&accel_i2c, reg, val);
+	if (err) {
+		LOG_ERR("Failed to write reg 0x%02x: %d", reg, err);
+	}
+	return err;
+}
+
+/* Full rate sampling through the FIFO, woken on each watermark */
+static int start_fifo(uint8_t int1_extra)
+{
+	/* Reset through bypass mode so stale samples are discarded */
+	int err = accel_write_reg(LIS2DH_FIFO_CTRL_REG, 0);
+	err = err ? err : accel_write_reg(LIS2DH_FIFO_CTRL_REG,
+			LIS2DH_FIFO_MODE_STREAM | CONFIG_MAGTAG_ACCEL_FIFO_WATERMARK);
+	err = err ? err : accel_write_reg(LIS2DH_CTRL_REG3, LIS2DH_I1_WTM | int1_extra);
+	/* Start sampling last, the first watermark can't be missed */
+	err = err ? err : accel_write_reg(LIS2DH_CTRL_REG1, (sample_odr << 4) | LIS2DH_XYZ_EN);
+	return err;
+}
+
+#ifdef CONFIG_MAGTAG_ACCEL_MOTION
+
+/*
+ * Wake on motion. While still, the part samples slowly with the FIFO off and
+ * only the high-pass filtered IA1 threshold interrupt enabled, so the CPU
+ * sleeps. Motion switches to full rate FIFO sampling, which continues until
+ * no IA1 event has been seen for MAGTAG_ACCEL_STILL_MS.
+ */
+#define LIS2DH_CTRL_REG2	0x21
+#define LIS2DH_REFERENCE	0x26
+#define LIS2DH_INT1_CFG		0x30
+#define LIS2DH_INT1_SRC		0x31
+#define LIS2DH_INT1_THS		0x32
+#define LIS2DH_INT1_DURATION	0x33
+
+#define LIS2DH_HP_IA1		BIT(0)
+#define LIS2DH_I1_IA1		BIT(6)
+#define LIS2DH_LIR_INT1		BIT(3)
+#define LIS2DH_IA1_XYZ_HIGH	(BIT(1) | BIT(3) | BIT(5))	/* OR of high events */
+#define LIS2DH_INT1_IA		BIT(6)
+#define LIS2DH_THS_MG_2G	16
+#define LIS2DH_ODR_10HZ		2
+
+static atomic_t moving;
+
+static int enter_still(void)
+{
+	/* Samples taken since the last watermark still belong to the motion */
+	fifo_drain();
+
+	int err = accel_write_reg(LIS2DH_CTRL_REG3, LIS2DH_I1_IA1);
+	err = err ? err : accel_write_reg(LIS2DH_FIFO_CTRL_REG, 0);
+	err = err ? err : accel_write_reg(LIS2DH_CTRL_REG1,
+			(LIS2DH_ODR_10HZ << 4) | LIS2DH_XYZ_EN);
+	return err;
+}
+
+static void still_work_handler(struct k_work *work)
+{
+	if (enter_still() == 0) {
+		atomic_set(&moving, 0);
+		LOG_DBG("Motion stopped");
+		if (consumer_work) {
+			k_work_submit(consumer_work);
+		}
+	}
+}
+
+static K_WORK_DELAYABLE_DEFINE(still_work, still_work_handler);
+
+static void motion_seen(void)
+{
+	uint8_t src;
+
+	/* Reading INT1_SRC releases the latched interrupt */
+	if (i2c_reg_read_byte_dt(&accel_i2c, LIS2DH_INT1_SRC, &src) ||
+			!(src & LIS2DH_INT1_IA)) {
+		return;
+	}
+
+	k_work_reschedule(&still_work, K_MSEC(CONFIG_MAGTAG_ACCEL_STILL_MS));
+	if (!atomic_get(&moving) && start_fifo(LIS2DH_I1_IA1) == 0) {
+		atomic_set(&moving, 1);
+		LOG_DBG("Motion started");
+	}
+}
+
+static int motion_init(void)
+{
+	uint8_t ref;
+	uint8_t ths = CONFIG_MAGTAG_ACCEL_MOTION_THRESHOLD_MG / LIS2DH_THS_MG_2G;
+
+	int err = accel_write_reg(LIS2DH_CTRL_REG2, LIS2DH_HP_IA1);
+	err = err ? err : accel_write_reg(LIS2DH_CTRL_REG5, LIS2DH_FIFO_EN | LIS2DH_LIR_INT1);
+	err = err ? err : accel_write_reg(LIS2DH_INT1_THS, ths);
+	err = err ? err : accel_write_reg(LIS2DH_INT1_DURATION, 0);
+	err = err ? err : accel_write_reg(LIS2DH_INT1_CFG, LIS2DH_IA1_XYZ_HIGH);
+	/* Reading REFERENCE settles the high-pass filter on the current attitude */
+	err = err ? err : i2c_reg_read_byte_dt(&accel_i2c, LIS2DH_REFERENCE, &ref);
+	err = err ? err : enter_still();
+	return err;
+}
+
+/**
+ * @brief Whether the accelerometer is currently sampling because of motion
+ */
+bool accel_is_moving(void)
+{
+	return atomic_get(&moving) != 0;
+}
+
+#else
+
+static void motion_seen(void) {}
+
+bool accel_is_moving(void)
+{
+	return true;
+}
+
+#endif /* CONFIG_MAGTAG_ACCEL_MOTION */
+
+static void accel_int_work_handler(struct k_work *work)
+{
+	motion_seen();
+	if (accel_is_moving()) {
+		fifo_drain();
+	}
+
+	/* Another source asserted while we were reading, the edge has already passed */
+	if (gpio_pin_get_dt(&accel_int) > 0) {
+		k_work_submit(work);
+	}
+}
+
+static K_WORK_DEFINE(accel_int_work, accel_int_work_handler);
+
+static void accel_int_isr(const struct device *dev, struct gpio_callback *cb,
+		uint32_t pins)
+{
+	/* I2C can't be used from the ISR, drain from the workqueue */
+	k_work_submit(&accel_int_work);
+}
+
+/**
+ * @brief Sample the accelerometer into its FIFO and buffer the results
+ *
+ * Call after accelerometer_init(). Samples are taken at
+ * MAGTAG_ACCEL_SAMPLE_HZ and the CPU only wakes each time
+ * MAGTAG_ACCEL_FIFO_WATERMARK samples are ready. With MAGTAG_ACCEL_MOTION
+ * sampling only runs while the board is moving. fetch_and_display() must not
+ * be used while the FIFO is running as it would steal samples.
+ *
+ * @param work submitted each time new samples are available, and when motion
+ *             stops, may be NULL
+ *
+ * @return 0 on success, negative errno otherwise
+ */
+int accel_fifo_init(struct k_work *work)
+{
+	int err;
+
+	if (!i2c_is_ready_dt(&accel_i2c)) {
+		LOG_ERR("Accelerometer I2C bus not ready");
+		return -ENODEV;
+	}
+	if (!device_is_ready(accel_int.port)) {
+		LOG_ERR("Accelerometer interrupt GPIO not ready");
+		return -ENODEV;
+	}
+
+	consumer_work = work;
+	sample_odr = odr_for_hz(CONFIG_MAGTAG_ACCEL_SAMPLE_HZ, &sample_hz);
+
+	err = accel_write_reg(LIS2DH_CTRL_REG4, LIS2DH_BDU_HR_2G);
+	if (err) {
+		return err;
+	}
+
+	gpio_pin_configure_dt(&accel_int, GPIO_INPUT);
+	gpio_pin_interrupt_configure_dt(&accel_int, GPIO_INT_EDGE_TO_ACTIVE);
+	gpio_init_callback(&accel_int_cb_data, accel_int_isr, BIT(accel_int.pin));
+	gpio_add_callback(accel_int.port, &accel_int_cb_data);
+
+#ifdef CONFIG_MAGTAG_ACCEL_MOTION
+	err = motion_init();
+	if (err) {
+		return err;
+	}
+	LOG_INF("Accelerometer waiting for motion over %u mg",
+			CONFIG_MAGTAG_ACCEL_MOTION_THRESHOLD_MG);
+#else
+	err = accel_write_reg(LIS2DH_CTRL_REG5, LIS2DH_FIFO_EN);
+	err = err ? err : start_fifo(0);
+	if (err) {
+		return err;
+	}
+#endif
+
+	LOG_INF("Accelerometer FIFO at %u Hz, watermark %u", sample_hz,
+			CONFIG_MAGTAG_ACCEL_FIFO_WATERMARK);
+	return 0;
+}
+
+/**
+ * @brief Read the current sample while the FIFO is stopped
+ *
+ * Useful for a periodic report while the board is still.
+ *
+ * @return 0 on success, -EBUSY while the FIFO is sampling
+ */
+int accel_read_sample(struct accel_sample *sample)
+{
+	uint8_t raw[6];
+
+	if (accel_is_moving()) {
+		return -EBUSY;
+	}
+
+	int err = i2c_burst_read_dt(&accel_i2c, LIS2DH_OUT_X_L | LIS2DH_AUTOINCREMENT,
+			raw, sizeof(raw));
+	if (err) {
+		return err;
+	}
+
+	sample->timestamp = k_uptime_get_32();
+	sample->x = (int16_t)sys_get_le16(&raw[0]) >> 4;
+	sample->y = (int16_t)sys_get_le16(&raw[2]) >> 4;
+	sample->z = (int16_t)sys_get_le16(&raw[4]) >> 4;
+	return 0;
+}
+
+/**
+ * @brief Take buffered samples, oldest first
+ *
+ * @return number of samples copied into buf
+ */
+size_t accel_get_samples(struct accel_sample *buf, size_t max)
+{
+	size_t n = 0;
+
+	k_spinlock_key_t key = k_spin_lock(&ring_lock);
+	while (n < max && ring_tail != ring_head) {
+		buf[n++] = ring[ring_tail++ & ACCEL_RING_MASK];
+	}
+	k_spin_unlock(&ring_lock, key);
+	return n;
+}
+
+uint32_t accel_samples_pending(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&ring_lock);
+	uint32_t pending = ring_head - ring_tail;
+	k_spin_unlock(&ring_lock, key);
+	return pending;
+}
+
+uint16_t accel_sample_rate(void)
+{
+	return sample_hz;
+}
+
+/**
+ * @brief Change the FIFO sample rate
+ *
+ * Rounded up to the next LIS2DH data rate. Samples already in the FIFO are
+ * moved to the ring first so they keep timestamps for the old rate. While
+ * still, the new rate is used when motion starts. Call from the system
+ * workqueue, e.g. from the work passed to accel_fifo_init().
+ *
+ * @return the rate now in use
+ */
+uint16_t accel_set_sample_rate(uint16_t hz)
+{
+	uint16_t new_hz;
+	uint8_t odr = odr_for_hz(hz, &new_hz);
+
+	if (!accel_is_moving()) {
+		sample_odr = odr;
+		sample_hz = new_hz;
+		return sample_hz;
+	}
+
+	fifo_drain();
+
+	if (odr == sample_odr) {
+		return sample_hz;
+	}
+	if (accel_write_reg(LIS2DH_CTRL_REG1, (odr << 4) | LIS2DH_XYZ_EN)) {
+		/* Still sampling at the old rate */
+		return sample_hz;
+	}
+	sample_odr = odr;
+	sample_hz = new_hz;
+	LOG_DBG("Sample rate %u Hz", sample_hz);
+	return sample_hz;
+}
+
+void accel_fifo_get_stats(struct accel_fifo_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&ring_lock);
+	*out = stats;
+	k_spin_unlock(&ring_lock, key);
+}
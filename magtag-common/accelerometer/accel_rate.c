@@ -0,0 +1,74 @@
+#include "magtag-common/accel_rate.h"
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_accel_rate, LOG_LEVEL_DBG);
+
+/*
+ * Activity jumps straight to the top rate so nothing is missed; quiet
+ * windows halve the rate and still reports double the wait, so a board left
+ * alone quickly costs next to nothing.
+ *
+ * Each bound is set on its own, so a pair may be briefly inverted while new
+ * settings arrive one by one; the lower of the two is always used as the
+ * minimum.
+ */
+
+void accel_rate_init(struct accel_rate *rate)
+{
+	rate->min_hz = CONFIG_MAGTAG_ACCEL_RATE_MIN_HZ;
+	rate->max_hz = CONFIG_MAGTAG_ACCEL_RATE_MAX_HZ;
+	rate->min_interval_s = CONFIG_MAGTAG_ACCEL_RATE_MIN_INTERVAL_S;
+	rate->max_interval_s = CONFIG_MAGTAG_ACCEL_RATE_MAX_INTERVAL_S;
+	rate->threshold = CONFIG_MAGTAG_ACCEL_RATE_VARIANCE;
+	rate->hz = rate->max_hz;
+	rate->interval_s = rate->min_interval_s;
+}
+
+/**
+ * @brief Pick the sample rate for the next window
+ *
+ * Any finished window means the board is moving, so the still report
+ * interval also starts again from its minimum.
+ *
+ * @return rate to pass to accel_set_sample_rate()
+ */
+uint16_t accel_rate_window(struct accel_rate *rate, const struct accel_stats *window)
+{
+	uint16_t lo = MIN(rate->min_hz, rate->max_hz);
+	uint16_t hi = MAX(rate->min_hz, rate->max_hz);
+	uint32_t variance = 0;
+
+	for (uint8_t i=0; i<3; i++) {
+		variance = MAX(variance, window->axis[i].variance);
+	}
+
+	if (variance >= rate->threshold) {
+		rate->hz = hi;
+	}
+	else {
+		rate->hz /= 2;
+	}
+	rate->hz = CLAMP(rate->hz, lo, hi);
+	rate->interval_s = MIN(rate->min_interval_s, rate->max_interval_s);
+	return rate->hz;
+}
+
+/**
+ * @brief Time to wait for motion before sending a still report
+ */
+uint32_t accel_rate_interval(struct accel_rate *rate)
+{
+	uint32_t lo = MIN(rate->min_interval_s, rate->max_interval_s);
+	uint32_t hi = MAX(rate->min_interval_s, rate->max_interval_s);
+
+	rate->interval_s = CLAMP(rate->interval_s, lo, hi);
+	return rate->interval_s;
+}
+
+/**
+ * @brief Back off after a still report, the next wait is twice as long
+ */
+void accel_rate_still(struct accel_rate *rate)
+{
+	rate->interval_s = MIN(rate->interval_s * 2,
+			MAX(rate->min_interval_s, rate->max_interval_s));
+}
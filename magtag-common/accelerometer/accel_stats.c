@@ -0,0 +1,146 @@
+#include "magtag-common/accel_stats.h"
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_accel_stats, LOG_LEVEL_DBG);
+
+/*
+ * With int16 samples and at most 65535 of them, n * sum_sq and sum^2 both fit
+ * in 64 bits, so the variance is computed exactly from plain sums instead of
+ * needing Welford's running mean to avoid cancellation.
+ */
+#define ACCEL_STATS_MAX_SAMPLES	UINT16_MAX
+
+static uint32_t isqrt64(uint64_t v)
+{
+	uint64_t res = 0;
+	uint64_t bit = 1ULL << 62;
+
+	while (bit > v) {
+		bit >>= 2;
+	}
+	while (bit) {
+		if (v >= res + bit) {
+			v -= res + bit;
+			res = (res >> 1) + bit;
+		}
+		else {
+			res >>= 1;
+		}
+		bit >>= 2;
+	}
+	return (uint32_t)res;
+}
+
+void accel_stats_reset(struct accel_stats_acc *acc)
+{
+	memset(acc, 0, sizeof(*acc));
+}
+
+/**
+ * @brief Add one sample to the running totals
+ *
+ * Samples beyond 65535 in one window are ignored, accel_stats_feed() closes
+ * the window before that happens.
+ */
+void accel_stats_add(struct accel_stats_acc *acc, const struct accel_sample *s)
+{
+	const int16_t v[3] = { s->x, s->y, s->z };
+	uint32_t mag_sq = 0;
+
+	if (acc->count >= ACCEL_STATS_MAX_SAMPLES) {
+		return;
+	}
+	if (acc->count == 0) {
+		acc->start = s->timestamp;
+	}
+	acc->last = s->timestamp;
+
+	for (uint8_t i=0; i<3; i++) {
+		if (acc->count == 0 || v[i] < acc->min[i]) {
+			acc->min[i] = v[i];
+		}
+		if (acc->count == 0 || v[i] > acc->max[i]) {
+			acc->max[i] = v[i];
+		}
+		acc->sum[i] += v[i];
+		acc->sum_sq[i] += (uint32_t)(v[i] * v[i]);
+		mag_sq += (uint32_t)(v[i] * v[i]);
+	}
+	if (mag_sq > acc->peak_sq) {
+		acc->peak_sq = mag_sq;
+	}
+	acc->count++;
+}
+
+void accel_stats_finish(const struct accel_stats_acc *acc, struct accel_stats *out)
+{
+	uint64_t n = acc->count;
+
+	memset(out, 0, sizeof(*out));
+	if (n == 0) {
+		return;
+	}
+
+	out->start = acc->start;
+	out->duration_ms = acc->last - acc->start;
+	out->count = acc->count;
+	out->peak = isqrt64(acc->peak_sq);
+
+	for (uint8_t i=0; i<3; i++) {
+		struct accel_axis_stats *a = &out->axis[i];
+		uint64_t spread = n * acc->sum_sq[i] - (uint64_t)(acc->sum[i] * acc->sum[i]);
+
+		a->mean = (int32_t)(acc->sum[i] / (int64_t)n);
+		a->variance = (uint32_t)(spread / (n * n));
+		a->rms = isqrt64(acc->sum_sq[i] / n);
+		a->min = acc->min[i];
+		a->max = acc->max[i];
+	}
+}
+
+/**
+ * @brief Add a sample and close the window when it is full
+ *
+ * A window closes when the sample arrives window_ms or more after the first
+ * one; that sample then starts the next window.
+ *
+ * @return true when out holds a finished window
+ */
+bool accel_stats_feed(struct accel_stats_acc *acc, const struct accel_sample *s,
+		uint32_t window_ms, struct accel_stats *out)
+{
+	bool done = false;
+
+	if (acc->count > 0 && ((s->timestamp - acc->start) >= window_ms ||
+				acc->count >= ACCEL_STATS_MAX_SAMPLES)) {
+		accel_stats_finish(acc, out);
+		accel_stats_reset(acc);
+		done = true;
+	}
+	accel_stats_add(acc, s);
+	return done;
+}
+
+/**
+ * @brief Write a window summary as compact JSON
+ *
+ * @return length written, or a negative value if buf was too small
+ */
+int accel_stats_json(const struct accel_stats *stats, char *buf, size_t len)
+{
+	static const char axis_names[3] = { 'x', 'y', 'z' };
+	int pos = snprintk(buf, len, "{\"n\":%u,\"ms\":%u,\"peak\":%u",
+			stats->count, stats->duration_ms, stats->peak);
+
+	for (uint8_t i=0; i<3 && pos < len; i++) {
+		const struct accel_axis_stats *a = &stats->axis[i];
+
+		pos += snprintk(&buf[pos], len - pos,
+				",\"%c\":{\"mean\":%d,\"var\":%u,\"rms\":%u,\"min\":%d,\"max\":%d}",
+				axis_names[i], a->mean, a->variance, a->rms, a->min, a->max);
+	}
+	if (pos >= len) {
+		return -ENOMEM;
+	}
+	pos += snprintk(&buf[pos], len - pos, "}");
+	return pos < len ? pos : -ENOMEM;
+}
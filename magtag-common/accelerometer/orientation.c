@@ -0,0 +1,79 @@
+#include "magtag-common/orientation.h"
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_orientation, LOG_LEVEL_DBG);
+
+/*
+ * Accelerometer axes as seen from the front of the display in landscape:
+ * +x towards the right edge, +y towards the top edge. At rest the axis
+ * pointing up reads +1 g.
+ */
+#define TILT_MIN_MG	500	/* below this the board is lying flat */
+#define TILT_MARGIN_MG	250	/* hysteresis between neighbouring orientations */
+
+static atomic_t current = ATOMIC_INIT(EPAPER_LANDSCAPE);
+static enum epaper_orientation candidate = EPAPER_LANDSCAPE;
+static uint32_t candidate_since;
+static struct k_work *change_work;
+
+static bool classify(const struct accel_sample *s, enum epaper_orientation *out)
+{
+	int32_t ax = s->x < 0 ? -s->x : s->x;
+	int32_t ay = s->y < 0 ? -s->y : s->y;
+
+	if (ay >= TILT_MIN_MG && ay >= ax + TILT_MARGIN_MG) {
+		*out = s->y > 0 ? EPAPER_LANDSCAPE : EPAPER_LANDSCAPE_FLIPPED;
+		return true;
+	}
+	if (ax >= TILT_MIN_MG && ax >= ay + TILT_MARGIN_MG) {
+		*out = s->x > 0 ? EPAPER_PORTRAIT : EPAPER_PORTRAIT_FLIPPED;
+		return true;
+	}
+	/* Flat or between two orientations, keep what we have */
+	return false;
+}
+
+/**
+ * @brief Feed an accelerometer sample to the orientation detector
+ *
+ * A new orientation is accepted once it has been held for
+ * MAGTAG_ORIENTATION_SETTLE_MS, then the work passed to orientation_init()
+ * is submitted. Call from a single thread, e.g. the accel FIFO consumer.
+ */
+void orientation_update(const struct accel_sample *s)
+{
+	enum epaper_orientation seen;
+
+	if (!classify(s, &seen)) {
+		candidate = atomic_get(&current);
+		return;
+	}
+
+	if (seen != candidate) {
+		candidate = seen;
+		candidate_since = s->timestamp;
+		return;
+	}
+
+	if (seen != atomic_get(&current) &&
+			(s->timestamp - candidate_since) >= CONFIG_MAGTAG_ORIENTATION_SETTLE_MS) {
+		atomic_set(&current, seen);
+		LOG_INF("Orientation changed to %d", seen);
+		if (change_work) {
+			k_work_submit(change_work);
+		}
+	}
+}
+
+enum epaper_orientation orientation_get(void)
+{
+	return atomic_get(&current);
+}
+
+/**
+ * @param work submitted when the orientation changes, may be NULL
+ */
+void orientation_init(struct k_work *work)
+{
+	change_work = work;
+}
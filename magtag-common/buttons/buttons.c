@@ -1,24 +1,282 @@
 #include "magtag-common/buttons.h"
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/sys/atomic.h>
+
+/* Buttons */
+#define SW0_NODE	DT_ALIAS(sw0)
+#define SW1_NODE	DT_ALIAS(sw1)
+#define SW2_NODE	DT_ALIAS(sw2)
+#define SW3_NODE	DT_ALIAS(sw3)
+
+static const struct gpio_dt_spec buttons[BUTTONS_NUM] = {
+	GPIO_DT_SPEC_GET(SW0_NODE, gpios),
+	GPIO_DT_SPEC_GET(SW1_NODE, gpios),
+	GPIO_DT_SPEC_GET(SW2_NODE, gpios),
+	GPIO_DT_SPEC_GET(SW3_NODE, gpios),
+};
+static struct gpio_callback button_cb_data;
+
+/* Per-button state machine, shared by the GPIO ISR and the scan timer */
+struct button_state {
+	uint32_t first_edge_ms;	/* first edge of the current bounce burst */
+	uint32_t first_edge_cycles;
+	uint32_t last_edge_ms;	/* most recent edge */
+	uint32_t press_ms;
+	uint32_t release_ms;
+	bool settling;		/* edges seen, level not yet accepted */
+	bool pressed;		/* debounced level */
+	bool long_sent;
+	bool double_armed;	/* last press was short, a quick re-press is a double */
+};
+
+static struct button_state button_states[BUTTONS_NUM];
+static struct k_spinlock button_lock;
+static bool scanning;
+static struct k_work *event_work;
+
+/*
+ * Single-producer/single-consumer event ring. The scan timer is the only
+ * producer and only advances ring_head; the consumer thread only advances
+ * ring_tail. event_sem counts queued events so the consumer can block.
+ */
+#define EVENT_RING_SIZE	CONFIG_MAGTAG_BUTTONS_EVENT_QUEUE_SIZE
+#define EVENT_RING_MASK	(EVENT_RING_SIZE - 1)
+BUILD_ASSERT(IS_POWER_OF_TWO(EVENT_RING_SIZE), "Event ring size must be a power of two");
+
+static struct button_event event_ring[EVENT_RING_SIZE];
+static atomic_t ring_head;
+static atomic_t ring_tail;
+static K_SEM_DEFINE(event_sem, 0, EVENT_RING_SIZE);
+
+static atomic_t events_queued;
+static atomic_t events_dropped;
+static atomic_t events_high_water;
+
+/* Producer side, called from the scan timer with button_lock held */
+static bool emit(uint8_t type, uint8_t button, uint8_t held, uint32_t timestamp,
+		uint32_t cycles)
+{
+	uint32_t head = (uint32_t)atomic_get(&ring_head);
+	uint32_t used = head - (uint32_t)atomic_get(&ring_tail);
+
+	if (used >= EVENT_RING_SIZE) {
+		/* Consumer has fallen behind, drop the newest event */
+		atomic_inc(&events_dropped);
+		return false;
+	}
+
+	struct button_event *evt = &event_ring[head & EVENT_RING_MASK];
+	evt->timestamp = timestamp;
+	evt->cycles = cycles;
+	evt->type = type;
+	evt->button = button;
+	evt->buttons = held;
+
+	/* atomic_set is a full barrier: the slot is written before it's published */
+	atomic_set(&ring_head, (atomic_val_t)(head + 1));
+	k_sem_give(&event_sem);
+
+	atomic_inc(&events_queued);
+	if (used + 1 > (uint32_t)atomic_get(&events_high_water)) {
+		atomic_set(&events_high_water, (atomic_val_t)(used + 1));
+	}
+	return true;
+}
+
+static uint8_t held_mask(void)
+{
+	uint8_t mask = 0;
+
+	for (uint8_t i=0; i<BUTTONS_NUM; i++) {
+		if (button_states[i].pressed) {
+			mask |= BIT(i);
+		}
+	}
+	return mask;
+}
+
+/* on_press() and on_release() return true if any event was queued */
+static bool on_press(uint8_t i, uint32_t ts)
+{
+	struct button_state *b = &button_states[i];
+	uint8_t others = held_mask() & ~BIT(i);
+	bool emitted;
+
+	b->pressed = true;
+	b->press_ms = ts;
+	b->long_sent = false;
+
+	emitted = emit(BUTTON_EVT_PRESS, i, others | BIT(i), ts, b->first_edge_cycles);
+	if (others) {
+		emitted |= emit(BUTTON_EVT_CHORD, i, others | BIT(i), ts, b->first_edge_cycles);
+	}
+	if (b->double_armed && (ts - b->release_ms) <= CONFIG_MAGTAG_BUTTONS_DOUBLE_PRESS_MS) {
+		/* Disarm so a third press doesn't count as another double */
+		b->double_armed = false;
+		emitted |= emit(BUTTON_EVT_DOUBLE, i, BIT(i), ts, b->first_edge_cycles);
+	}
+	return emitted;
+}
+
+static bool on_release(uint8_t i, uint32_t ts)
+{
+	struct button_state *b = &button_states[i];
+
+	b->pressed = false;
+	b->release_ms = ts;
+	b->double_armed = !b->long_sent;
+
+	return emit(BUTTON_EVT_RELEASE, i, held_mask(), ts, b->first_edge_cycles);
+}
+
+/*
+ * Runs every MAGTAG_BUTTONS_SCAN_MS while any button is pressed or bouncing.
+ * A new level is accepted once no edge has been seen for the debounce time.
+ */
+static void scan_timer_handler(struct k_timer *timer)
+{
+	uint32_t now = k_uptime_get_32();
+	bool busy = false;
+	bool emitted = false;
+
+	k_spinlock_key_t key = k_spin_lock(&button_lock);
+	for (uint8_t i=0; i<BUTTONS_NUM; i++) {
+		struct button_state *b = &button_states[i];
+
+		if (b->settling && (now - b->last_edge_ms) >= CONFIG_MAGTAG_BUTTONS_DEBOUNCE_MS) {
+			bool level = gpio_pin_get_dt(&buttons[i]) > 0;
+
+			b->settling = false;
+			if (level && !b->pressed) {
+				emitted |= on_press(i, b->first_edge_ms);
+			}
+			else if (!level && b->pressed) {
+				emitted |= on_release(i, b->first_edge_ms);
+			}
+		}
+
+		if (b->pressed && !b->long_sent &&
+				(now - b->press_ms) >= CONFIG_MAGTAG_BUTTONS_LONG_PRESS_MS) {
+			b->long_sent = true;
+			emitted |= emit(BUTTON_EVT_LONG, i, held_mask(), now,
+					k_cycle_get_32());
+		}
+
+		if (b->settling || b->pressed) {
+			busy = true;
+		}
+	}
+
+	if (!busy) {
+		/* All buttons released and stable */
+		scanning = false;
+		k_timer_stop(timer);
+	}
+	k_spin_unlock(&button_lock, key);
+
+	/* One submit per scan, however many events were queued */
+	if (emitted && event_work) {
+		k_work_submit(event_work);
+	}
+}
+
+static K_TIMER_DEFINE(button_scan_timer, scan_timer_handler, NULL);
+
+static void button_isr(const struct device *dev, struct gpio_callback *cb,
+		uint32_t pins)
+{
+	uint32_t now = k_uptime_get_32();
+	uint32_t cycles = k_cycle_get_32();
+
+	k_spinlock_key_t key = k_spin_lock(&button_lock);
+	for (uint8_t i=0; i<BUTTONS_NUM; i++) {
+		if (dev != buttons[i].port || !(pins & BIT(buttons[i].pin))) {
+			continue;
+		}
+
+		struct button_state *b = &button_states[i];
+		if (!b->settling) {
+			b->settling = true;
+			b->first_edge_ms = now;
+			b->first_edge_cycles = cycles;
+		}
+		b->last_edge_ms = now;
+	}
+
+	if (!scanning) {
+		scanning = true;
+		k_timer_start(&button_scan_timer,
+				K_MSEC(CONFIG_MAGTAG_BUTTONS_SCAN_MS),
+				K_MSEC(CONFIG_MAGTAG_BUTTONS_SCAN_MS));
+	}
+	k_spin_unlock(&button_lock, key);
+}
 
 /**
  * @brief set up buttons and interrupts
  *
- * @param handler the function to call when button interrupt occurs
+ * Each button is debounced independently and decoded into press, release,
+ * long, double and chord events, read with buttons_get_event().
+ *
+ * @param work  submitted whenever a new event is queued (may be NULL)
  */
-void buttons_init(gpio_callback_handler_t handler)
-{
-    gpio_pin_configure_dt(&button0, GPIO_INPUT);
-	gpio_pin_configure_dt(&button1, GPIO_INPUT);
-	gpio_pin_configure_dt(&button2, GPIO_INPUT);
-	gpio_pin_configure_dt(&button3, GPIO_INPUT);
-	gpio_pin_interrupt_configure_dt(&button0, GPIO_INT_EDGE_TO_ACTIVE);
-	gpio_pin_interrupt_configure_dt(&button1, GPIO_INT_EDGE_TO_ACTIVE);
-	gpio_pin_interrupt_configure_dt(&button2, GPIO_INT_EDGE_TO_ACTIVE);
-	gpio_pin_interrupt_configure_dt(&button3, GPIO_INT_EDGE_TO_ACTIVE);
-	uint32_t button_mask = BIT(button0.pin) | BIT(button1.pin) | BIT(button2.pin) | BIT(button3.pin);
-	gpio_init_callback(&button_cb_data, handler, button_mask);
-	gpio_add_callback(button0.port, &button_cb_data);
-	gpio_add_callback(button1.port, &button_cb_data);
-	gpio_add_callback(button2.port, &button_cb_data);
-	gpio_add_callback(button3.port, &button_cb_data);
+void buttons_init(struct k_work *work)
+{
+	uint32_t button_mask = 0;
+
+	event_work = work;
+
+	for (uint8_t i=0; i<BUTTONS_NUM; i++) {
+		gpio_pin_configure_dt(&buttons[i], GPIO_INPUT);
+		gpio_pin_interrupt_configure_dt(&buttons[i], GPIO_INT_EDGE_BOTH);
+		button_mask |= BIT(buttons[i].pin);
+	}
+	gpio_init_callback(&button_cb_data, button_isr, button_mask);
+	for (uint8_t i=0; i<BUTTONS_NUM; i++) {
+		gpio_add_callback(buttons[i].port, &button_cb_data);
+	}
+}
+
+/**
+ * @brief Get the next button event
+ *
+ * Events must be consumed from a single thread. Use K_NO_WAIT to poll.
+ *
+ * @param evt       receives the event
+ * @param timeout   how long to wait for an event
+ * @return 0 on success, -EAGAIN if no event is available
+ */
+int buttons_get_event(struct button_event *evt, k_timeout_t timeout)
+{
+	if (k_sem_take(&event_sem, timeout) != 0) {
+		return -EAGAIN;
+	}
+
+	uint32_t tail = (uint32_t)atomic_get(&ring_tail);
+	*evt = event_ring[tail & EVENT_RING_MASK];
+	/* Slot is copied out before it is handed back to the producer */
+	atomic_set(&ring_tail, (atomic_val_t)(tail + 1));
+	return 0;
+}
+
+/**
+ * @brief Number of events waiting to be read
+ */
+uint32_t buttons_events_pending(void)
+{
+	return (uint32_t)atomic_get(&ring_head) - (uint32_t)atomic_get(&ring_tail);
+}
+
+/**
+ * @brief Get event ring counters
+ *
+ * @param stats receives total queued and dropped events and the highest ring
+ *              occupancy seen
+ */
+void buttons_get_stats(struct button_event_stats *stats)
+{
+	stats->queued = (uint32_t)atomic_get(&events_queued);
+	stats->dropped = (uint32_t)atomic_get(&events_dropped);
+	stats->high_water = (uint32_t)atomic_get(&events_high_water);
 }
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "magtag-common/magtag_epaper.h"
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_epaper_rle, LOG_LEVEL_DBG);
+
+/*
+ * Region updates are PackBits compressed. A control byte n of 0..127 is
+ * followed by n+1 literal bytes, 129..255 by one byte repeated 257-n times,
+ * and 128 is skipped. Decoded, a region is in display RAM order: rows of w/8
+ * bytes along the 296 pixel side, MSB leftmost, 1 is black (see
+ * utility/epaper_rle.py). Bytes go to the controller as they are decoded, so
+ * no frame buffer is needed however large the region.
+ */
+
+/* Decode, sending to the display if send is set; -EINVAL unless exactly expected bytes */
+static int rle_decode(const uint8_t *rle, size_t len, size_t expected, bool send)
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < len) {
+        uint8_t n = rle[in++];
+        size_t count;
+
+        if (n == 128) {
+            continue;
+        }
+        count = n < 128 ? n + 1 : 257 - n;
+        if (out + count > expected || in + (n < 128 ? count : 1) > len) {
+            return -EINVAL;
+        }
+        out += count;
+
+        if (!send) {
+            in += n < 128 ? count : 1;
+        }
+        else if (n < 128) {
+            while (count--) {
+                EPD_2IN9D_SendData(~rle[in++]);
+            }
+        }
+        else {
+            EPD_2IN9D_SendRepeatedBytePattern(~rle[in++], count);
+        }
+    }
+    return out == expected ? 0 : -EINVAL;
+}
+
+/**
+ * @brief Check that a compressed region fits the display and decodes fully
+ *
+ * @param x, w    Across the 128 pixel side, multiples of 8
+ * @param y, h    Along the 296 pixel side
+ *
+ * @return 0 if epaper_DrawRle() would draw it, -EINVAL otherwise
+ */
+int epaper_CheckRle(const uint8_t *rle, size_t len, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    if ((x | w) & 7 || w == 0 || h == 0 ||
+            x + w > EPD_2IN9D_WIDTH || y + h > EPD_2IN9D_HEIGHT) {
+        LOG_ERR("Region %ux%u at %u,%u out of bounds", w, h, x, y);
+        return -EINVAL;
+    }
+    if (rle_decode(rle, len, (w / 8) * h, false)) {
+        LOG_ERR("Region data doesn't decode to %ux%u", w, h);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * @brief Decode a compressed region straight into the display's partial window
+ *
+ * Wakes the display, refreshes the region with the same refresh-then-prewind
+ * sequence as epaper_BlitBitmap() and powers it back down. Nothing is drawn if
+ * epaper_CheckRle() fails.
+ */
+int epaper_DrawRle(const uint8_t *rle, size_t len, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    int err = epaper_CheckRle(rle, len, x, y, w, h);
+
+    if (err) {
+        return err;
+    }
+
+    EPD_2IN9D_Init();
+    EPD_2IN9D_SetPartReg();
+    for (uint8_t i=0; i<2; i++) {
+        EPD_2IN9D_SendCommand(0x91);
+        EPD_2IN9D_SendPartialAddr(x, y, w, h);
+        EPD_2IN9D_SendCommand(0x13);
+        rle_decode(rle, len, (w / 8) * h, true);
+        EPD_2IN9D_SendCommand(0x92);
+
+        if (i==0) {
+            /* Refresh, then write again to prewind the "last-frame" */
+            EPD_2IN9D_Refresh();
+        }
+    }
+    EPD_2IN9D_PowerOff();
+    return 0;
+}
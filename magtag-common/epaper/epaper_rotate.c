@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "magtag-common/magtag_epaper.h"
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_epaper_rotate, LOG_LEVEL_DBG);
+
+/*
+ * Display RAM is 128 pixels across (16 bytes, MSB is the leftmost pixel, 1 is
+ * white) by 296 rows. Logical bitmaps are row-major for the current
+ * orientation with the MSB leftmost and 1 for black. Rotation works on 8x8
+ * tiles: each logical tile lands on exactly one RAM tile, so a region is
+ * rotated with one transpose (or bit reverse) per tile.
+ */
+#define RAM_TILES_X     (EPD_2IN9D_WIDTH / 8)
+#define RAM_TILES_Y     (EPD_2IN9D_HEIGHT / 8)
+
+static enum epaper_orientation orientation = EPAPER_LANDSCAPE;
+
+static bool is_portrait(void)
+{
+    return orientation == EPAPER_PORTRAIT || orientation == EPAPER_PORTRAIT_FLIPPED;
+}
+
+void epaper_set_orientation(enum epaper_orientation new_orientation)
+{
+    /* Landscape text and frames are drawn without the rotation buffers */
+    if (!IS_ENABLED(CONFIG_MAGTAG_ORIENTATION) && new_orientation != EPAPER_LANDSCAPE) {
+        LOG_WRN("Rotation needs CONFIG_MAGTAG_ORIENTATION");
+        return;
+    }
+    if (new_orientation != orientation) {
+        LOG_INF("Display orientation %d", new_orientation);
+    }
+    orientation = new_orientation;
+}
+
+enum epaper_orientation epaper_get_orientation(void)
+{
+    return orientation;
+}
+
+/* Logical width and height for the current orientation */
+uint16_t epaper_width(void)
+{
+    return is_portrait() ? EPD_2IN9D_WIDTH : EPD_2IN9D_HEIGHT;
+}
+
+uint16_t epaper_height(void)
+{
+    return is_portrait() ? EPD_2IN9D_HEIGHT : EPD_2IN9D_WIDTH;
+}
+
+static uint8_t reverse_bits(uint8_t b)
+{
+    b = (b >> 4) | (b << 4);
+    b = ((b & 0xCC) >> 2) | ((b & 0x33) << 2);
+    b = ((b & 0xAA) >> 1) | ((b & 0x55) << 1);
+    return b;
+}
+
+/**
+ * @brief Transpose an 8x8 bit matrix
+ *
+ * in[] holds rows with the MSB in column 0; out[] holds columns with the MSB
+ * in row 0. Three swap stages on two 32-bit halves (Hacker's Delight 7-3).
+ */
+void epaper_transpose8x8(const uint8_t in[8], uint8_t out[8])
+{
+    uint32_t x = (in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+    uint32_t y = (in[4] << 24) | (in[5] << 16) | (in[6] << 8) | in[7];
+    uint32_t t;
+
+    t = (x ^ (x >> 7)) & 0x00AA00AA;  x = x ^ t ^ (t << 7);
+    t = (y ^ (y >> 7)) & 0x00AA00AA;  y = y ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC; x = x ^ t ^ (t << 14);
+    t = (y ^ (y >> 14)) & 0x0000CCCC; y = y ^ t ^ (t << 14);
+
+    t = (x & 0xF0F0F0F0) | ((y >> 4) & 0x0F0F0F0F);
+    y = ((x << 4) & 0xF0F0F0F0) | (y & 0x0F0F0F0F);
+    x = t;
+
+    out[0] = x >> 24; out[1] = x >> 16; out[2] = x >> 8; out[3] = x;
+    out[4] = y >> 24; out[5] = y >> 16; out[6] = y >> 8; out[7] = y;
+}
+
+#if defined(CONFIG_MAGTAG_ORIENTATION)
+/* Rotated region waiting to be sent, in RAM order */
+static uint8_t ram_buf[RAM_TILES_X * EPD_2IN9D_HEIGHT];
+/* Rendered text line, widest line is 296 pixels of the 32 pixel font */
+static uint8_t text_buf[(EPD_2IN9D_HEIGHT / 8) * 32];
+
+/* RAM tile holding logical tile (tx, ty) */
+static void tile_to_ram(uint8_t tx, uint8_t ty, uint8_t *rx, uint8_t *ry)
+{
+    switch (orientation) {
+    case EPAPER_PORTRAIT:
+        *rx = tx;
+        *ry = ty;
+        break;
+    case EPAPER_PORTRAIT_FLIPPED:
+        *rx = RAM_TILES_X - 1 - tx;
+        *ry = RAM_TILES_Y - 1 - ty;
+        break;
+    case EPAPER_LANDSCAPE_FLIPPED:
+        *rx = RAM_TILES_X - 1 - ty;
+        *ry = tx;
+        break;
+    case EPAPER_LANDSCAPE:
+    default:
+        *rx = ty;
+        *ry = RAM_TILES_Y - 1 - tx;
+        break;
+    }
+}
+
+/* Turn the rows of a logical tile into the rows of its RAM tile, inverted */
+static void tile_rotate(const uint8_t rows[8], uint8_t out[8])
+{
+    uint8_t cols[8];
+
+    switch (orientation) {
+    case EPAPER_PORTRAIT:
+        for (uint8_t j=0; j<8; j++) { out[j] = ~rows[j]; }
+        break;
+    case EPAPER_PORTRAIT_FLIPPED:
+        for (uint8_t j=0; j<8; j++) { out[j] = ~reverse_bits(rows[7-j]); }
+        break;
+    case EPAPER_LANDSCAPE_FLIPPED:
+        epaper_transpose8x8(rows, cols);
+        for (uint8_t j=0; j<8; j++) { out[j] = ~reverse_bits(cols[j]); }
+        break;
+    case EPAPER_LANDSCAPE:
+    default:
+        epaper_transpose8x8(rows, cols);
+        for (uint8_t j=0; j<8; j++) { out[j] = ~cols[7-j]; }
+        break;
+    }
+}
+
+/**
+ * @brief Send a logical bitmap to the display in the current orientation
+ *
+ * The region is rotated into display order in one pass, then sent with the
+ * same refresh-then-prewind sequence as epaper_WriteString(). Call with the
+ * display awake and partial refresh registers set; see epaper_DrawBitmap().
+ *
+ * @param bitmap  Row-major, MSB leftmost, 1 is black
+ * @param stride  Bytes per bitmap row
+ * @param x, y    Top left in logical pixels, multiples of 8
+ * @param w, h    Size in logical pixels, multiples of 8
+ */
+void epaper_BlitBitmap(const uint8_t *bitmap, uint16_t stride, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    if ((x | y | w | h) & 7) {
+        LOG_ERR("Blit region must be 8 pixel aligned");
+        return;
+    }
+    if (w == 0 || h == 0 || x + w > epaper_width() || y + h > epaper_height()) {
+        LOG_ERR("Blit region out of bounds");
+        return;
+    }
+
+    /* RAM tile bounds are set by two opposite corners of the region */
+    uint8_t rx0, ry0, rx1, ry1;
+    tile_to_ram(x/8, y/8, &rx0, &ry0);
+    tile_to_ram((x+w)/8 - 1, (y+h)/8 - 1, &rx1, &ry1);
+    if (rx0 > rx1) { uint8_t t = rx0; rx0 = rx1; rx1 = t; }
+    if (ry0 > ry1) { uint8_t t = ry0; ry0 = ry1; ry1 = t; }
+    uint8_t ram_stride = rx1 - rx0 + 1;
+    uint16_t ram_rows = (ry1 - ry0 + 1) * 8;
+
+    /* Single pass over the dirty region, one tile at a time */
+    for (uint8_t ty=y/8; ty<(y+h)/8; ty++) {
+        for (uint8_t tx=x/8; tx<(x+w)/8; tx++) {
+            uint8_t rows[8];
+            uint8_t out[8];
+            uint8_t rx, ry;
+
+            for (uint8_t i=0; i<8; i++) {
+                rows[i] = bitmap[((ty*8 - y) + i) * stride + (tx - x/8)];
+            }
+            tile_rotate(rows, out);
+            tile_to_ram(tx, ty, &rx, &ry);
+            for (uint8_t j=0; j<8; j++) {
+                ram_buf[((ry - ry0)*8 + j) * ram_stride + (rx - rx0)] = out[j];
+            }
+        }
+    }
+
+    for (uint8_t i=0; i<2; i++) {
+        EPD_2IN9D_SendCommand(0x91);
+        EPD_2IN9D_SendPartialAddr(rx0*8, ry0*8, ram_stride*8, ram_rows);
+        EPD_2IN9D_SendCommand(0x13);
+        for (uint16_t n=0; n<ram_stride*ram_rows; n++) {
+            EPD_2IN9D_SendData(ram_buf[n]);
+        }
+        EPD_2IN9D_SendCommand(0x92);
+
+        if (i==0) {
+            /* Refresh, then write again to prewind the "last-frame" */
+            EPD_2IN9D_Refresh();
+        }
+    }
+}
+
+/**
+ * @brief Wake the display, blit a bitmap and power it back down
+ *
+ * Assets drawn this way are stored once, unrotated (see
+ * utility/xbm_to_header.py --no-rotate), and shown in any orientation.
+ */
+void epaper_DrawBitmap(const uint8_t *bitmap, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    EPD_2IN9D_Init();
+    EPD_2IN9D_SetPartReg();
+    epaper_BlitBitmap(bitmap, w/8, x, y, w, h);
+    EPD_2IN9D_PowerOff();
+}
+
+/* Font columns run right to left, each column is top byte first, MSB on top */
+static void glyph_to_bitmap(uint8_t letter, struct font_meta *font_m, uint16_t x0, uint16_t stride)
+{
+    if ((letter < ' ') || (letter > '~')) { letter = ' '; }
+    letter -= ASCII_OFFSET;
+
+    uint8_t width = font_m->letter_width_bits;
+    uint8_t height_bytes = font_m->letter_height_bytes;
+    const char *glyph = font_m->font_p + (letter * width * height_bytes);
+
+    for (uint8_t col=0; col<width; col++) {
+        const char *column = glyph + (width - 1 - col) * height_bytes;
+        uint16_t x = x0 + col;
+
+        for (uint8_t row=0; row<height_bytes*8; row++) {
+            bool ink = (column[row/8] << (row%8)) & 0x80;
+            if (ink != font_m->inverted) {
+                text_buf[row*stride + x/8] |= 0x80 >> (x%8);
+            }
+        }
+    }
+}
+
+/**
+ * @brief epaper_WriteString() for orientations other than landscape
+ *
+ * Same arguments, with lines and x_left counted in the current orientation:
+ * line is y/8 from the top, x_left counts down from the logical width at the
+ * left edge. The region written is rounded out to whole 8x8 tiles.
+ */
+void epaper_WriteStringRotated(uint8_t *str, uint8_t str_len, uint8_t line, int16_t x_left, struct font_meta *font_m)
+{
+    uint16_t width = epaper_width();
+    uint16_t y = line * 8;
+    uint16_t h = font_m->letter_height_bytes * 8;
+    uint8_t letter_w = font_m->letter_width_bits;
+    uint16_t x;
+    uint8_t char_count;
+
+    if (y + h > epaper_height()) { return; }
+
+    /* Like epaper_WriteString(), too-wide centered text uses the full width */
+    bool full = (x_left == FULL_WIDTH) || (x_left == CENTER && str_len * letter_w >= width);
+    if (full) {
+        char_count = width / letter_w;
+        /* Odd leftover column goes on the left, as in epaper_StringToRam() */
+        x = (width - char_count * letter_w) - (width - char_count * letter_w) / 2;
+    }
+    else if (x_left == CENTER) {
+        char_count = str_len;
+        x = (width - str_len * letter_w) / 2;
+    }
+    else if (x_left < 0) {
+        LOG_ERR("Unrecognized x_left value: %d", x_left);
+        return;
+    }
+    else {
+        x = x_left < width ? width - x_left : 0;
+        char_count = MIN(str_len, (width - x) / letter_w);
+    }
+    if (char_count == 0) { return; }
+
+    uint16_t x0 = full ? 0 : x & ~7;
+    uint16_t x1 = full ? width : ROUND_UP(x + char_count * letter_w, 8);
+    uint16_t stride = (x1 - x0) / 8;
+
+    memset(text_buf, 0, stride * h);
+    for (uint8_t i=0; i<char_count; i++) {
+        glyph_to_bitmap(i < str_len ? str[i] : ' ', font_m, (x - x0) + i * letter_w, stride);
+    }
+
+    epaper_BlitBitmap(text_buf, stride, x0, y, x1 - x0, h);
+}
+#endif /* CONFIG_MAGTAG_ORIENTATION */
+
+/**
+ * @brief Send a full landscape frame (EPD_2IN9D_Display() layout) to RAM
+ *
+ * Flipped landscape is the same frame sent backwards with each byte bit
+ * reversed. Portrait can't fit a landscape frame so it is sent unrotated.
+ */
+void epaper_DisplayFrame(const uint8_t *frame)
+{
+    uint16_t len = RAM_TILES_X * EPD_2IN9D_HEIGHT;
+
+    if (orientation != EPAPER_LANDSCAPE_FLIPPED) {
+        EPD_2IN9D_Display((uint8_t *)frame);
+        return;
+    }
+
+    EPD_2IN9D_SendCommand(0x13);
+    for (uint16_t n=len; n>0; n--) {
+        EPD_2IN9D_SendData(reverse_bits(frame[n-1]));
+    }
+}
@@ -28,6 +28,7 @@
  */
 
 #include "magtag-common/magtag_epaper.h"
+#include "magtag-common/latency.h"
 #include "magtag_epaper_hal.h"
 #include "GoliothLogo.h"
 #include <zephyr/logging/log.h>
@@ -35,6 +36,9 @@ LOG_MODULE_REGISTER(golioth_epaper, LOG_LEVEL_DBG);
 
 bool _display_asleep = true;
 
+static struct epaper_stats refresh_stats;
+static struct k_spinlock stats_lock;
+
 /*
  * Fonts
  */
@@ -228,10 +232,27 @@ parameter:
 ******************************************************************************/
 void EPD_2IN9D_Refresh(void)
 {
+    uint32_t start = k_uptime_get_32();
+
     EPD_2IN9D_SendCommand(0x12); //DISPLAY REFRESH
+    latency_mark(LATENCY_EPD_REFRESH_START);
     DEV_Delay_ms(1); //!!!The delay here is necessary, 200uS at least!!!
 
     EPD_2IN9D_ReadBusy();
+    latency_mark(LATENCY_EPD_REFRESH_DONE);
+
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    refresh_stats.refreshes++;
+    refresh_stats.refresh_ms += k_uptime_get_32() - start;
+    k_spin_unlock(&stats_lock, key);
+}
+
+/* Copy the refresh count and time since boot */
+void epaper_get_stats(struct epaper_stats *stats)
+{
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    *stats = refresh_stats;
+    k_spin_unlock(&stats_lock, key);
 }
 
 /******************************************************************************
@@ -263,10 +284,10 @@ void EPD_2IN9D_SendPartialAddr(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
     EPD_2IN9D_SendData(x); //x-start
     EPD_2IN9D_SendData(x+w - 1); //x-end
 
-    EPD_2IN9D_SendData(0);
-    EPD_2IN9D_SendData(y); //y-start
-    EPD_2IN9D_SendData((y+h) / 256);
-    EPD_2IN9D_SendData((y+h) % 256 - 1); //y-end
+    EPD_2IN9D_SendData(y / 256);
+    EPD_2IN9D_SendData(y % 256); //y-start
+    EPD_2IN9D_SendData((y+h - 1) / 256);
+    EPD_2IN9D_SendData((y+h - 1) % 256); //y-end
     EPD_2IN9D_SendData(0x01);
 }
 
@@ -376,9 +397,9 @@ void epaper_ShowFullFrame(const char *frame) {
         EPD_2IN9D_Init();
         EPD_2IN9D_SetPartReg();
     }
-    EPD_2IN9D_Display((char *)frame);
+    epaper_DisplayFrame(frame);
     EPD_2IN9D_Refresh();
-    EPD_2IN9D_Display((char *)frame);
+    epaper_DisplayFrame(frame);
     EPD_2IN9D_SetPartReg();
     EPD_2IN9D_PowerOff();
 }
@@ -614,6 +635,13 @@ void epaper_WriteString(uint8_t *str,
                         int16_t x_left,
                         struct font_meta *font_m)
 {
+#if defined(CONFIG_MAGTAG_ORIENTATION)
+    if (epaper_get_orientation() != EPAPER_LANDSCAPE) {
+        epaper_WriteStringRotated(str, str_len, line, x_left, font_m);
+        return;
+    }
+#endif
+
     /* Bounding */
     line %= EPD_2IN9D_PAGECNT;
     if (line > (EPD_2IN9D_PAGECNT - font_m->letter_height_bytes)) { return; }
@@ -5,8 +5,48 @@
 
 extern struct device *sensor;
 
+/*
+ * Readings are kept as integers end to end: micro-g from the sensor API,
+ * milli-g from the FIFO. Use accel_fmt_fixed() rather than %f to print them.
+ */
+static inline int32_t accel_ms2_to_ug(const struct sensor_value *v)
+{
+	int64_t micro_ms2 = (int64_t)v->val1 * 1000000 + v->val2;
+
+	return (int32_t)(micro_ms2 * 1000000 / SENSOR_G);
+}
+
+static inline int32_t accel_mg_to_mms2(int32_t mg)
+{
+	return (int32_t)(((int64_t)mg * SENSOR_G) / 1000000);
+}
+
+/* One FIFO sample, see accel_get_samples() */
+struct accel_sample {
+	uint32_t timestamp;	/* k_uptime_get_32() when sampled, estimated */
+	int16_t x;		/* milli-g */
+	int16_t y;
+	int16_t z;
+};
+
+struct accel_fifo_stats {
+	uint32_t batches;	/* FIFO drains */
+	uint32_t samples;
+	uint32_t dropped;	/* overwritten before a consumer read them */
+	uint32_t overruns;	/* FIFO filled before it was drained */
+};
+
 /* prototypes */
 void accelerometer_init(void);
 void fetch_and_display(const struct device *sensor, struct sensor_value accel[3]);
+int accel_fmt_fixed(char *buf, size_t len, int32_t value, uint8_t decimals);
+int accel_fifo_init(struct k_work *work);
+size_t accel_get_samples(struct accel_sample *buf, size_t max);
+uint32_t accel_samples_pending(void);
+uint16_t accel_sample_rate(void);
+uint16_t accel_set_sample_rate(uint16_t hz);
+bool accel_is_moving(void);
+int accel_read_sample(struct accel_sample *sample);
+void accel_fifo_get_stats(struct accel_fifo_stats *stats);
 
 #endif
@@ -0,0 +1,23 @@
+#ifndef __ACCEL_BATCH_H_
+#define __ACCEL_BATCH_H_
+
+#include "magtag-common/accel_stats.h"
+
+/* Largest CBOR encoding of one summary, and of a full batch */
+#define ACCEL_BATCH_ITEM_MAX	170
+#define ACCEL_BATCH_BUF_SIZE	(CONFIG_MAGTAG_ACCEL_BATCH_COUNT * ACCEL_BATCH_ITEM_MAX + 3)
+
+/* Window summaries waiting to go out in one stream push */
+struct accel_batch {
+	struct accel_stats items[CONFIG_MAGTAG_ACCEL_BATCH_COUNT];
+	size_t count;
+	int64_t first_ms;	/* uptime the first item was added */
+};
+
+/* Prototypes */
+int accel_batch_encode(const struct accel_stats *items, size_t n, uint8_t *buf, size_t len);
+bool accel_batch_add(struct accel_batch *batch, const struct accel_stats *stats);
+k_timeout_t accel_batch_timeout(const struct accel_batch *batch);
+bool accel_batch_ready(const struct accel_batch *batch);
+
+#endif
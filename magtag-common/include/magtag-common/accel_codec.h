@@ -0,0 +1,29 @@
+#ifndef __ACCEL_CODEC_H_
+#define __ACCEL_CODEC_H_
+
+#include "magtag-common/accel.h"
+
+/*
+ * Compact encoding of a run of accelerometer samples:
+ *
+ *   varint  sample count
+ *   varint  scale, milli-g per encoded unit (1 is lossless)
+ *   varint  timestamp of the first sample (ms)
+ *   zigzag  x, y, z of the first sample, in scale units
+ *   then for every following sample:
+ *   varint  ms since the previous sample
+ *   zigzag  change in x, y, z since the previous sample, in scale units
+ *
+ * Varints are LEB128, 7 bits per byte with the low bits first. Zigzag maps
+ * 0, -1, 1, -2... to 0, 1, 2, 3... before the varint step. utility/
+ * accel_decode.py turns this back into samples.
+ */
+
+/* Worst case encoded size of n samples */
+#define ACCEL_CODEC_MAX_BYTES(n)	(3 * 5 + (n) * (5 + 3 * 3))
+
+/* Prototypes */
+int accel_codec_encode(const struct accel_sample *samples, size_t n, uint16_t scale,
+		uint8_t *buf, size_t len);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __ACCEL_RATE_H_
+#define __ACCEL_RATE_H_
+
+#include "magtag-common/accel_stats.h"
+
+/*
+ * Sample rate and still report interval, adapted to how much is going on.
+ * Bounds may be changed at any time, e.g. from a settings callback.
+ */
+struct accel_rate {
+	uint16_t min_hz;
+	uint16_t max_hz;
+	uint32_t min_interval_s;	/* still report interval bounds */
+	uint32_t max_interval_s;
+	uint32_t threshold;		/* variance counted as activity, milli-g squared */
+	uint16_t hz;
+	uint32_t interval_s;
+};
+
+/* Prototypes */
+void accel_rate_init(struct accel_rate *rate);
+uint16_t accel_rate_window(struct accel_rate *rate, const struct accel_stats *window);
+uint32_t accel_rate_interval(struct accel_rate *rate);
+void accel_rate_still(struct accel_rate *rate);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef __ACCEL_STATS_H_
+#define __ACCEL_STATS_H_
+
+#include "magtag-common/accel.h"
+
+/* Summary of one axis over a window, all in milli-g */
+struct accel_axis_stats {
+	int32_t mean;
+	uint32_t variance;	/* milli-g squared */
+	uint32_t rms;
+	int16_t min;
+	int16_t max;
+};
+
+/* Summary of one window of samples */
+struct accel_stats {
+	uint32_t start;		/* timestamp of the first sample */
+	uint32_t duration_ms;	/* first to last sample */
+	uint32_t count;
+	struct accel_axis_stats axis[3];	/* x, y, z */
+	uint32_t peak;		/* largest magnitude seen, milli-g */
+};
+
+/* Running totals, exact integers so nothing is lost however long the window */
+struct accel_stats_acc {
+	uint32_t start;
+	uint32_t last;
+	uint32_t count;
+	int64_t sum[3];
+	uint64_t sum_sq[3];
+	int16_t min[3];
+	int16_t max[3];
+	uint32_t peak_sq;
+};
+
+/* Prototypes */
+void accel_stats_reset(struct accel_stats_acc *acc);
+void accel_stats_add(struct accel_stats_acc *acc, const struct accel_sample *s);
+void accel_stats_finish(const struct accel_stats_acc *acc, struct accel_stats *out);
+bool accel_stats_feed(struct accel_stats_acc *acc, const struct accel_sample *s,
+		uint32_t window_ms, struct accel_stats *out);
+int accel_stats_json(const struct accel_stats *stats, char *buf, size_t len);
+
+#endif
@@ -1,21 +1,37 @@
 #ifndef _BUTTONS_H_
 #define _BUTTONS_H_
 
-#include <zephyr/device.h>
-#include <zephyr/drivers/gpio.h>
+#include <zephyr/kernel.h>
 
-/* Buttons */
-#define SW0_NODE	DT_ALIAS(sw0)
-#define SW1_NODE	DT_ALIAS(sw1)
-#define SW2_NODE	DT_ALIAS(sw2)
-#define SW3_NODE	DT_ALIAS(sw3)
-static const struct gpio_dt_spec button0 = GPIO_DT_SPEC_GET(SW0_NODE, gpios);
-static const struct gpio_dt_spec button1 = GPIO_DT_SPEC_GET(SW1_NODE, gpios);
-static const struct gpio_dt_spec button2 = GPIO_DT_SPEC_GET(SW2_NODE, gpios);
-static const struct gpio_dt_spec button3 = GPIO_DT_SPEC_GET(SW3_NODE, gpios);
-static struct gpio_callback button_cb_data;
+/* Buttons A..D, in sw0..sw3 devicetree alias order */
+#define BUTTONS_NUM	4
+
+enum button_event_type {
+	BUTTON_EVT_PRESS,	/* debounced press */
+	BUTTON_EVT_RELEASE,	/* debounced release */
+	BUTTON_EVT_LONG,	/* held for MAGTAG_BUTTONS_LONG_PRESS_MS */
+	BUTTON_EVT_DOUBLE,	/* pressed again within MAGTAG_BUTTONS_DOUBLE_PRESS_MS */
+	BUTTON_EVT_CHORD,	/* pressed while other buttons are held */
+};
+
+struct button_event {
+	uint32_t timestamp;	/* k_uptime_get_32() of the first edge */
+	uint32_t cycles;	/* k_cycle_get_32() of the first edge, for latency */
+	uint8_t type;		/* enum button_event_type */
+	uint8_t button;		/* 0..3 for A..D */
+	uint8_t buttons;	/* bitmask of buttons held, for chords */
+};
+
+struct button_event_stats {
+	uint32_t queued;
+	uint32_t dropped;	/* lost because the ring was full */
+	uint32_t high_water;	/* most events waiting at once */
+};
 
 /* Prototypes */
-void buttons_init(gpio_callback_handler_t handler);
+void buttons_init(struct k_work *work);
+int buttons_get_event(struct button_event *evt, k_timeout_t timeout);
+uint32_t buttons_events_pending(void);
+void buttons_get_stats(struct button_event_stats *stats);
 
 #endif
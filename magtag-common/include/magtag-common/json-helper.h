@@ -1,28 +1,34 @@
 #ifndef __JSON_HELPER_H_
 #define __JSON_HELPER_H_
 
-#include <data/json.h>
+#include <zephyr/data/json.h>
+#include <net/golioth/system_client.h>
 
+#define LED_SETTINGS_NUM	4
+/* Large enough for all four "#rrggbb" colors and states */
+#define LED_SETTINGS_JSON_LEN	192
+
+/*
+ * Whole LED state as one JSON document. Colors are any name or "#rrggbb"
+ * string accepted by color_from_name(), states are 0 (off) or 1 (on).
+ */
 struct led_settings {
 	const char *led0_color;
-	int8_t led0_state;
+	int32_t led0_state;
 	const char *led1_color;
-	int8_t led1_state;
+	int32_t led1_state;
 	const char *led2_color;
-	int8_t led2_state;
+	int32_t led2_state;
 	const char *led3_color;
-	int8_t led3_state;
+	int32_t led3_state;
 };
 
-static const struct json_obj_descr led_settings_descr[] = {
-	JSON_OBJ_DESCR_PRIM(struct led_settings, led0_color, JSON_TOK_STRING),
-	JSON_OBJ_DESCR_PRIM(struct led_settings, led0_state, JSON_TOK_NUMBER),
-	JSON_OBJ_DESCR_PRIM(struct led_settings, led1_color, JSON_TOK_STRING),
-	JSON_OBJ_DESCR_PRIM(struct led_settings, led1_state, JSON_TOK_NUMBER),
-	JSON_OBJ_DESCR_PRIM(struct led_settings, led2_color, JSON_TOK_STRING),
-	JSON_OBJ_DESCR_PRIM(struct led_settings, led2_state, JSON_TOK_NUMBER),
-	JSON_OBJ_DESCR_PRIM(struct led_settings, led3_color, JSON_TOK_STRING),
-	JSON_OBJ_DESCR_PRIM(struct led_settings, led3_state, JSON_TOK_NUMBER)
-};
+/* Prototypes */
+int led_settings_parse(char *json, size_t len, struct led_settings *settings);
+int led_settings_apply(const struct led_settings *settings, uint32_t fields);
+int led_settings_apply_json(char *json, size_t len);
+int led_settings_encode(char *buf, size_t len);
+int led_settings_sync(struct golioth_client *client, const char *path,
+		golioth_req_cb_t cb, void *user_data);
 
 #endif
@@ -0,0 +1,32 @@
+#ifndef __LATENCY_H_
+#define __LATENCY_H_
+
+#include <zephyr/kernel.h>
+
+/* Points along the input -> visible result path */
+enum latency_stage {
+	LATENCY_LED_BLIT,		/* LED frame sent to the strip */
+	LATENCY_EPD_REFRESH_START,	/* ePaper refresh command issued */
+	LATENCY_EPD_REFRESH_DONE,	/* ePaper no longer busy */
+	LATENCY_LIGHTDB_ACK,		/* LightDB State write acknowledged */
+	LATENCY_STAGE_COUNT
+};
+
+#ifdef CONFIG_MAGTAG_LATENCY
+
+/* Prototypes */
+void latency_begin(uint32_t origin_cycles, uint32_t stages);
+void latency_mark(enum latency_stage stage);
+void latency_record(enum latency_stage stage, uint32_t origin_cycles);
+void latency_reset(void);
+
+#else
+
+static inline void latency_begin(uint32_t origin_cycles, uint32_t stages) {}
+static inline void latency_mark(enum latency_stage stage) {}
+static inline void latency_record(enum latency_stage stage, uint32_t origin_cycles) {}
+static inline void latency_reset(void) {}
+
+#endif /* CONFIG_MAGTAG_LATENCY */
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef __LIGHTDB_COALESCE_H_
+#define __LIGHTDB_COALESCE_H_
+
+#include <zephyr/kernel.h>
+#include <net/golioth/system_client.h>
+
+/* Writes that may be waiting for their response at the same time */
+#define LIGHTDB_COALESCE_IN_FLIGHT	4
+
+struct lightdb_coalesce;
+
+/* A write waiting for its response, and the user_data of the burst it carries */
+struct lightdb_coalesce_req {
+	struct lightdb_coalesce *c;
+	void *user_data;
+	atomic_t busy;
+};
+
+/*
+ * One LightDB State document written at most once per burst of changes.
+ * encode() is called at flush time, so the latest state always wins.
+ */
+struct lightdb_coalesce {
+	struct golioth_client *client;
+	const char *path;
+	int (*encode)(char *buf, size_t len);
+	golioth_req_cb_t cb;
+	struct k_work_delayable work;
+	struct k_spinlock lock;
+	bool pending;
+	int64_t first_ms;	/* uptime of the first change since the last write */
+	void *user_data;	/* passed with the first change, given to cb */
+	struct lightdb_coalesce_req reqs[LIGHTDB_COALESCE_IN_FLIGHT];
+};
+
+/* Prototypes */
+void lightdb_coalesce_init(struct lightdb_coalesce *c, struct golioth_client *client,
+		const char *path, int (*encode)(char *buf, size_t len), golioth_req_cb_t cb);
+void lightdb_coalesce_mark(struct lightdb_coalesce *c, void *user_data);
+
+#endif
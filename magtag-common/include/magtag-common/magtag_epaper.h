@@ -9,6 +9,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 // Display resolution
 #define EPD_2IN9D_WIDTH   128
@@ -22,6 +23,23 @@
 #define FULL_WIDTH  -1
 #define CENTER      -2
 
+/*
+ * Orientations, named for the view. The landscape view has buttons along the
+ * bottom edge; portrait has the landscape right edge at the top.
+ */
+enum epaper_orientation {
+    EPAPER_LANDSCAPE,           /* 296x128, the native text orientation */
+    EPAPER_PORTRAIT,            /* 128x296, turned 90 degrees counter-clockwise */
+    EPAPER_LANDSCAPE_FLIPPED,   /* 296x128, turned 180 degrees */
+    EPAPER_PORTRAIT_FLIPPED,    /* 128x296, turned 90 degrees clockwise */
+};
+
+/* Display refreshes since boot */
+struct epaper_stats {
+    uint32_t refreshes;
+    uint32_t refresh_ms;    /* total time spent waiting for refreshes to finish */
+};
+
 /*
  * Fonts
  */
@@ -39,6 +57,7 @@ void EPD_2IN9D_SendData(uint8_t Data);
 void EPD_2IN9D_ReadBusy(void);
 void EPD_2IN9D_SetPartReg(void);
 void EPD_2IN9D_Refresh(void);
+void epaper_get_stats(struct epaper_stats *stats);
 void EPD_2IN9D_Init(void);
 void EPD_2IN9D_SendRepeatedBytePattern(uint8_t byte_pattern, uint16_t how_many);
 void EPD_2IN9D_SendPartialAddr(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
@@ -69,5 +88,19 @@ void epaper_WriteLargeLine(uint8_t *str, uint8_t str_len, uint8_t line);
 void epaper_WriteLargeLetter(uint8_t letter, uint16_t x, uint8_t line);
 void epaper_autowrite(uint8_t *str, uint8_t str_len);
 
+void epaper_set_orientation(enum epaper_orientation orientation);
+enum epaper_orientation epaper_get_orientation(void);
+uint16_t epaper_width(void);
+uint16_t epaper_height(void);
+void epaper_transpose8x8(const uint8_t in[8], uint8_t out[8]);
+/* Only built with CONFIG_MAGTAG_ORIENTATION */
+void epaper_BlitBitmap(const uint8_t *bitmap, uint16_t stride, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+void epaper_DrawBitmap(const uint8_t *bitmap, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+void epaper_WriteStringRotated(uint8_t *str, uint8_t str_len, uint8_t line, int16_t x_left, struct font_meta *font_m);
+
+void epaper_DisplayFrame(const uint8_t *frame);
+int epaper_CheckRle(const uint8_t *rle, size_t len, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+int epaper_DrawRle(const uint8_t *rle, size_t len, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
 #endif
 
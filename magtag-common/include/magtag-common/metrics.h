@@ -0,0 +1,14 @@
+#ifndef __METRICS_H_
+#define __METRICS_H_
+
+#include <zephyr/kernel.h>
+#include <net/golioth/system_client.h>
+
+/* LightDB Stream path the health records are pushed to */
+#define METRICS_PATH	"metrics"
+
+/* Prototypes */
+int metrics_init(struct golioth_client *client);
+int metrics_encode(uint8_t *buf, size_t len);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef __ORIENTATION_H_
+#define __ORIENTATION_H_
+
+#include "magtag-common/accel.h"
+#include "magtag-common/magtag_epaper.h"
+
+/* Prototypes */
+void orientation_init(struct k_work *work);
+void orientation_update(const struct accel_sample *s);
+enum epaper_orientation orientation_get(void);
+
+#endif
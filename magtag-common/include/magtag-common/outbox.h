@@ -0,0 +1,38 @@
+#ifndef __OUTBOX_H_
+#define __OUTBOX_H_
+
+#include <net/golioth/system_client.h>
+
+/* Cloud writes that could not be sent yet */
+enum outbox_kind {
+	OUTBOX_STREAM,		/* LightDB Stream, every record is kept in order */
+	OUTBOX_LIGHTDB,		/* LightDB State, only the latest value per path */
+};
+
+#define OUTBOX_PATH_MAX		32
+
+#ifdef CONFIG_MAGTAG_OUTBOX
+
+/* Prototypes */
+int outbox_init(void);
+int outbox_put(enum outbox_kind kind, const char *path,
+		enum golioth_content_format format, const uint8_t *data, size_t len);
+int outbox_flush(struct golioth_client *client);
+uint32_t outbox_pending(void);
+uint32_t outbox_rejected(void);
+
+#else
+
+static inline int outbox_init(void) { return 0; }
+static inline int outbox_put(enum outbox_kind kind, const char *path,
+		enum golioth_content_format format, const uint8_t *data, size_t len)
+{
+	return -ENOTSUP;
+}
+static inline int outbox_flush(struct golioth_client *client) { return 0; }
+static inline uint32_t outbox_pending(void) { return 0; }
+static inline uint32_t outbox_rejected(void) { return 0; }
+
+#endif /* CONFIG_MAGTAG_OUTBOX */
+
+#endif
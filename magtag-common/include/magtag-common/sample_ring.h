@@ -0,0 +1,67 @@
+#ifndef __SAMPLE_RING_H_
+#define __SAMPLE_RING_H_
+
+#include <zephyr/kernel.h>
+
+/* What to do with a new record when the ring is full */
+enum sample_ring_policy {
+	SAMPLE_RING_OVERWRITE,		/* drop the oldest record */
+	SAMPLE_RING_BACKPRESSURE,	/* refuse the new record with -ENOBUFS */
+};
+
+struct sample_ring_stats {
+	uint32_t used;		/* records buffered now */
+	uint32_t capacity;
+	uint32_t high_water;	/* most records ever buffered at once */
+	uint32_t pushed;
+	uint32_t drained;
+	uint32_t overwritten;
+	uint32_t rejected;
+};
+
+/* Each record is a uptime timestamp followed by record_size bytes of data */
+struct sample_ring {
+	uint8_t *buf;
+	size_t record_size;
+	uint32_t capacity;
+	enum sample_ring_policy policy;
+	uint32_t head;		/* sequence number of the next record written */
+	uint32_t tail;		/* sequence number of the oldest record */
+	struct k_spinlock lock;
+	struct sample_ring_stats stats;
+};
+
+#ifdef CONFIG_MAGTAG_SAMPLE_RING_PSRAM
+#define SAMPLE_RING_SECTION	__attribute__((section(".ext_ram.bss")))
+#else
+#define SAMPLE_RING_SECTION
+#endif
+
+#define SAMPLE_RING_SLOT(size)	(sizeof(uint32_t) + ROUND_UP(size, 4))
+
+/**
+ * @brief Statically define a ring of count records of size bytes
+ *
+ * With CONFIG_MAGTAG_SAMPLE_RING_PSRAM the storage is placed in external RAM.
+ */
+#define SAMPLE_RING_DEFINE(name, size, count, pol)				\
+	static uint8_t name##_buf[SAMPLE_RING_SLOT(size) * (count)]		\
+		SAMPLE_RING_SECTION __aligned(4);				\
+	struct sample_ring name = {						\
+		.buf = name##_buf,						\
+		.record_size = (size),						\
+		.capacity = (count),						\
+		.policy = (pol),						\
+		.stats = { .capacity = (count) },				\
+	}
+
+/* Prototypes */
+int sample_ring_put(struct sample_ring *ring, uint32_t timestamp, const void *data);
+size_t sample_ring_peek(struct sample_ring *ring, uint32_t *seq,
+		uint32_t *timestamps, void *data, size_t max);
+void sample_ring_consume(struct sample_ring *ring, uint32_t seq);
+void sample_ring_set_policy(struct sample_ring *ring, enum sample_ring_policy policy);
+uint32_t sample_ring_used(struct sample_ring *ring);
+void sample_ring_get_stats(struct sample_ring *ring, struct sample_ring_stats *stats);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef __STARTUP_H_
+#define __STARTUP_H_
+
+#include <zephyr/kernel.h>
+#include <net/golioth/system_client.h>
+
+/*
+ * Offline-first bring-up. Slow local steps run on the startup thread while
+ * main carries on, the network comes up on its own thread, and cloud work
+ * waits for the first connection instead of holding up the hardware.
+ */
+
+/* Prototypes */
+int startup_run(void (*fn)(void));
+int startup_wait_local(k_timeout_t timeout);
+void startup_network(struct golioth_client *client,
+		void (*on_connect)(struct golioth_client *client));
+bool startup_is_connected(void);
+int startup_wait_connected(k_timeout_t timeout);
+int startup_when_connected(struct k_work *work);
+
+#endif
@@ -12,12 +12,16 @@
 #define STRIP_NUM_PIXELS	DT_PROP(DT_ALIAS(led_strip), chain_length)
 #define RGB(_r, _g, _b) { .r = (_r), .g = (_g), .b = (_b) }
 
+/*
+ * Palette of full-scale colors. Output level is set globally by
+ * ws2812_set_brightness() and gamma corrected when blitting.
+ */
 static const struct led_rgb colors[] = {
 	RGB(0x00, 0x00, 0x00), /* off */
-	RGB(0x0F, 0x00, 0x00), /* red */
-	RGB(0x00, 0x0F, 0x00), /* green */
-	RGB(0x00, 0x00, 0x0F), /* blue */
-	RGB(0x08, 0x08, 0x00), /* yellow */
+	RGB(0xFF, 0x00, 0x00), /* red */
+	RGB(0x00, 0xFF, 0x00), /* green */
+	RGB(0x00, 0x00, 0xFF), /* blue */
+	RGB(0xC0, 0xC0, 0x00), /* yellow */
 };
 
 /* Color name definitions match colors[] index */
@@ -27,22 +31,65 @@ static const struct led_rgb colors[] = {
 #define BLUE	3
 #define YELLOW	4
 
+/* Hue, saturation and value, each scaled to 0..255 */
+struct led_hsv {
+	uint8_t h;
+	uint8_t s;
+	uint8_t v;
+};
+
 struct led_color_state {
-  uint8_t color;
+  struct led_rgb color;
   int8_t state;  
 };
 
 extern struct led_color_state led_states[STRIP_NUM_PIXELS];
 
+/* Animations run per pixel and override led_states until stopped */
+enum led_anim_type {
+	LED_ANIM_SOLID,		/* hold color_a */
+	LED_ANIM_FADE,		/* one-shot color_a -> color_b, then hold color_b */
+	LED_ANIM_BREATHE,	/* smooth color_a <-> color_b */
+	LED_ANIM_BLINK,		/* square wave color_a/color_b */
+	LED_ANIM_CHASE,		/* color_a for 1/STRIP_NUM_PIXELS of period */
+};
+
+struct led_anim {
+	enum led_anim_type type;
+	struct led_rgb color_a;
+	struct led_rgb color_b;
+	uint16_t period_ms;
+	uint16_t phase_ms;
+};
+
+/* Canned animations for device status */
+enum led_status {
+	LED_STATUS_NONE,
+	LED_STATUS_CONNECTING,
+	LED_STATUS_STREAMING,
+	LED_STATUS_ERROR,
+};
+
 extern struct led_rgb pixels[STRIP_NUM_PIXELS];
 static const struct device *const strip = DEVICE_DT_GET(STRIP_NODE);
 
 /* ws2812 prototypes*/
 void clear_pixels(void);
-void set_pixel(struct led_color_state *states, uint8_t pixel_n, uint8_t color_n, int8_t state);
+void set_pixel(struct led_color_state *states, uint8_t pixel_n, struct led_rgb color, int8_t state);
 void ws2812_blit(const struct device *dev, struct led_color_state *states, uint8_t pix_count);
 void ws2812_init(void);
+void ws2812_set_brightness(uint8_t brightness);
+uint8_t ws2812_get_brightness(void);
+int64_t ws2812_rail_on_time_ms(void);
+struct led_rgb hsv_to_rgb(struct led_hsv hsv);
+struct led_hsv rgb_to_hsv(struct led_rgb rgb);
 void leds_immediate(uint8_t led3, uint8_t led2, uint8_t led1, uint8_t led0);
 void set_leds(uint8_t led_num, const char * l_color, int8_t l_state);
+int color_from_name(const char *name, struct led_rgb *rgb);
+void ws2812_anim_start(uint8_t pixel_n, const struct led_anim *anim);
+void ws2812_anim_chase(struct led_rgb color_a, struct led_rgb color_b, uint16_t period_ms);
+void ws2812_anim_stop(uint8_t pixel_n);
+void ws2812_anim_stop_all(void);
+void ws2812_status(enum led_status status);
 
 #endif
@@ -0,0 +1,169 @@
+#include "magtag-common/latency.h"
+#include <zephyr/shell/shell.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_latency, LOG_LEVEL_DBG);
+
+/*
+ * Bucket n counts latencies in [2^n, 2^(n+1)) us, the last bucket also
+ * holds everything longer. Latencies are measured with the 32-bit cycle
+ * counter so must be shorter than one counter wrap (~17 s at 240 MHz).
+ */
+#define LATENCY_BUCKETS	24
+
+/* A stage not reached this long after its input is no longer waited for */
+#define LATENCY_PENDING_MAX_MS	5000
+
+struct latency_hist {
+	uint32_t count;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint64_t sum_us;
+	uint32_t buckets[LATENCY_BUCKETS];
+};
+
+static const char *const stage_names[LATENCY_STAGE_COUNT] = {
+	"led_blit",
+	"epd_refresh_start",
+	"epd_refresh_done",
+	"lightdb_ack",
+};
+
+static struct latency_hist hists[LATENCY_STAGE_COUNT];
+static struct k_spinlock latency_lock;
+/* Cycle stamp of the input being tracked, and stages not yet seen for it */
+static uint32_t origin;
+static uint32_t pending;
+
+/* Call with latency_lock held */
+static void hist_add(enum latency_stage stage, uint32_t cycles)
+{
+	struct latency_hist *h = &hists[stage];
+	uint32_t us = k_cyc_to_us_floor32(cycles);
+	uint8_t bucket = 0;
+
+	if (us > 1) {
+		bucket = MIN(31 - __builtin_clz(us), LATENCY_BUCKETS - 1);
+	}
+
+	if (h->count == 0 || us < h->min_us) {
+		h->min_us = us;
+	}
+	if (us > h->max_us) {
+		h->max_us = us;
+	}
+	h->count++;
+	h->sum_us += us;
+	h->buckets[bucket]++;
+}
+
+/**
+ * @brief Start tracking a new input
+ *
+ * Following latency_mark() calls for the given stages measure from this
+ * input's timestamp, for up to LATENCY_PENDING_MAX_MS.
+ *
+ * @param origin_cycles k_cycle_get_32() when the input happened, e.g. the
+ *                      cycles field of a button_event
+ * @param stages        BIT() of each latency_stage this input leads to
+ */
+void latency_begin(uint32_t origin_cycles, uint32_t stages)
+{
+	k_spinlock_key_t key = k_spin_lock(&latency_lock);
+	origin = origin_cycles;
+	pending = stages & BIT_MASK(LATENCY_STAGE_COUNT);
+	k_spin_unlock(&latency_lock, key);
+}
+
+/**
+ * @brief Record the first time a stage is reached for the current input
+ *
+ * Cheap enough to leave in hot paths: does nothing once the stage has been
+ * recorded or when no input is being tracked.
+ */
+void latency_mark(enum latency_stage stage)
+{
+	uint32_t now = k_cycle_get_32();
+
+	k_spinlock_key_t key = k_spin_lock(&latency_lock);
+	if (pending && now - origin > k_ms_to_cyc_ceil32(LATENCY_PENDING_MAX_MS)) {
+		/* Whatever comes now was not caused by that input */
+		pending = 0;
+	}
+	if (pending & BIT(stage)) {
+		pending &= ~BIT(stage);
+		hist_add(stage, now - origin);
+	}
+	k_spin_unlock(&latency_lock, key);
+}
+
+/**
+ * @brief Record a stage against an explicit origin
+ *
+ * For asynchronous completions (e.g. a LightDB ack) that may arrive after
+ * the next input has started.
+ */
+void latency_record(enum latency_stage stage, uint32_t origin_cycles)
+{
+	uint32_t now = k_cycle_get_32();
+
+	k_spinlock_key_t key = k_spin_lock(&latency_lock);
+	hist_add(stage, now - origin_cycles);
+	k_spin_unlock(&latency_lock, key);
+}
+
+void latency_reset(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&latency_lock);
+	memset(hists, 0, sizeof(hists));
+	pending = 0;
+	k_spin_unlock(&latency_lock, key);
+}
+
+#if defined(CONFIG_SHELL)
+
+static int cmd_latency_show(const struct shell *sh, size_t argc, char **argv)
+{
+	struct latency_hist h;
+
+	for (uint8_t s=0; s<LATENCY_STAGE_COUNT; s++) {
+		k_spinlock_key_t key = k_spin_lock(&latency_lock);
+		h = hists[s];
+		k_spin_unlock(&latency_lock, key);
+
+		if (h.count == 0) {
+			shell_print(sh, "%s: no samples", stage_names[s]);
+			continue;
+		}
+
+		shell_print(sh, "%s: n=%u min=%u us avg=%u us max=%u us",
+				stage_names[s], h.count, h.min_us,
+				(uint32_t)(h.sum_us / h.count), h.max_us);
+		for (uint8_t b=0; b<LATENCY_BUCKETS; b++) {
+			if (h.buckets[b] == 0) {
+				continue;
+			}
+			shell_print(sh, "  %8u us%s %u",
+					b ? (uint32_t)BIT(b) : 0,
+					b == LATENCY_BUCKETS - 1 ? "+ " : " -",
+					h.buckets[b]);
+		}
+	}
+	return 0;
+}
+
+static int cmd_latency_reset(const struct shell *sh, size_t argc, char **argv)
+{
+	latency_reset();
+	shell_print(sh, "Latency histograms cleared");
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_latency,
+	SHELL_CMD(show, NULL, "Show input latency histograms", cmd_latency_show),
+	SHELL_CMD(reset, NULL, "Clear input latency histograms", cmd_latency_reset),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(latency, &sub_latency, "Input latency measurement", NULL);
+
+#endif /* CONFIG_SHELL */
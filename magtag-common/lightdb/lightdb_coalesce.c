@@ -0,0 +1,141 @@
+#include "magtag-common/lightdb_coalesce.h"
+#include "magtag-common/outbox.h"
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_lightdb_coalesce, LOG_LEVEL_DBG);
+
+/*
+ * A change waits until no other change has come in for
+ * MAGTAG_LIGHTDB_COALESCE_MS, but never longer than
+ * MAGTAG_LIGHTDB_COALESCE_MAX_MS after the first one, so a steady stream of
+ * changes still gets written out regularly.
+ */
+
+#define DOC_MAX_LEN	256
+
+/* Keep the latest document for later, when the write can't go out now */
+static void store(struct lightdb_coalesce *c, const char *doc)
+{
+	int err = outbox_put(OUTBOX_LIGHTDB, c->path, GOLIOTH_CONTENT_FORMAT_APP_JSON,
+			doc, strlen(doc));
+
+	if (err && err != -ENOTSUP) {
+		LOG_WRN("Failed to store %s: %d", c->path, err);
+	}
+}
+
+static struct lightdb_coalesce_req *req_get(struct lightdb_coalesce *c)
+{
+	for (size_t i=0; i<ARRAY_SIZE(c->reqs); i++) {
+		if (atomic_cas(&c->reqs[i].busy, 0, 1)) {
+			c->reqs[i].c = c;
+			return &c->reqs[i];
+		}
+	}
+	return NULL;
+}
+
+static void req_put(struct lightdb_coalesce_req *req)
+{
+	atomic_clear(&req->busy);
+}
+
+static int coalesce_rsp(struct golioth_req_rsp *rsp)
+{
+	struct lightdb_coalesce_req *req = rsp->user_data;
+	struct lightdb_coalesce *c = req->c;
+
+	if (rsp->err) {
+		char doc[DOC_MAX_LEN];
+
+		if (c->encode(doc, sizeof(doc)) == 0) {
+			store(c, doc);
+		}
+	}
+
+	/* Acks may come back out of order, each carries its own burst's user_data */
+	rsp->user_data = req->user_data;
+	req_put(req);
+	return c->cb ? c->cb(rsp) : 0;
+}
+
+static void coalesce_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct lightdb_coalesce *c = CONTAINER_OF(dwork, struct lightdb_coalesce, work);
+	struct lightdb_coalesce_req *req = req_get(c);
+	char doc[DOC_MAX_LEN];
+
+	if (req == NULL) {
+		/* Every earlier write is still waiting for its response */
+		k_work_schedule(&c->work, K_MSEC(CONFIG_MAGTAG_LIGHTDB_COALESCE_MS));
+		return;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&c->lock);
+	c->pending = false;
+	req->user_data = c->user_data;
+	k_spin_unlock(&c->lock, key);
+
+	int err = c->encode(doc, sizeof(doc));
+	if (err) {
+		LOG_ERR("Failed to encode %s: %d", c->path, err);
+		req_put(req);
+		return;
+	}
+
+	err = -ENOTCONN;
+	if (golioth_is_connected(c->client)) {
+		err = golioth_lightdb_set_cb(c->client, c->path,
+				GOLIOTH_CONTENT_FORMAT_APP_JSON,
+				doc, strlen(doc),
+				coalesce_rsp, req);
+	}
+	if (err) {
+		req_put(req);
+		LOG_WRN("Failed to update %s: %d", c->path, err);
+		store(c, doc);
+	}
+}
+
+/**
+ * @brief Set up a coalesced writer for one LightDB State path
+ *
+ * @param encode writes the whole current document as a JSON string
+ * @param cb     called with each write's response, may be NULL
+ */
+void lightdb_coalesce_init(struct lightdb_coalesce *c, struct golioth_client *client,
+		const char *path, int (*encode)(char *buf, size_t len), golioth_req_cb_t cb)
+{
+	c->client = client;
+	c->path = path;
+	c->encode = encode;
+	c->cb = cb;
+	c->pending = false;
+	for (size_t i=0; i<ARRAY_SIZE(c->reqs); i++) {
+		atomic_clear(&c->reqs[i].busy);
+	}
+	k_work_init_delayable(&c->work, coalesce_work_handler);
+}
+
+/**
+ * @brief Note that the document changed, it will be written soon
+ *
+ * @param user_data handed to cb in rsp->user_data; only the value given with
+ *                  the first change of a burst is kept
+ */
+void lightdb_coalesce_mark(struct lightdb_coalesce *c, void *user_data)
+{
+	int64_t now = k_uptime_get();
+
+	k_spinlock_key_t key = k_spin_lock(&c->lock);
+	if (!c->pending) {
+		c->pending = true;
+		c->first_ms = now;
+		c->user_data = user_data;
+	}
+	int64_t left = c->first_ms + CONFIG_MAGTAG_LIGHTDB_COALESCE_MAX_MS - now;
+	k_spin_unlock(&c->lock, key);
+
+	k_work_reschedule(&c->work,
+			K_MSEC(CLAMP(left, 0, CONFIG_MAGTAG_LIGHTDB_COALESCE_MS)));
+}
@@ -0,0 +1,277 @@
+#include "magtag-common/metrics.h"
+#include "magtag-common/magtag_epaper.h"
+#include "magtag-common/outbox.h"
+#include "magtag-common/ws2812_control.h"
+#include <qcbor/qcbor.h>
+#include <zephyr/net/net_if.h>
+#include <zephyr/net/net_mgmt.h>
+#include <zephyr/net/net_event.h>
+#include <zephyr/sys/sys_heap.h>
+#if defined(CONFIG_MBEDTLS_ENABLE_HEAP)
+#include <mbedtls/memory_buffer_alloc.h>
+#endif
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_metrics, LOG_LEVEL_DBG);
+
+/*
+ * Every MAGTAG_METRICS_PERIOD_S one CBOR map goes to LightDB Stream:
+ *
+ *   up        uptime, ms
+ *   heap      k_malloc() heap: free, used and most ever used bytes
+ *   libc      malloc() arena size (the minimal libc keeps no usage figures)
+ *   tls       mbedTLS heap: used and most ever used bytes, blocks in use
+ *   stack     per thread name: stack size and fewest free bytes seen
+ *   wq_us     time a work item waited on the system workqueue
+ *   epd       display refreshes and total refresh time, ms
+ *   led_ms    time the LED power rail has been on
+ *   radio_ms  time a network interface has been up
+ *
+ * Times and counts are totals since boot, so lost records lose nothing but
+ * resolution. Records that can't be sent go to the outbox when it's enabled.
+ */
+
+#define PROBE_TIMEOUT_MS	1000
+
+static struct golioth_client *metrics_client;
+
+K_THREAD_STACK_DEFINE(metrics_stack, CONFIG_MAGTAG_METRICS_STACK_SIZE);
+static struct k_thread metrics_thread;
+
+/* Workqueue probe, submitted once per record */
+static uint32_t probe_start;
+static uint32_t probe_us;
+static K_SEM_DEFINE(probe_sem, 0, 1);
+
+static struct net_mgmt_event_callback iface_cb;
+static struct k_spinlock radio_lock;
+static int radio_ifaces_up;
+static int64_t radio_up_since;
+static int64_t radio_up_total_ms;
+
+static void probe_work_handler(struct k_work *work)
+{
+	probe_us = k_cyc_to_us_floor32(k_cycle_get_32() - probe_start);
+	k_sem_give(&probe_sem);
+}
+
+K_WORK_DEFINE(probe_work, probe_work_handler);
+
+static uint32_t workqueue_delay_us(void)
+{
+	/* A probe still queued from last time keeps its original stamp */
+	if (!k_work_is_pending(&probe_work)) {
+		k_sem_reset(&probe_sem);
+		probe_start = k_cycle_get_32();
+		k_work_submit(&probe_work);
+	}
+	if (k_sem_take(&probe_sem, K_MSEC(PROBE_TIMEOUT_MS))) {
+		return k_cyc_to_us_floor32(k_cycle_get_32() - probe_start);
+	}
+	return probe_us;
+}
+
+static void iface_event_handler(struct net_mgmt_event_callback *cb,
+		uint32_t mgmt_event, struct net_if *iface)
+{
+	int64_t now = k_uptime_get();
+
+	k_spinlock_key_t key = k_spin_lock(&radio_lock);
+	if (mgmt_event == NET_EVENT_IF_UP) {
+		if (radio_ifaces_up++ == 0) {
+			radio_up_since = now;
+		}
+	}
+	else if (mgmt_event == NET_EVENT_IF_DOWN && radio_ifaces_up > 0) {
+		if (--radio_ifaces_up == 0) {
+			radio_up_total_ms += now - radio_up_since;
+		}
+	}
+	k_spin_unlock(&radio_lock, key);
+}
+
+static void count_iface_up(struct net_if *iface, void *user_data)
+{
+	if (net_if_is_up(iface)) {
+		radio_ifaces_up++;
+	}
+}
+
+static int64_t radio_on_time_ms(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&radio_lock);
+	int64_t total = radio_up_total_ms;
+
+	if (radio_ifaces_up > 0) {
+		total += k_uptime_get() - radio_up_since;
+	}
+	k_spin_unlock(&radio_lock, key);
+	return total;
+}
+
+static void encode_heaps(QCBOREncodeContext *ec)
+{
+#if defined(CONFIG_SYS_HEAP_RUNTIME_STATS) && CONFIG_HEAP_MEM_POOL_SIZE > 0
+	extern struct k_heap _system_heap;
+	struct sys_memory_stats heap;
+
+	if (sys_heap_runtime_stats_get(&_system_heap.heap, &heap) == 0) {
+		QCBOREncode_OpenMapInMap(ec, "heap");
+		QCBOREncode_AddUInt64ToMap(ec, "free", heap.free_bytes);
+		QCBOREncode_AddUInt64ToMap(ec, "used", heap.allocated_bytes);
+		QCBOREncode_AddUInt64ToMap(ec, "max", heap.max_allocated_bytes);
+		QCBOREncode_CloseMap(ec);
+	}
+#endif
+
+#if CONFIG_MINIMAL_LIBC_MALLOC_ARENA_SIZE > 0
+	QCBOREncode_OpenMapInMap(ec, "libc");
+	QCBOREncode_AddUInt64ToMap(ec, "size", CONFIG_MINIMAL_LIBC_MALLOC_ARENA_SIZE);
+	QCBOREncode_CloseMap(ec);
+#endif
+
+#if defined(CONFIG_MBEDTLS_ENABLE_HEAP) && defined(MBEDTLS_MEMORY_DEBUG)
+	size_t used, blocks, max_used, max_blocks;
+
+	mbedtls_memory_buffer_alloc_cur_get(&used, &blocks);
+	mbedtls_memory_buffer_alloc_max_get(&max_used, &max_blocks);
+	QCBOREncode_OpenMapInMap(ec, "tls");
+	QCBOREncode_AddUInt64ToMap(ec, "used", used);
+	QCBOREncode_AddUInt64ToMap(ec, "max", max_used);
+	QCBOREncode_AddUInt64ToMap(ec, "blocks", blocks);
+	QCBOREncode_CloseMap(ec);
+#endif
+}
+
+static void encode_stack(const struct k_thread *thread, void *user_data)
+{
+	QCBOREncodeContext *ec = user_data;
+	const char *name = k_thread_name_get((k_tid_t)thread);
+	char addr[20];
+	size_t unused;
+
+	if (k_thread_stack_space_get(thread, &unused)) {
+		return;
+	}
+	if (name == NULL || name[0] == '\0') {
+		snprintk(addr, sizeof(addr), "%p", thread);
+		name = addr;
+	}
+	if (unused < CONFIG_MAGTAG_METRICS_STACK_MARGIN) {
+		LOG_WRN("Thread %s has %zu of %zu stack bytes left", name, unused,
+				thread->stack_info.size);
+	}
+
+	QCBOREncode_OpenMapInMap(ec, name);
+	QCBOREncode_AddUInt64ToMap(ec, "size", thread->stack_info.size);
+	QCBOREncode_AddUInt64ToMap(ec, "free", unused);
+	QCBOREncode_CloseMap(ec);
+}
+
+/**
+ * @brief Sample every metric into one CBOR map
+ *
+ * Blocks for up to a second while a probe goes through the system workqueue,
+ * so don't call it from there.
+ *
+ * @return length written, or -ENOMEM if buf was too small
+ */
+int metrics_encode(uint8_t *buf, size_t len)
+{
+	QCBOREncodeContext ec;
+	UsefulBufC out;
+	uint32_t wq_us = workqueue_delay_us();
+
+	QCBOREncode_Init(&ec, (UsefulBuf){ buf, len });
+	QCBOREncode_OpenMap(&ec);
+	QCBOREncode_AddUInt64ToMap(&ec, "up", k_uptime_get());
+
+	encode_heaps(&ec);
+
+	QCBOREncode_OpenMapInMap(&ec, "stack");
+	/* Stacks are scanned one by one without holding up the scheduler */
+	k_thread_foreach_unlocked(encode_stack, &ec);
+	QCBOREncode_CloseMap(&ec);
+
+	QCBOREncode_AddUInt64ToMap(&ec, "wq_us", wq_us);
+
+#if defined(CONFIG_MAGTAG_EPAPER)
+	struct epaper_stats epd;
+
+	epaper_get_stats(&epd);
+	QCBOREncode_OpenMapInMap(&ec, "epd");
+	QCBOREncode_AddUInt64ToMap(&ec, "n", epd.refreshes);
+	QCBOREncode_AddUInt64ToMap(&ec, "ms", epd.refresh_ms);
+	QCBOREncode_CloseMap(&ec);
+#endif
+#if defined(CONFIG_MAGTAG_WS2812)
+	QCBOREncode_AddInt64ToMap(&ec, "led_ms", ws2812_rail_on_time_ms());
+#endif
+	QCBOREncode_AddInt64ToMap(&ec, "radio_ms", radio_on_time_ms());
+	QCBOREncode_CloseMap(&ec);
+
+	QCBORError qerr = QCBOREncode_Finish(&ec, &out);
+	if (qerr != QCBOR_SUCCESS) {
+		LOG_ERR("Failed to encode metrics: %d", qerr);
+		return -ENOMEM;
+	}
+	return out.len;
+}
+
+static void metrics_thread_fn(void *p1, void *p2, void *p3)
+{
+	static uint8_t buf[CONFIG_MAGTAG_METRICS_BUF_SIZE];
+
+	while (true) {
+		k_sleep(K_SECONDS(CONFIG_MAGTAG_METRICS_PERIOD_S));
+
+		int len = metrics_encode(buf, sizeof(buf));
+		if (len < 0) {
+			continue;
+		}
+
+		int err = -ENOTCONN;
+		if (golioth_is_connected(metrics_client)) {
+			err = golioth_stream_push(metrics_client, METRICS_PATH,
+					GOLIOTH_CONTENT_FORMAT_APP_CBOR, buf, len);
+		}
+		if (err) {
+			err = outbox_put(OUTBOX_STREAM, METRICS_PATH,
+					GOLIOTH_CONTENT_FORMAT_APP_CBOR, buf, len);
+			if (err && err != -ENOTSUP) {
+				LOG_WRN("Failed to store metrics: %d", err);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Start sampling and pushing a health record every MAGTAG_METRICS_PERIOD_S
+ *
+ * Call early, so network interfaces that come up later are counted from the
+ * start.
+ *
+ * @return 0 on success, -EALREADY if already started
+ */
+int metrics_init(struct golioth_client *client)
+{
+	if (metrics_client) {
+		return -EALREADY;
+	}
+	metrics_client = client;
+
+	/* Counted before listening, missing an event beats counting one twice */
+	k_spinlock_key_t key = k_spin_lock(&radio_lock);
+	net_if_foreach(count_iface_up, NULL);
+	radio_up_since = k_uptime_get();
+	k_spin_unlock(&radio_lock, key);
+
+	net_mgmt_init_event_callback(&iface_cb, iface_event_handler,
+			NET_EVENT_IF_UP | NET_EVENT_IF_DOWN);
+	net_mgmt_add_event_callback(&iface_cb);
+
+	k_thread_create(&metrics_thread, metrics_stack, K_THREAD_STACK_SIZEOF(metrics_stack),
+			metrics_thread_fn, NULL, NULL, NULL,
+			CONFIG_MAIN_THREAD_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(&metrics_thread, "metrics");
+	return 0;
+}
@@ -0,0 +1,537 @@
+#include "magtag-common/outbox.h"
+#include <string.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/fs/nvs.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_outbox, LOG_LEVEL_DBG);
+
+/*
+ * Records are kept in NVS on the storage partition, one NVS entry each, so a
+ * power cut leaves either the whole record or none of it. Stream records use
+ * a ring of IDs addressed by sequence number and are deleted only once the
+ * cloud acknowledged them: after a power cut a record may be sent twice but
+ * is not lost. LightDB State records get one ID per path, and a new value for
+ * a path replaces the one waiting.
+ */
+#define STORAGE_NODE_LABEL	storage
+
+#define LIGHTDB_ID_BASE		0x4000
+#define STREAM_ID_BASE		0x4100
+#define LIGHTDB_SLOTS		CONFIG_MAGTAG_OUTBOX_LIGHTDB_SLOTS
+#define STREAM_SLOTS		CONFIG_MAGTAG_OUTBOX_STREAM_SLOTS
+
+/* Room left in front of a merged batch for its array header */
+#define BATCH_HDR_MAX		5
+
+/* CoAP header, token and options of a stream push around the payload */
+#define PUSH_OVERHEAD		64
+
+#if defined(CONFIG_MBEDTLS_SSL_MAX_CONTENT_LEN)
+BUILD_ASSERT(BATCH_HDR_MAX + CONFIG_MAGTAG_OUTBOX_BATCH_BYTES + PUSH_OVERHEAD <=
+		CONFIG_MBEDTLS_SSL_MAX_CONTENT_LEN,
+		"Merged outbox pushes must fit in one DTLS record");
+BUILD_ASSERT(CONFIG_MAGTAG_OUTBOX_MAX_RECORD + PUSH_OVERHEAD <=
+		CONFIG_MBEDTLS_SSL_MAX_CONTENT_LEN,
+		"Outbox records must fit in one DTLS record");
+#endif
+
+struct outbox_hdr {
+	uint32_t seq;		/* stream order, 0 for LightDB State */
+	uint16_t len;
+	uint8_t format;
+	char path[OUTBOX_PATH_MAX];
+} __packed;
+
+struct outbox_record {
+	struct outbox_hdr hdr;
+	uint8_t data[CONFIG_MAGTAG_OUTBOX_MAX_RECORD];
+} __packed;
+
+static struct nvs_fs fs;
+static bool ready;
+static K_MUTEX_DEFINE(outbox_lock);
+
+/* Everything below is protected by outbox_lock */
+static uint32_t head;		/* sequence number of the next stream record */
+static uint32_t tail;		/* sequence number of the oldest stream record */
+static uint32_t lightdb_used;	/* bit per occupied LightDB State slot */
+static uint32_t lightdb_gen[LIGHTDB_SLOTS];	/* bumped by each new value */
+static uint32_t rejected;	/* records the cloud refused, dropped */
+static struct outbox_record put_rec;
+
+/* Only used by outbox_flush(), which has a single caller */
+static struct outbox_record flush_rec;
+static uint8_t batch_buf[BATCH_HDR_MAX + CONFIG_MAGTAG_OUTBOX_BATCH_BYTES];
+
+static uint16_t stream_id(uint32_t seq)
+{
+	return STREAM_ID_BASE + (seq % STREAM_SLOTS);
+}
+
+static int write_record(uint16_t id, const struct outbox_record *rec)
+{
+	ssize_t rc = nvs_write(&fs, id, rec, sizeof(rec->hdr) + rec->hdr.len);
+
+	return rc < 0 ? rc : 0;
+}
+
+static int read_record(uint16_t id, struct outbox_record *rec)
+{
+	ssize_t rc = nvs_read(&fs, id, rec, sizeof(*rec));
+
+	if (rc < 0) {
+		return rc;
+	}
+	if (rc < sizeof(rec->hdr) || rc != sizeof(rec->hdr) + rec->hdr.len) {
+		return -EBADMSG;
+	}
+	return 0;
+}
+
+static void drop_oldest(void)
+{
+	nvs_delete(&fs, stream_id(tail));
+	tail++;
+	LOG_WRN("Outbox full, dropped oldest stream record");
+}
+
+static int put_stream(struct outbox_record *rec)
+{
+	int err;
+
+	if (head - tail >= STREAM_SLOTS) {
+		drop_oldest();
+	}
+	rec->hdr.seq = head;
+
+	/* Flash may fill before the slots do, make room the same way */
+	while ((err = write_record(stream_id(head), rec)) == -ENOSPC && tail != head) {
+		drop_oldest();
+	}
+	if (err == 0) {
+		head++;
+	}
+	return err;
+}
+
+static int put_lightdb(struct outbox_record *rec)
+{
+	struct outbox_hdr hdr;
+	int free_slot = -1;
+	int slot = -1;
+
+	for (int i=0; i<LIGHTDB_SLOTS && slot < 0; i++) {
+		if (!(lightdb_used & BIT(i))) {
+			if (free_slot < 0) {
+				free_slot = i;
+			}
+			continue;
+		}
+		/* nvs_read() returns the full entry length, more than we asked for */
+		if (nvs_read(&fs, LIGHTDB_ID_BASE + i, &hdr, sizeof(hdr)) >= (ssize_t)sizeof(hdr) &&
+				strcmp(hdr.path, rec->hdr.path) == 0) {
+			slot = i;
+		}
+	}
+	if (slot < 0) {
+		slot = free_slot;
+	}
+	if (slot < 0) {
+		return -ENOSPC;
+	}
+
+	int err = write_record(LIGHTDB_ID_BASE + slot, rec);
+	if (err == 0) {
+		lightdb_used |= BIT(slot);
+		lightdb_gen[slot]++;
+	}
+	return err;
+}
+
+/**
+ * @brief Keep a cloud write in flash until outbox_flush() delivers it
+ *
+ * Safe to call from Golioth response callbacks, nothing is sent from here.
+ * When the stream queue is full the oldest stream record is dropped.
+ *
+ * @return 0 on success, -EMSGSIZE if the path or data is too long, -ENOSPC
+ * if every LightDB State slot holds another path
+ */
+int outbox_put(enum outbox_kind kind, const char *path,
+		enum golioth_content_format format, const uint8_t *data, size_t len)
+{
+	int err;
+
+	if (!ready) {
+		return -ENODEV;
+	}
+	if (len > CONFIG_MAGTAG_OUTBOX_MAX_RECORD || strlen(path) >= OUTBOX_PATH_MAX) {
+		return -EMSGSIZE;
+	}
+
+	k_mutex_lock(&outbox_lock, K_FOREVER);
+	memset(&put_rec.hdr, 0, sizeof(put_rec.hdr));
+	strcpy(put_rec.hdr.path, path);
+	put_rec.hdr.len = len;
+	put_rec.hdr.format = format;
+	memcpy(put_rec.data, data, len);
+
+	err = kind == OUTBOX_LIGHTDB ? put_lightdb(&put_rec) : put_stream(&put_rec);
+	k_mutex_unlock(&outbox_lock);
+
+	if (err) {
+		LOG_ERR("Failed to store %s: %d", path, err);
+	}
+	return err;
+}
+
+/*
+ * The request never got an answer, so the record is kept for the next flush.
+ * Anything else is the cloud refusing this record, which sending it again
+ * won't change.
+ */
+static bool transport_error(struct golioth_client *client, int err)
+{
+	switch (err) {
+	case -ETIMEDOUT:
+	case -EAGAIN:
+	case -ENOTCONN:
+	case -ENETDOWN:
+	case -ENETUNREACH:
+	case -ECONNRESET:
+	case -ENOMEM:
+	case -ENOBUFS:
+		return true;
+	default:
+		return !golioth_is_connected(client);
+	}
+}
+
+/* Count a record the cloud refused, it is dropped rather than retried */
+static void reject(const char *path, int err)
+{
+	k_mutex_lock(&outbox_lock, K_FOREVER);
+	uint32_t n = ++rejected;
+	k_mutex_unlock(&outbox_lock);
+
+	LOG_ERR("Cloud refused queued record for %s: %d, dropped (%u so far)", path, err, n);
+}
+
+/* Push one stored stream record, a refused one counts as sent */
+static int push_single(struct golioth_client *client, const struct outbox_record *rec)
+{
+	int err = golioth_stream_push(client, rec->hdr.path, rec->hdr.format,
+			rec->data, rec->hdr.len);
+
+	if (err && !transport_error(client, err)) {
+		reject(rec->hdr.path, err);
+		err = 0;
+	}
+	return err ? err : 1;
+}
+
+/* Delete stream records up to seq, skipping any already dropped */
+static void release(uint32_t seq)
+{
+	k_mutex_lock(&outbox_lock, K_FOREVER);
+	while ((int32_t)(seq - tail) > 0 && tail != head) {
+		nvs_delete(&fs, stream_id(tail));
+		tail++;
+	}
+	k_mutex_unlock(&outbox_lock);
+}
+
+/* Read a stream record, it may have been dropped since the caller looked */
+static int read_stream(uint32_t seq, struct outbox_record *rec)
+{
+	k_mutex_lock(&outbox_lock, K_FOREVER);
+	int err = (int32_t)(seq - tail) < 0 ? -ENOENT : read_record(stream_id(seq), rec);
+	k_mutex_unlock(&outbox_lock);
+
+	if (err == 0 && rec->hdr.seq != seq) {
+		err = -ENOENT;
+	}
+	return err;
+}
+
+/* Size of a definite length CBOR array header and the number of elements */
+static int cbor_array(const uint8_t *data, size_t len, uint32_t *count, size_t *hdr_len)
+{
+	uint8_t info;
+
+	if (len == 0 || (data[0] >> 5) != 4) {
+		return -EINVAL;
+	}
+
+	info = data[0] & 0x1F;
+	if (info < 24) {
+		*count = info;
+		*hdr_len = 1;
+	}
+	else if (info == 24 && len >= 2) {
+		*count = data[1];
+		*hdr_len = 2;
+	}
+	else if (info == 25 && len >= 3) {
+		*count = sys_get_be16(&data[1]);
+		*hdr_len = 3;
+	}
+	else if (info == 26 && len >= 5) {
+		*count = sys_get_be32(&data[1]);
+		*hdr_len = 5;
+	}
+	else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static size_t cbor_array_hdr(uint32_t count, uint8_t *out)
+{
+	if (count < 24) {
+		out[0] = 0x80 | count;
+		return 1;
+	}
+	if (count <= UINT8_MAX) {
+		out[0] = 0x98;
+		out[1] = count;
+		return 2;
+	}
+	if (count <= UINT16_MAX) {
+		out[0] = 0x99;
+		sys_put_be16(count, &out[1]);
+		return 3;
+	}
+	out[0] = 0x9A;
+	sys_put_be32(count, &out[1]);
+	return 5;
+}
+
+/*
+ * Send the oldest stream record. CBOR arrays queued back to back for the same
+ * path are merged into one array, so a backlog goes out in a few large pushes.
+ *
+ * @return number of records sent, or negative errno
+ */
+static int flush_stream_batch(struct golioth_client *client, uint32_t first, uint32_t end)
+{
+	char path[OUTBOX_PATH_MAX];
+	uint32_t count;
+	uint32_t elements;
+	size_t hdr_len;
+	size_t pos = BATCH_HDR_MAX;
+	uint32_t seq = first;
+	int err = read_stream(seq, &flush_rec);
+
+	if (err) {
+		/* Dropped or damaged, nothing to send */
+		return 1;
+	}
+
+	if (flush_rec.hdr.format != GOLIOTH_CONTENT_FORMAT_APP_CBOR ||
+			cbor_array(flush_rec.data, flush_rec.hdr.len, &count, &hdr_len) ||
+			flush_rec.hdr.len - hdr_len > CONFIG_MAGTAG_OUTBOX_BATCH_BYTES) {
+		return push_single(client, &flush_rec);
+	}
+
+	strcpy(path, flush_rec.hdr.path);
+	elements = 0;
+	do {
+		memcpy(&batch_buf[pos], &flush_rec.data[hdr_len], flush_rec.hdr.len - hdr_len);
+		pos += flush_rec.hdr.len - hdr_len;
+		elements += count;
+		seq++;
+	} while (seq != end &&
+		read_stream(seq, &flush_rec) == 0 &&
+		flush_rec.hdr.format == GOLIOTH_CONTENT_FORMAT_APP_CBOR &&
+		strcmp(flush_rec.hdr.path, path) == 0 &&
+		cbor_array(flush_rec.data, flush_rec.hdr.len, &count, &hdr_len) == 0 &&
+		pos + flush_rec.hdr.len - hdr_len <= sizeof(batch_buf));
+
+	uint8_t hdr[BATCH_HDR_MAX];
+	size_t len = cbor_array_hdr(elements, hdr);
+	uint8_t *start = &batch_buf[BATCH_HDR_MAX - len];
+
+	memcpy(start, hdr, len);
+	LOG_DBG("Sending %u queued records to %s as one push", seq - first, path);
+	err = golioth_stream_push(client, path, GOLIOTH_CONTENT_FORMAT_APP_CBOR,
+			start, pos - (BATCH_HDR_MAX - len));
+	if (err == 0) {
+		return seq - first;
+	}
+	if (transport_error(client, err)) {
+		return err;
+	}
+	if (seq - first == 1) {
+		reject(path, err);
+		return 1;
+	}
+
+	/* Don't let a merge the cloud won't take hold up the queue */
+	LOG_WRN("Merged push of %u records failed: %d, sending the oldest alone",
+			seq - first, err);
+	if (read_stream(first, &flush_rec)) {
+		return 1;
+	}
+	return push_single(client, &flush_rec);
+}
+
+static int flush_lightdb(struct golioth_client *client)
+{
+	for (int i=0; i<LIGHTDB_SLOTS; i++) {
+		k_mutex_lock(&outbox_lock, K_FOREVER);
+		uint32_t gen = lightdb_gen[i];
+		int err = (lightdb_used & BIT(i)) ?
+			read_record(LIGHTDB_ID_BASE + i, &flush_rec) : -ENOENT;
+		k_mutex_unlock(&outbox_lock);
+
+		if (err) {
+			continue;
+		}
+
+		err = golioth_lightdb_set(client, flush_rec.hdr.path, flush_rec.hdr.format,
+				flush_rec.data, flush_rec.hdr.len);
+		if (err && transport_error(client, err)) {
+			return err;
+		}
+		if (err) {
+			reject(flush_rec.hdr.path, err);
+		}
+
+		/* Keep the slot if a newer value arrived while sending */
+		k_mutex_lock(&outbox_lock, K_FOREVER);
+		if (gen == lightdb_gen[i]) {
+			nvs_delete(&fs, LIGHTDB_ID_BASE + i);
+			lightdb_used &= ~BIT(i);
+		}
+		k_mutex_unlock(&outbox_lock);
+	}
+	return 0;
+}
+
+/**
+ * @brief Deliver everything stored, latest LightDB State values first
+ *
+ * Blocks on each cloud request, call from a thread that may wait (not from
+ * the system workqueue or a Golioth callback) and only from one thread.
+ * Stops at the first request that gets no answer, what is left stays stored.
+ * A record the cloud refuses is dropped and counted in outbox_rejected().
+ */
+int outbox_flush(struct golioth_client *client)
+{
+	if (!ready) {
+		return -ENODEV;
+	}
+
+	int err = flush_lightdb(client);
+	if (err) {
+		return err;
+	}
+
+	while (true) {
+		k_mutex_lock(&outbox_lock, K_FOREVER);
+		uint32_t first = tail;
+		uint32_t end = head;
+		k_mutex_unlock(&outbox_lock);
+
+		if (first == end) {
+			return 0;
+		}
+
+		int sent = flush_stream_batch(client, first, end);
+		if (sent < 0) {
+			LOG_WRN("Outbox flush stopped: %d", sent);
+			return sent;
+		}
+		release(first + sent);
+	}
+}
+
+/**
+ * @brief Number of records waiting to be delivered
+ */
+uint32_t outbox_pending(void)
+{
+	k_mutex_lock(&outbox_lock, K_FOREVER);
+	uint32_t pending = (head - tail) + POPCOUNT(lightdb_used);
+	k_mutex_unlock(&outbox_lock);
+	return pending;
+}
+
+/**
+ * @brief Number of records dropped since boot because the cloud refused them
+ */
+uint32_t outbox_rejected(void)
+{
+	k_mutex_lock(&outbox_lock, K_FOREVER);
+	uint32_t n = rejected;
+	k_mutex_unlock(&outbox_lock);
+	return n;
+}
+
+/**
+ * @brief Mount the outbox and pick up records left from before a reboot
+ *
+ * Uses CONFIG_MAGTAG_OUTBOX_SECTORS sectors at the start of the storage
+ * partition.
+ */
+int outbox_init(void)
+{
+	struct flash_pages_info info;
+	struct outbox_hdr hdr;
+	uint32_t oldest = 0;
+	uint32_t newest = 0;
+	bool found = false;
+	int err;
+
+	fs.flash_device = FLASH_AREA_DEVICE(STORAGE_NODE_LABEL);
+	if (!device_is_ready(fs.flash_device)) {
+		LOG_ERR("Flash device %s is not ready", fs.flash_device->name);
+		return -ENODEV;
+	}
+	fs.offset = FLASH_AREA_OFFSET(STORAGE_NODE_LABEL);
+	err = flash_get_page_info_by_offs(fs.flash_device, fs.offset, &info);
+	if (err) {
+		LOG_ERR("Unable to get page info: %d", err);
+		return err;
+	}
+	fs.sector_size = info.size;
+	fs.sector_count = CONFIG_MAGTAG_OUTBOX_SECTORS;
+
+	err = nvs_mount(&fs);
+	if (err) {
+		LOG_ERR("Failed to mount outbox: %d", err);
+		return err;
+	}
+
+	/* The stream queue runs from the oldest to the newest surviving record */
+	for (uint32_t i=0; i<STREAM_SLOTS; i++) {
+		if (nvs_read(&fs, STREAM_ID_BASE + i, &hdr, sizeof(hdr)) < (ssize_t)sizeof(hdr)) {
+			continue;
+		}
+		if (!found || (int32_t)(hdr.seq - oldest) < 0) {
+			oldest = hdr.seq;
+		}
+		if (!found || (int32_t)(hdr.seq - newest) > 0) {
+			newest = hdr.seq;
+		}
+		found = true;
+	}
+	if (found) {
+		tail = oldest;
+		head = newest + 1;
+	}
+
+	for (int i=0; i<LIGHTDB_SLOTS; i++) {
+		if (nvs_read(&fs, LIGHTDB_ID_BASE + i, &hdr, sizeof(hdr)) >= (ssize_t)sizeof(hdr)) {
+			lightdb_used |= BIT(i);
+		}
+	}
+
+	ready = true;
+	LOG_INF("Outbox has %u stream and %u state records waiting",
+			head - tail, POPCOUNT(lightdb_used));
+	return 0;
+}
@@ -0,0 +1,128 @@
+#include "magtag-common/sample_ring.h"
+#include <string.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_sample_ring, LOG_LEVEL_DBG);
+
+/*
+ * Records are addressed by free-running 32-bit sequence numbers so that a
+ * consumer can peek a batch, upload it, and then release exactly that batch
+ * even if the producer overwrote some of it in the meantime.
+ */
+
+static uint8_t *slot(struct sample_ring *ring, uint32_t seq)
+{
+	return &ring->buf[(seq % ring->capacity) * SAMPLE_RING_SLOT(ring->record_size)];
+}
+
+/**
+ * @brief Add a record to the ring
+ *
+ * @return 0 on success, -ENOBUFS if the ring is full and the policy is
+ * SAMPLE_RING_BACKPRESSURE
+ */
+int sample_ring_put(struct sample_ring *ring, uint32_t timestamp, const void *data)
+{
+	k_spinlock_key_t key = k_spin_lock(&ring->lock);
+	uint32_t used = ring->head - ring->tail;
+
+	if (used == ring->capacity) {
+		if (ring->policy == SAMPLE_RING_BACKPRESSURE) {
+			ring->stats.rejected++;
+			k_spin_unlock(&ring->lock, key);
+			return -ENOBUFS;
+		}
+		ring->tail++;
+		ring->stats.overwritten++;
+		used--;
+	}
+
+	uint8_t *rec = slot(ring, ring->head);
+
+	memcpy(rec, &timestamp, sizeof(timestamp));
+	memcpy(rec + sizeof(timestamp), data, ring->record_size);
+	ring->head++;
+	used++;
+
+	ring->stats.pushed++;
+	if (used > ring->stats.high_water) {
+		ring->stats.high_water = used;
+	}
+	k_spin_unlock(&ring->lock, key);
+	return 0;
+}
+
+/**
+ * @brief Copy out up to max of the oldest records without removing them
+ *
+ * Pass the returned seq plus the number of records handled on to
+ * sample_ring_consume() to release them. Either of timestamps and data may
+ * be NULL. Single consumer only.
+ *
+ * @return number of records copied
+ */
+size_t sample_ring_peek(struct sample_ring *ring, uint32_t *seq,
+		uint32_t *timestamps, void *data, size_t max)
+{
+	uint8_t *out = data;
+	size_t n;
+
+	k_spinlock_key_t key = k_spin_lock(&ring->lock);
+
+	n = MIN(max, ring->head - ring->tail);
+	*seq = ring->tail;
+	for (size_t i=0; i<n; i++) {
+		const uint8_t *rec = slot(ring, ring->tail + i);
+
+		if (timestamps) {
+			memcpy(&timestamps[i], rec, sizeof(uint32_t));
+		}
+		if (out) {
+			memcpy(&out[i * ring->record_size], rec + sizeof(uint32_t),
+					ring->record_size);
+		}
+	}
+	k_spin_unlock(&ring->lock, key);
+	return n;
+}
+
+/**
+ * @brief Release every record before sequence number seq
+ *
+ * Records that were already overwritten are skipped over.
+ */
+void sample_ring_consume(struct sample_ring *ring, uint32_t seq)
+{
+	k_spinlock_key_t key = k_spin_lock(&ring->lock);
+
+	if ((int32_t)(seq - ring->tail) > 0) {
+		if ((int32_t)(seq - ring->head) > 0) {
+			seq = ring->head;
+		}
+		ring->stats.drained += seq - ring->tail;
+		ring->tail = seq;
+	}
+	k_spin_unlock(&ring->lock, key);
+}
+
+void sample_ring_set_policy(struct sample_ring *ring, enum sample_ring_policy policy)
+{
+	ring->policy = policy;
+}
+
+uint32_t sample_ring_used(struct sample_ring *ring)
+{
+	k_spinlock_key_t key = k_spin_lock(&ring->lock);
+	uint32_t used = ring->head - ring->tail;
+
+	k_spin_unlock(&ring->lock, key);
+	return used;
+}
+
+void sample_ring_get_stats(struct sample_ring *ring, struct sample_ring_stats *stats)
+{
+	k_spinlock_key_t key = k_spin_lock(&ring->lock);
+
+	*stats = ring->stats;
+	stats->used = ring->head - ring->tail;
+	k_spin_unlock(&ring->lock, key);
+}
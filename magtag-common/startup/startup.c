@@ -0,0 +1,219 @@
+#include "magtag-common/startup.h"
+#include <samples/common/net_connect.h>
+#include <string.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_startup, LOG_LEVEL_DBG);
+
+/*
+ * Local steps are queued to a dedicated thread so that main can go on with
+ * the quick ones (LEDs, accelerometer, buttons) meanwhile. Work handed to
+ * startup_when_connected() is held back until the first connection and the
+ * end of local bring-up, so it may use both the cloud and the hardware.
+ */
+
+typedef void (*startup_fn_t)(void);
+
+K_MSGQ_DEFINE(startup_msgq, sizeof(startup_fn_t), CONFIG_MAGTAG_STARTUP_QUEUE, 4);
+
+static K_MUTEX_DEFINE(startup_lock);
+static K_CONDVAR_DEFINE(startup_cond);
+static int local_pending;
+static bool connected;
+static struct k_work *deferred[CONFIG_MAGTAG_STARTUP_DEFERRED];
+static size_t deferred_count;
+
+static void (*app_on_connect)(struct golioth_client *client);
+
+K_THREAD_STACK_DEFINE(net_stack, CONFIG_MAGTAG_STARTUP_NET_STACK_SIZE);
+static struct k_thread net_thread;
+
+/* Call with startup_lock held, submit the returned work after releasing it */
+static size_t take_deferred(struct k_work **work)
+{
+	size_t n = 0;
+
+	if (connected && local_pending == 0) {
+		n = deferred_count;
+		memcpy(work, deferred, n * sizeof(work[0]));
+		deferred_count = 0;
+	}
+	return n;
+}
+
+static void submit_all(struct k_work **work, size_t n)
+{
+	for (size_t i=0; i<n; i++) {
+		k_work_submit(work[i]);
+	}
+}
+
+static void startup_thread(void *p1, void *p2, void *p3)
+{
+	struct k_work *work[CONFIG_MAGTAG_STARTUP_DEFERRED];
+	startup_fn_t fn;
+	size_t n;
+
+	while (true) {
+		k_msgq_get(&startup_msgq, &fn, K_FOREVER);
+		fn();
+
+		k_mutex_lock(&startup_lock, K_FOREVER);
+		if (--local_pending == 0) {
+			LOG_INF("Local bring-up done at %lld ms", k_uptime_get());
+		}
+		n = take_deferred(work);
+		k_condvar_broadcast(&startup_cond);
+		k_mutex_unlock(&startup_lock);
+
+		submit_all(work, n);
+	}
+}
+
+K_THREAD_DEFINE(startup_tid, CONFIG_MAGTAG_STARTUP_STACK_SIZE, startup_thread,
+		NULL, NULL, NULL, CONFIG_MAIN_THREAD_PRIORITY, 0, 0);
+
+/**
+ * @brief Run a local bring-up step on the startup thread
+ *
+ * Steps run one after another, in the order they were queued, while the
+ * caller continues.
+ *
+ * @return 0 on success, -ENOMEM if too many steps are queued
+ */
+int startup_run(void (*fn)(void))
+{
+	k_mutex_lock(&startup_lock, K_FOREVER);
+	local_pending++;
+	k_mutex_unlock(&startup_lock);
+
+	if (k_msgq_put(&startup_msgq, &fn, K_NO_WAIT)) {
+		LOG_ERR("Startup queue is full");
+		k_mutex_lock(&startup_lock, K_FOREVER);
+		local_pending--;
+		k_condvar_broadcast(&startup_cond);
+		k_mutex_unlock(&startup_lock);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * @brief Wait for every step queued with startup_run() to finish
+ *
+ * @return 0 once done, -EAGAIN on timeout
+ */
+int startup_wait_local(k_timeout_t timeout)
+{
+	int err = 0;
+
+	k_mutex_lock(&startup_lock, K_FOREVER);
+	while (local_pending > 0 && err == 0) {
+		err = k_condvar_wait(&startup_cond, &startup_lock, timeout);
+	}
+	k_mutex_unlock(&startup_lock);
+	return err;
+}
+
+static void startup_on_connect(struct golioth_client *client)
+{
+	struct k_work *work[CONFIG_MAGTAG_STARTUP_DEFERRED];
+	size_t n;
+
+	k_mutex_lock(&startup_lock, K_FOREVER);
+	if (!connected) {
+		LOG_INF("Connected to Golioth at %lld ms", k_uptime_get());
+	}
+	connected = true;
+	n = take_deferred(work);
+	k_condvar_broadcast(&startup_cond);
+	k_mutex_unlock(&startup_lock);
+
+	if (app_on_connect) {
+		app_on_connect(client);
+	}
+	submit_all(work, n);
+}
+
+static void net_thread_fn(void *p1, void *p2, void *p3)
+{
+	if (IS_ENABLED(CONFIG_GOLIOTH_SAMPLES_COMMON)) {
+		net_connect();
+	}
+	golioth_system_client_start();
+}
+
+/**
+ * @brief Connect the network and start the Golioth client in the background
+ *
+ * on_connect (may be NULL) is called on every connection, like
+ * client->on_connect which this takes over.
+ */
+void startup_network(struct golioth_client *client,
+		void (*on_connect)(struct golioth_client *client))
+{
+	app_on_connect = on_connect;
+	client->on_connect = startup_on_connect;
+
+	k_thread_create(&net_thread, net_stack, K_THREAD_STACK_SIZEOF(net_stack),
+			net_thread_fn, NULL, NULL, NULL,
+			CONFIG_MAIN_THREAD_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(&net_thread, "startup_net");
+}
+
+/* True once the client has connected, it may have dropped out since */
+bool startup_is_connected(void)
+{
+	k_mutex_lock(&startup_lock, K_FOREVER);
+	bool ret = connected;
+
+	k_mutex_unlock(&startup_lock);
+	return ret;
+}
+
+/**
+ * @brief Wait for the first connection to Golioth
+ *
+ * @return 0 once connected, -EAGAIN on timeout
+ */
+int startup_wait_connected(k_timeout_t timeout)
+{
+	int err = 0;
+
+	k_mutex_lock(&startup_lock, K_FOREVER);
+	while (!connected && err == 0) {
+		err = k_condvar_wait(&startup_cond, &startup_lock, timeout);
+	}
+	k_mutex_unlock(&startup_lock);
+	return err;
+}
+
+/**
+ * @brief Submit work once connected and local bring-up is done
+ *
+ * The work is submitted right away if both have already happened. Queue the
+ * local steps with startup_run() first.
+ *
+ * @return 0 on success, -ENOMEM if too much work is waiting
+ */
+int startup_when_connected(struct k_work *work)
+{
+	k_mutex_lock(&startup_lock, K_FOREVER);
+	if (connected && local_pending == 0) {
+		k_mutex_unlock(&startup_lock);
+		k_work_submit(work);
+		return 0;
+	}
+	for (size_t i=0; i<deferred_count; i++) {
+		if (deferred[i] == work) {
+			k_mutex_unlock(&startup_lock);
+			return 0;
+		}
+	}
+	if (deferred_count == ARRAY_SIZE(deferred)) {
+		k_mutex_unlock(&startup_lock);
+		return -ENOMEM;
+	}
+	deferred[deferred_count++] = work;
+	k_mutex_unlock(&startup_lock);
+	return 0;
+}
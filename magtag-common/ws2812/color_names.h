@@ -0,0 +1,195 @@
+/* Generated by utility/color_names_to_header.py, do not edit */
+
+#ifndef __COLOR_NAMES_H_
+#define __COLOR_NAMES_H_
+
+#define COLOR_NAME_SEED		0x811C9DC5
+#define COLOR_NAME_SLOTS	256
+#define COLOR_NAME_BUCKETS	64
+#define COLOR_NAME_MAX_LEN	20
+
+struct color_name {
+	const char *name;
+	uint32_t rgb;
+};
+
+static const struct color_name color_names[] = {
+	{ "aliceblue", 0xF0F8FF },
+	{ "antiquewhite", 0xFAEBD7 },
+	{ "aqua", 0x00FFFF },
+	{ "aquamarine", 0x7FFFD4 },
+	{ "azure", 0xF0FFFF },
+	{ "beige", 0xF5F5DC },
+	{ "bisque", 0xFFE4C4 },
+	{ "black", 0x000000 },
+	{ "blanchedalmond", 0xFFEBCD },
+	{ "blue", 0x0000FF },
+	{ "blueviolet", 0x8A2BE2 },
+	{ "brown", 0xA52A2A },
+	{ "burlywood", 0xDEB887 },
+	{ "cadetblue", 0x5F9EA0 },
+	{ "chartreuse", 0x7FFF00 },
+	{ "chocolate", 0xD2691E },
+	{ "coral", 0xFF7F50 },
+	{ "cornflowerblue", 0x6495ED },
+	{ "cornsilk", 0xFFF8DC },
+	{ "crimson", 0xDC143C },
+	{ "cyan", 0x00FFFF },
+	{ "darkblue", 0x00008B },
+	{ "darkcyan", 0x008B8B },
+	{ "darkgoldenrod", 0xB8860B },
+	{ "darkgray", 0xA9A9A9 },
+	{ "darkgreen", 0x006400 },
+	{ "darkgrey", 0xA9A9A9 },
+	{ "darkkhaki", 0xBDB76B },
+	{ "darkmagenta", 0x8B008B },
+	{ "darkolivegreen", 0x556B2F },
+	{ "darkorange", 0xFF8C00 },
+	{ "darkorchid", 0x9932CC },
+	{ "darkred", 0x8B0000 },
+	{ "darksalmon", 0xE9967A },
+	{ "darkseagreen", 0x8FBC8F },
+	{ "darkslateblue", 0x483D8B },
+	{ "darkslategray", 0x2F4F4F },
+	{ "darkslategrey", 0x2F4F4F },
+	{ "darkturquoise", 0x00CED1 },
+	{ "darkviolet", 0x9400D3 },
+	{ "deeppink", 0xFF1493 },
+	{ "deepskyblue", 0x00BFFF },
+	{ "dimgray", 0x696969 },
+	{ "dimgrey", 0x696969 },
+	{ "dodgerblue", 0x1E90FF },
+	{ "firebrick", 0xB22222 },
+	{ "floralwhite", 0xFFFAF0 },
+	{ "forestgreen", 0x228B22 },
+	{ "fuchsia", 0xFF00FF },
+	{ "gainsboro", 0xDCDCDC },
+	{ "ghostwhite", 0xF8F8FF },
+	{ "gold", 0xFFD700 },
+	{ "goldenrod", 0xDAA520 },
+	{ "gray", 0x808080 },
+	{ "green", 0x008000 },
+	{ "greenyellow", 0xADFF2F },
+	{ "grey", 0x808080 },
+	{ "honeydew", 0xF0FFF0 },
+	{ "hotpink", 0xFF69B4 },
+	{ "indianred", 0xCD5C5C },
+	{ "indigo", 0x4B0082 },
+	{ "ivory", 0xFFFFF0 },
+	{ "khaki", 0xF0E68C },
+	{ "lavender", 0xE6E6FA },
+	{ "lavenderblush", 0xFFF0F5 },
+	{ "lawngreen", 0x7CFC00 },
+	{ "lemonchiffon", 0xFFFACD },
+	{ "lightblue", 0xADD8E6 },
+	{ "lightcoral", 0xF08080 },
+	{ "lightcyan", 0xE0FFFF },
+	{ "lightgoldenrodyellow", 0xFAFAD2 },
+	{ "lightgray", 0xD3D3D3 },
+	{ "lightgreen", 0x90EE90 },
+	{ "lightgrey", 0xD3D3D3 },
+	{ "lightpink", 0xFFB6C1 },
+	{ "lightsalmon", 0xFFA07A },
+	{ "lightseagreen", 0x20B2AA },
+	{ "lightskyblue", 0x87CEFA },
+	{ "lightslategray", 0x778899 },
+	{ "lightslategrey", 0x778899 },
+	{ "lightsteelblue", 0xB0C4DE },
+	{ "lightyellow", 0xFFFFE0 },
+	{ "lime", 0x00FF00 },
+	{ "limegreen", 0x32CD32 },
+	{ "linen", 0xFAF0E6 },
+	{ "magenta", 0xFF00FF },
+	{ "maroon", 0x800000 },
+	{ "mediumaquamarine", 0x66CDAA },
+	{ "mediumblue", 0x0000CD },
+	{ "mediumorchid", 0xBA55D3 },
+	{ "mediumpurple", 0x9370DB },
+	{ "mediumseagreen", 0x3CB371 },
+	{ "mediumslateblue", 0x7B68EE },
+	{ "mediumspringgreen", 0x00FA9A },
+	{ "mediumturquoise", 0x48D1CC },
+	{ "mediumvioletred", 0xC71585 },
+	{ "midnightblue", 0x191970 },
+	{ "mintcream", 0xF5FFFA },
+	{ "mistyrose", 0xFFE4E1 },
+	{ "moccasin", 0xFFE4B5 },
+	{ "navajowhite", 0xFFDEAD },
+	{ "navy", 0x000080 },
+	{ "oldlace", 0xFDF5E6 },
+	{ "olive", 0x808000 },
+	{ "olivedrab", 0x6B8E23 },
+	{ "orange", 0xFFA500 },
+	{ "orangered", 0xFF4500 },
+	{ "orchid", 0xDA70D6 },
+	{ "palegoldenrod", 0xEEE8AA },
+	{ "palegreen", 0x98FB98 },
+	{ "paleturquoise", 0xAFEEEE },
+	{ "palevioletred", 0xDB7093 },
+	{ "papayawhip", 0xFFEFD5 },
+	{ "peachpuff", 0xFFDAB9 },
+	{ "peru", 0xCD853F },
+	{ "pink", 0xFFC0CB },
+	{ "plum", 0xDDA0DD },
+	{ "powderblue", 0xB0E0E6 },
+	{ "purple", 0x800080 },
+	{ "rebeccapurple", 0x663399 },
+	{ "red", 0xFF0000 },
+	{ "rosybrown", 0xBC8F8F },
+	{ "royalblue", 0x4169E1 },
+	{ "saddlebrown", 0x8B4513 },
+	{ "salmon", 0xFA8072 },
+	{ "sandybrown", 0xF4A460 },
+	{ "seagreen", 0x2E8B57 },
+	{ "seashell", 0xFFF5EE },
+	{ "sienna", 0xA0522D },
+	{ "silver", 0xC0C0C0 },
+	{ "skyblue", 0x87CEEB },
+	{ "slateblue", 0x6A5ACD },
+	{ "slategray", 0x708090 },
+	{ "slategrey", 0x708090 },
+	{ "snow", 0xFFFAFA },
+	{ "springgreen", 0x00FF7F },
+	{ "steelblue", 0x4682B4 },
+	{ "tan", 0xD2B48C },
+	{ "teal", 0x008080 },
+	{ "thistle", 0xD8BFD8 },
+	{ "tomato", 0xFF6347 },
+	{ "turquoise", 0x40E0D0 },
+	{ "violet", 0xEE82EE },
+	{ "wheat", 0xF5DEB3 },
+	{ "white", 0xFFFFFF },
+	{ "whitesmoke", 0xF5F5F5 },
+	{ "yellow", 0xFFFF00 },
+	{ "yellowgreen", 0x9ACD32 },
+};
+
+/* Per-bucket displacement used by color_slot() */
+static const uint8_t color_name_displace[COLOR_NAME_BUCKETS] = {
+	0, 0, 0, 6, 1, 1, 0, 0, 0, 2, 1, 0, 0, 0, 1, 0,
+	1, 0, 5, 2, 3, 1, 0, 13, 1, 1, 1, 0, 1, 1, 3, 1,
+	0, 0, 1, 0, 2, 0, 0, 2, 0, 2, 0, 0, 3, 2, 2, 0,
+	2, 0, 0, 0, 0, 0, 19, 4, 0, 7, 1, 4, 2, 1, 3, 6,
+};
+
+/* color_names[] index + 1 for each slot, 0 when empty */
+static const uint8_t color_name_slots[COLOR_NAME_SLOTS] = {
+	43, 18, 120, 0, 0, 0, 0, 0, 0, 0, 0, 3, 0, 21, 0, 0,
+	38, 113, 72, 0, 80, 0, 34, 0, 141, 52, 17, 63, 82, 0, 50, 106,
+	0, 0, 0, 81, 12, 29, 7, 98, 64, 0, 0, 36, 49, 67, 0, 33,
+	105, 0, 71, 47, 90, 0, 134, 0, 57, 139, 13, 130, 0, 0, 97, 0,
+	89, 0, 109, 54, 28, 0, 0, 0, 0, 0, 0, 83, 0, 0, 131, 61,
+	124, 0, 119, 0, 0, 20, 70, 75, 110, 0, 0, 46, 14, 123, 68, 44,
+	121, 66, 27, 101, 0, 23, 117, 148, 2, 0, 65, 0, 0, 138, 133, 73,
+	0, 0, 0, 0, 0, 0, 77, 118, 0, 0, 0, 116, 87, 114, 79, 0,
+	62, 0, 69, 127, 0, 132, 0, 31, 5, 15, 147, 74, 10, 0, 0, 35,
+	24, 0, 144, 0, 0, 107, 0, 19, 0, 111, 26, 4, 53, 84, 129, 0,
+	51, 135, 93, 0, 0, 42, 115, 143, 0, 86, 0, 103, 40, 0, 0, 0,
+	76, 0, 0, 96, 0, 59, 146, 85, 0, 9, 0, 136, 0, 0, 137, 122,
+	0, 0, 0, 0, 0, 78, 145, 0, 0, 58, 102, 48, 0, 0, 0, 22,
+	0, 56, 0, 41, 0, 0, 11, 6, 8, 108, 0, 125, 37, 142, 1, 0,
+	94, 0, 140, 0, 39, 32, 0, 99, 95, 126, 0, 55, 0, 45, 60, 30,
+	0, 0, 0, 25, 100, 104, 0, 112, 16, 0, 0, 91, 128, 88, 0, 92,
+};
+
+#endif
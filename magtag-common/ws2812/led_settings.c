@@ -0,0 +1,154 @@
+#include "magtag-common/json-helper.h"
+#include "magtag-common/ws2812_control.h"
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(golioth_led_settings, LOG_LEVEL_DBG);
+
+static const struct json_obj_descr led_settings_descr[] = {
+	JSON_OBJ_DESCR_PRIM(struct led_settings, led0_color, JSON_TOK_STRING),
+	JSON_OBJ_DESCR_PRIM(struct led_settings, led0_state, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct led_settings, led1_color, JSON_TOK_STRING),
+	JSON_OBJ_DESCR_PRIM(struct led_settings, led1_state, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct led_settings, led2_color, JSON_TOK_STRING),
+	JSON_OBJ_DESCR_PRIM(struct led_settings, led2_state, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct led_settings, led3_color, JSON_TOK_STRING),
+	JSON_OBJ_DESCR_PRIM(struct led_settings, led3_state, JSON_TOK_NUMBER)
+};
+
+/* json_obj_parse() sets one bit per decoded descriptor entry */
+#define COLOR_FIELD(i)	BIT((i) * 2)
+#define STATE_FIELD(i)	BIT((i) * 2 + 1)
+
+BUILD_ASSERT(LED_SETTINGS_NUM <= STRIP_NUM_PIXELS, "More LED settings than pixels");
+
+static const char **color_field(struct led_settings *settings, uint8_t i)
+{
+	const char **fields[] = {
+		&settings->led0_color, &settings->led1_color,
+		&settings->led2_color, &settings->led3_color
+	};
+	return fields[i];
+}
+
+static int32_t *state_field(struct led_settings *settings, uint8_t i)
+{
+	int32_t *fields[] = {
+		&settings->led0_state, &settings->led1_state,
+		&settings->led2_state, &settings->led3_state
+	};
+	return fields[i];
+}
+
+/**
+ * @brief Parse a JSON LED settings document
+ *
+ * Strings in settings point into json, which is modified in place and must
+ * outlive settings.
+ *
+ * @return bitmask of decoded fields, or a negative error
+ */
+int led_settings_parse(char *json, size_t len, struct led_settings *settings)
+{
+	memset(settings, 0, sizeof(*settings));
+	return json_obj_parse(json, len, led_settings_descr,
+			ARRAY_SIZE(led_settings_descr), settings);
+}
+
+/**
+ * @brief Apply LED settings with a single blit
+ *
+ * All colors are validated before anything changes, so a bad document leaves
+ * the LEDs untouched.
+ *
+ * @param settings  parsed settings
+ * @param fields    bitmask returned by led_settings_parse(), fields not set
+ *                  keep their current value
+ */
+int led_settings_apply(const struct led_settings *settings, uint32_t fields)
+{
+	struct led_settings s = *settings;
+	struct led_color_state new_states[LED_SETTINGS_NUM];
+
+	for (uint8_t i=0; i<LED_SETTINGS_NUM; i++) {
+		new_states[i] = led_states[i];
+
+		if (fields & COLOR_FIELD(i)) {
+			int err = color_from_name(*color_field(&s, i), &new_states[i].color);
+			if (err) {
+				LOG_WRN("Invalid color for LED %d: %s", i, *color_field(&s, i));
+				return err;
+			}
+		}
+		if (fields & STATE_FIELD(i)) {
+			new_states[i].state = *state_field(&s, i) ? 1 : 0;
+		}
+	}
+
+	memcpy(led_states, new_states, sizeof(new_states));
+	ws2812_blit(strip, led_states, STRIP_NUM_PIXELS);
+	return 0;
+}
+
+int led_settings_apply_json(char *json, size_t len)
+{
+	struct led_settings settings;
+	int ret = led_settings_parse(json, len, &settings);
+
+	if (ret < 0) {
+		LOG_ERR("Failed to parse LED settings: %d", ret);
+		return ret;
+	}
+	if (ret == 0) {
+		return -ENODATA;
+	}
+	return led_settings_apply(&settings, (uint32_t)ret);
+}
+
+/**
+ * @brief Encode the current LED state as one JSON document
+ *
+ * @param buf   output buffer, LED_SETTINGS_JSON_LEN is always enough
+ * @param len   size of buf
+ */
+int led_settings_encode(char *buf, size_t len)
+{
+	struct led_settings settings;
+	char hex[LED_SETTINGS_NUM][8];
+
+	for (uint8_t i=0; i<LED_SETTINGS_NUM; i++) {
+		snprintk(hex[i], sizeof(hex[i]), "#%02x%02x%02x",
+				led_states[i].color.r,
+				led_states[i].color.g,
+				led_states[i].color.b);
+		*color_field(&settings, i) = hex[i];
+		/* -1 is the local "forced on" value, the cloud only sees on/off */
+		*state_field(&settings, i) = led_states[i].state != 0 ? 1 : 0;
+	}
+
+	return json_obj_encode_buf(led_settings_descr, ARRAY_SIZE(led_settings_descr),
+			&settings, buf, len);
+}
+
+/**
+ * @brief Write the whole LED state to LightDB State in one request
+ *
+ * @param client    Golioth client
+ * @param path      LightDB State path for the settings object
+ * @param cb        async response callback
+ * @param user_data passed to cb
+ */
+int led_settings_sync(struct golioth_client *client, const char *path,
+		golioth_req_cb_t cb, void *user_data)
+{
+	char buf[LED_SETTINGS_JSON_LEN];
+	int err = led_settings_encode(buf, sizeof(buf));
+
+	if (err) {
+		LOG_ERR("Failed to encode LED settings: %d", err);
+		return err;
+	}
+
+	return golioth_lightdb_set_cb(client, path,
+			GOLIOTH_CONTENT_FORMAT_APP_JSON,
+			buf, strlen(buf),
+			cb, user_data);
+}
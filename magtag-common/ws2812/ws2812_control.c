@@ -1,4 +1,6 @@
 #include "magtag-common/ws2812_control.h"
+#include "magtag-common/latency.h"
+#include "color_names.h"
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(golioth_ws2812, LOG_LEVEL_DBG);
 
@@ -6,6 +8,7 @@ LOG_MODULE_REGISTER(golioth_ws2812, LOG_LEVEL_DBG);
 
 /* mosfet control pin for ws2812 power rail */
 #define NEOPOWER_NODE 	DT_ALIAS(neopower)
+static const struct gpio_dt_spec neopower_dev = GPIO_DT_SPEC_GET(NEOPOWER_NODE, gpios);
 
 struct led_color_state led_states[STRIP_NUM_PIXELS];
 struct led_rgb pixels[STRIP_NUM_PIXELS];
@@ -23,38 +26,429 @@ void clear_pixels(void)
  * @brief Set a single pixel color
  * 
  * @param pixel_n   the pixel number
- * @param color     the color_rgb value
+ * @param color     any 24-bit color (use colors[] for the palette)
+ * @param state     0 = off, 1 = on, -1 = on and overrides toggle value
  */
-void set_pixel(struct led_color_state *states, uint8_t pixel_n, uint8_t color_n, int8_t state)
+void set_pixel(struct led_color_state *states, uint8_t pixel_n, struct led_rgb color, int8_t state)
 {
     if (pixel_n >= STRIP_NUM_PIXELS) return;
-    if (color_n >= sizeof(colors)) return;
-    states[pixel_n].color = color_n;
+    states[pixel_n].color = color;
     states[pixel_n].state = state;
 }
 
+/* Gamma 2.8 correction, indexed by requested channel level */
+static const uint8_t gamma8[256] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+	0x02, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x04, 0x04, 0x04, 0x04, 0x04, 0x05, 0x05, 0x05,
+	0x05, 0x06, 0x06, 0x06, 0x06, 0x07, 0x07, 0x07, 0x07, 0x08, 0x08, 0x08, 0x09, 0x09, 0x09, 0x0A,
+	0x0A, 0x0A, 0x0B, 0x0B, 0x0B, 0x0C, 0x0C, 0x0D, 0x0D, 0x0D, 0x0E, 0x0E, 0x0F, 0x0F, 0x10, 0x10,
+	0x11, 0x11, 0x12, 0x12, 0x13, 0x13, 0x14, 0x14, 0x15, 0x15, 0x16, 0x16, 0x17, 0x18, 0x18, 0x19,
+	0x19, 0x1A, 0x1B, 0x1B, 0x1C, 0x1D, 0x1D, 0x1E, 0x1F, 0x20, 0x20, 0x21, 0x22, 0x23, 0x23, 0x24,
+	0x25, 0x26, 0x27, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x32,
+	0x33, 0x34, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F, 0x40, 0x42, 0x43, 0x44,
+	0x45, 0x46, 0x48, 0x49, 0x4A, 0x4B, 0x4D, 0x4E, 0x4F, 0x51, 0x52, 0x53, 0x55, 0x56, 0x57, 0x59,
+	0x5A, 0x5C, 0x5D, 0x5F, 0x60, 0x62, 0x63, 0x65, 0x66, 0x68, 0x69, 0x6B, 0x6D, 0x6E, 0x70, 0x72,
+	0x73, 0x75, 0x77, 0x78, 0x7A, 0x7C, 0x7E, 0x7F, 0x81, 0x83, 0x85, 0x87, 0x89, 0x8A, 0x8C, 0x8E,
+	0x90, 0x92, 0x94, 0x96, 0x98, 0x9A, 0x9C, 0x9E, 0xA0, 0xA2, 0xA4, 0xA7, 0xA9, 0xAB, 0xAD, 0xAF,
+	0xB1, 0xB4, 0xB6, 0xB8, 0xBA, 0xBD, 0xBF, 0xC1, 0xC4, 0xC6, 0xC8, 0xCB, 0xCD, 0xD0, 0xD2, 0xD5,
+	0xD7, 0xDA, 0xDC, 0xDF, 0xE1, 0xE4, 0xE7, 0xE9, 0xEC, 0xEF, 0xF1, 0xF4, 0xF7, 0xF9, 0xFC, 0xFF,
+};
+
+/* gamma8[] pre-scaled by the global brightness, rebuilt when it changes */
+static uint8_t output_lut[256];
+static uint8_t brightness = CONFIG_MAGTAG_WS2812_BRIGHTNESS;
+
+static void build_output_lut(void)
+{
+	for (uint16_t i=0; i<256; i++) {
+		output_lut[i] = (uint8_t)(((uint16_t)gamma8[i] * brightness + 127) / 255);
+	}
+}
+
+/* Animation phase is Q16 fixed point: ANIM_Q16_ONE spans one period */
+#define ANIM_Q16_ONE	65536
+#define ANIM_FRAME_MS	(1000 / CONFIG_MAGTAG_WS2812_ANIM_FPS)
+
+struct led_anim_slot {
+	struct led_anim anim;
+	int64_t start_ms;
+};
+
+static struct led_anim_slot anim_slots[STRIP_NUM_PIXELS];
+static struct led_rgb anim_frame[STRIP_NUM_PIXELS];
+/* Bitmask of pixels whose output is owned by an animation */
+static uint32_t anim_active;
+static struct k_spinlock anim_lock;
+static enum led_status current_status = LED_STATUS_NONE;
+
+/* Last frame sent to the strip, used to skip redundant blits */
+static struct led_rgb shown[STRIP_NUM_PIXELS];
+static bool shown_valid;
+static K_MUTEX_DEFINE(blit_mutex);
+
+/* Power rail gating, protected by blit_mutex */
+static bool rail_on;
+static int64_t rail_on_since;
+static int64_t rail_on_total_ms;
+
+static bool frame_is_black(const struct led_rgb *frame, uint8_t pix_count)
+{
+	for (uint8_t i=0; i<pix_count; i++) {
+		if (frame[i].r || frame[i].g || frame[i].b) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Call with blit_mutex held */
+static void rail_set(bool on)
+{
+	if (on == rail_on) return;
+
+	/* The rail switch is a P-channel MOSFET: logical 0 powers the LEDs */
+	gpio_pin_set_dt(&neopower_dev, on ? 0 : 1);
+	rail_on = on;
+
+	if (on) {
+		rail_on_since = k_uptime_get();
+		k_sleep(K_MSEC(CONFIG_MAGTAG_WS2812_RAIL_SETTLE_MS));
+	}
+	else {
+		rail_on_total_ms += k_uptime_get() - rail_on_since;
+		/* LEDs lose their state without power, force the next blit */
+		shown_valid = false;
+		LOG_DBG("LED rail off, total on-time: %u ms", (uint32_t)rail_on_total_ms);
+	}
+}
+
+static void rail_off_work_handler(struct k_work *work)
+{
+	k_mutex_lock(&blit_mutex, K_FOREVER);
+	/* Only switch off if nothing was lit since this was scheduled */
+	if (shown_valid && frame_is_black(shown, STRIP_NUM_PIXELS)) {
+		rail_set(false);
+	}
+	k_mutex_unlock(&blit_mutex);
+}
+
+static K_WORK_DELAYABLE_DEFINE(rail_off_work, rail_off_work_handler);
+
+static bool rgb_equal(const struct led_rgb *a, const struct led_rgb *b)
+{
+	return (a->r == b->r) && (a->g == b->g) && (a->b == b->b);
+}
+
 void ws2812_blit(const struct device *dev, struct led_color_state *states, uint8_t pix_count)
 {
 	struct led_rgb buffer[pix_count];
+	bool changed = false;
+
+	k_spinlock_key_t key = k_spin_lock(&anim_lock);
 	for (uint8_t i=0; i<pix_count; i++)
 	{
-        if (states[i].state == 0)
-        {
-		    memcpy(&buffer[i], &colors[0], sizeof(struct led_rgb));
-        }
-        else
-        {
-            memcpy(&buffer[i], &colors[states[i].color], sizeof(struct led_rgb));
-        }
+		if (i < STRIP_NUM_PIXELS && (anim_active & BIT(i)))
+		{
+			buffer[i] = anim_frame[i];
+		}
+		else if (states[i].state == 0)
+		{
+			buffer[i] = colors[BLACK];
+		}
+		else
+		{
+			buffer[i] = states[i].color;
+		}
+	}
+	k_spin_unlock(&anim_lock, key);
+
+	k_mutex_lock(&blit_mutex, K_FOREVER);
+	for (uint8_t i=0; i<pix_count; i++) {
+		buffer[i].r = output_lut[buffer[i].r];
+		buffer[i].g = output_lut[buffer[i].g];
+		buffer[i].b = output_lut[buffer[i].b];
+	}
+
+	bool black = frame_is_black(buffer, pix_count);
+	if (!black) {
+		k_work_cancel_delayable(&rail_off_work);
+		rail_set(true);
+	}
+
+	if (!rail_on) {
+		/* Unpowered LEDs are already dark */
+		changed = false;
+	}
+	else if (pix_count != STRIP_NUM_PIXELS || !shown_valid) {
+		changed = true;
+	}
+	else {
+		for (uint8_t i=0; i<pix_count; i++) {
+			if (!rgb_equal(&buffer[i], &shown[i])) {
+				changed = true;
+				break;
+			}
+		}
+	}
+
+	if (changed) {
+		/* The driver may overwrite buffer, so take the copy first */
+		if (pix_count == STRIP_NUM_PIXELS) {
+			memcpy(shown, buffer, sizeof(shown));
+			shown_valid = true;
+		}
+		led_strip_update_rgb(strip, buffer, pix_count);
+		latency_mark(LATENCY_LED_BLIT);
+	}
+
+	if (black && rail_on && CONFIG_MAGTAG_WS2812_RAIL_IDLE_MS > 0) {
+		/* Does not restart a pending timeout, idle counts from first black */
+		k_work_schedule(&rail_off_work, K_MSEC(CONFIG_MAGTAG_WS2812_RAIL_IDLE_MS));
+	}
+	k_mutex_unlock(&blit_mutex);
+}
+
+static void anim_blit_work_handler(struct k_work *work)
+{
+	ws2812_blit(strip, led_states, STRIP_NUM_PIXELS);
+}
+
+static K_WORK_DEFINE(anim_blit_work, anim_blit_work_handler);
+
+static uint8_t anim_mix_channel(uint8_t a, uint8_t b, uint32_t p)
+{
+	return (uint8_t)((int32_t)a + (((int32_t)b - (int32_t)a) * (int32_t)p) / ANIM_Q16_ONE);
+}
+
+static struct led_rgb anim_mix(struct led_rgb a, struct led_rgb b, uint32_t p)
+{
+	struct led_rgb out = a;
+
+	out.r = anim_mix_channel(a.r, b.r, p);
+	out.g = anim_mix_channel(a.g, b.g, p);
+	out.b = anim_mix_channel(a.b, b.b, p);
+	return out;
+}
+
+/**
+ * @brief Compute the color of one animated pixel at a point in time
+ *
+ * @param slot      the pixel's animation
+ * @param now       uptime in ms
+ * @param finished  set true when a one-shot animation has completed
+ */
+static struct led_rgb anim_compute(const struct led_anim_slot *slot, int64_t now, bool *finished)
+{
+	const struct led_anim *a = &slot->anim;
+	uint32_t elapsed = (uint32_t)(now - slot->start_ms);
+	uint32_t p;
+
+	*finished = false;
+	if (a->type == LED_ANIM_SOLID || a->period_ms == 0) {
+		return a->color_a;
+	}
+
+	if (a->type == LED_ANIM_FADE && elapsed >= a->period_ms) {
+		*finished = true;
+		return a->color_b;
+	}
+
+	elapsed = (elapsed + a->phase_ms) % a->period_ms;
+	p = (elapsed * (uint32_t)ANIM_Q16_ONE) / a->period_ms;
+
+	switch (a->type) {
+		case LED_ANIM_FADE:
+			return anim_mix(a->color_a, a->color_b, p);
+		case LED_ANIM_BREATHE:
+			/* Triangle wave, squared so the ramp looks even to the eye */
+			p = (p < ANIM_Q16_ONE / 2) ? p * 2 : (ANIM_Q16_ONE - p) * 2;
+			p = (uint32_t)(((uint64_t)p * p) / ANIM_Q16_ONE);
+			return anim_mix(a->color_a, a->color_b, p);
+		case LED_ANIM_BLINK:
+			return (p < ANIM_Q16_ONE / 2) ? a->color_a : a->color_b;
+		case LED_ANIM_CHASE:
+			return (p < ANIM_Q16_ONE / STRIP_NUM_PIXELS) ? a->color_a : a->color_b;
+		default:
+			return a->color_a;
+	}
+}
+
+/*
+ * Runs in ISR context: compute the next frame and hand the blit off to the
+ * system workqueue only when a pixel actually changed.
+ */
+static void anim_timer_handler(struct k_timer *timer)
+{
+	int64_t now = k_uptime_get();
+	bool changed = false;
+	bool dynamic = false;
+
+	k_spinlock_key_t key = k_spin_lock(&anim_lock);
+	for (uint8_t i=0; i<STRIP_NUM_PIXELS; i++) {
+		if (!(anim_active & BIT(i))) {
+			continue;
+		}
+
+		bool finished;
+		struct led_rgb c = anim_compute(&anim_slots[i], now, &finished);
+
+		if (finished) {
+			anim_slots[i].anim.type = LED_ANIM_SOLID;
+			anim_slots[i].anim.color_a = c;
+		}
+		if (anim_slots[i].anim.type != LED_ANIM_SOLID) {
+			dynamic = true;
+		}
+		if (!rgb_equal(&c, &anim_frame[i])) {
+			anim_frame[i] = c;
+			changed = true;
+		}
+	}
+	k_spin_unlock(&anim_lock, key);
+
+	if (!dynamic) {
+		/* Everything is static, no need to keep ticking */
+		k_timer_stop(timer);
+	}
+	if (changed) {
+		k_work_submit(&anim_blit_work);
+	}
+}
+
+static K_TIMER_DEFINE(anim_timer, anim_timer_handler, NULL);
+
+/**
+ * @brief Start an animation on one pixel
+ *
+ * The animation overrides led_states for this pixel until it is stopped.
+ *
+ * @param pixel_n   the pixel number
+ * @param anim      animation parameters (copied)
+ */
+void ws2812_anim_start(uint8_t pixel_n, const struct led_anim *anim)
+{
+	if (pixel_n >= STRIP_NUM_PIXELS) return;
+
+	k_spinlock_key_t key = k_spin_lock(&anim_lock);
+	anim_slots[pixel_n].anim = *anim;
+	anim_slots[pixel_n].start_ms = k_uptime_get();
+	anim_active |= BIT(pixel_n);
+	k_spin_unlock(&anim_lock, key);
+
+	/* First tick computes a frame right away */
+	k_timer_start(&anim_timer, K_NO_WAIT, K_MSEC(ANIM_FRAME_MS));
+}
+
+/**
+ * @brief Run a single lit pixel around the strip
+ *
+ * @param color_a   color of the lit pixel
+ * @param color_b   color of the other pixels
+ * @param period_ms time for one full lap
+ */
+void ws2812_anim_chase(struct led_rgb color_a, struct led_rgb color_b, uint16_t period_ms)
+{
+	struct led_anim anim = {
+		.type = LED_ANIM_CHASE,
+		.color_a = color_a,
+		.color_b = color_b,
+		.period_ms = period_ms,
+	};
+
+	for (uint8_t i=0; i<STRIP_NUM_PIXELS; i++) {
+		anim.phase_ms = (uint16_t)(((uint32_t)period_ms * (STRIP_NUM_PIXELS - i)) / STRIP_NUM_PIXELS) % period_ms;
+		ws2812_anim_start(i, &anim);
+	}
+}
+
+/**
+ * @brief Stop animating a pixel and return it to its led_states value
+ *
+ * @param pixel_n   the pixel number
+ */
+void ws2812_anim_stop(uint8_t pixel_n)
+{
+	if (pixel_n >= STRIP_NUM_PIXELS) return;
+
+	k_spinlock_key_t key = k_spin_lock(&anim_lock);
+	anim_active &= ~BIT(pixel_n);
+	k_spin_unlock(&anim_lock, key);
+
+	k_work_submit(&anim_blit_work);
+}
+
+void ws2812_anim_stop_all(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&anim_lock);
+	anim_active = 0;
+	k_spin_unlock(&anim_lock, key);
+
+	k_timer_stop(&anim_timer);
+	k_work_submit(&anim_blit_work);
+}
+
+/**
+ * @brief Show device status on the LEDs without app involvement
+ *
+ * Calling again with the current status does not restart the animation, so
+ * this is safe to call every time through a loop.
+ *
+ * @param status    LED_STATUS_NONE returns the LEDs to led_states
+ */
+void ws2812_status(enum led_status status)
+{
+	if (status == current_status) return;
+	current_status = status;
+
+	ws2812_anim_stop_all();
+
+	switch (status) {
+		case LED_STATUS_CONNECTING:
+		{
+			/* Two blue pixels breathing in the middle of the strip */
+			struct led_anim off = { .type = LED_ANIM_SOLID, .color_a = colors[BLACK] };
+			struct led_anim breathe = {
+				.type = LED_ANIM_BREATHE,
+				.color_a = colors[BLACK],
+				.color_b = colors[BLUE],
+				.period_ms = 2000,
+			};
+			ws2812_anim_start(0, &off);
+			ws2812_anim_start(1, &breathe);
+			ws2812_anim_start(2, &breathe);
+			ws2812_anim_start(3, &off);
+			break;
+		}
+		case LED_STATUS_STREAMING:
+			ws2812_anim_chase(colors[GREEN], colors[BLACK], 2000);
+			break;
+		case LED_STATUS_ERROR:
+		{
+			struct led_anim blink = {
+				.type = LED_ANIM_BLINK,
+				.color_a = colors[RED],
+				.color_b = colors[BLACK],
+				.period_ms = 500,
+			};
+			for (uint8_t i=0; i<STRIP_NUM_PIXELS; i++) {
+				ws2812_anim_start(i, &blink);
+			}
+			break;
+		}
+		default:
+			break;
 	}
-	led_strip_update_rgb(strip, buffer, pix_count);
 }
 
 void ws2812_init(void) {
 	/* ws2812 */
 
+	build_output_lut();
+
 	for (uint8_t i=0; i<STRIP_NUM_PIXELS; i++) {
-		led_states[i].color = 0;
+		led_states[i].color = colors[BLACK];
 		led_states[i].state = -1;
 	}
 
@@ -70,21 +464,147 @@ void ws2812_init(void) {
 	LOG_DBG("Fixing ESP32s2 Register %p Value: 0x%x", myreg, *myreg);
 	#endif
 
-	/* Turn on power to the ws2812 neopixels */
-	const struct gpio_dt_spec neopower_dev = GPIO_DT_SPEC_GET(NEOPOWER_NODE, gpios);
+	/*
+	 * Start with the ws2812 power rail off, it is switched on by the first
+	 * blit that lights a pixel
+	 */
 	int ret = gpio_pin_configure_dt(&neopower_dev, GPIO_OUTPUT_ACTIVE);
 	if (ret < 0) {
 		LOG_ERR("Failed to configure NEOPOWER pin: %d", ret);
 	}
 
-	gpio_pin_set_dt(&neopower_dev, 0);
+	if (CONFIG_MAGTAG_WS2812_RAIL_IDLE_MS == 0) {
+		/* Gating disabled, keep the rail on */
+		k_mutex_lock(&blit_mutex, K_FOREVER);
+		rail_set(true);
+		k_mutex_unlock(&blit_mutex);
+	}
+}
+
+/**
+ * @brief Total time the ws2812 power rail has been switched on
+ *
+ * @return on-time in ms since boot, including the current on period
+ */
+int64_t ws2812_rail_on_time_ms(void)
+{
+	int64_t total;
+
+	k_mutex_lock(&blit_mutex, K_FOREVER);
+	total = rail_on_total_ms;
+	if (rail_on) {
+		total += k_uptime_get() - rail_on_since;
+	}
+	k_mutex_unlock(&blit_mutex);
+
+	return total;
+}
+
+/**
+ * @brief Set the global LED brightness
+ *
+ * Applies to every pixel, including running animations, and takes effect on
+ * the next blit.
+ *
+ * @param level 0 (off) .. 255 (full output)
+ */
+void ws2812_set_brightness(uint8_t level)
+{
+	k_mutex_lock(&blit_mutex, K_FOREVER);
+	brightness = level;
+	build_output_lut();
+	shown_valid = false;
+	k_mutex_unlock(&blit_mutex);
+
+	k_work_submit(&anim_blit_work);
+}
+
+uint8_t ws2812_get_brightness(void)
+{
+	return brightness;
+}
+
+/**
+ * @brief Convert HSV to RGB using integer math
+ *
+ * Hue is split into six 43-step regions around the color wheel.
+ *
+ * @param hsv   hue, saturation and value in 0..255
+ */
+struct led_rgb hsv_to_rgb(struct led_hsv hsv)
+{
+	struct led_rgb rgb = RGB(hsv.v, hsv.v, hsv.v);
+
+	if (hsv.s == 0) {
+		return rgb;
+	}
+
+	uint8_t region = hsv.h / 43;
+	uint8_t rem = (hsv.h - (region * 43)) * 6;
+	uint8_t p = (hsv.v * (255 - hsv.s)) >> 8;
+	uint8_t q = (hsv.v * (255 - ((hsv.s * rem) >> 8))) >> 8;
+	uint8_t t = (hsv.v * (255 - ((hsv.s * (255 - rem)) >> 8))) >> 8;
+
+	switch (region) {
+		case 0:
+			rgb.r = hsv.v; rgb.g = t; rgb.b = p;
+			break;
+		case 1:
+			rgb.r = q; rgb.g = hsv.v; rgb.b = p;
+			break;
+		case 2:
+			rgb.r = p; rgb.g = hsv.v; rgb.b = t;
+			break;
+		case 3:
+			rgb.r = p; rgb.g = q; rgb.b = hsv.v;
+			break;
+		case 4:
+			rgb.r = t; rgb.g = p; rgb.b = hsv.v;
+			break;
+		default:
+			rgb.r = hsv.v; rgb.g = p; rgb.b = q;
+			break;
+	}
+	return rgb;
+}
+
+/**
+ * @brief Convert RGB to HSV using integer math
+ *
+ * @param rgb   24-bit color
+ */
+struct led_hsv rgb_to_hsv(struct led_rgb rgb)
+{
+	struct led_hsv hsv = { 0 };
+	uint8_t min = MIN(rgb.r, MIN(rgb.g, rgb.b));
+	uint8_t max = MAX(rgb.r, MAX(rgb.g, rgb.b));
+	uint8_t delta = max - min;
+
+	hsv.v = max;
+	if (delta == 0) {
+		return hsv;
+	}
+
+	hsv.s = (uint8_t)((255 * (uint16_t)delta) / max);
+
+	if (max == rgb.r) {
+		hsv.h = (uint8_t)(0 + (43 * ((int16_t)rgb.g - rgb.b)) / delta);
+	}
+	else if (max == rgb.g) {
+		hsv.h = (uint8_t)(85 + (43 * ((int16_t)rgb.b - rgb.r)) / delta);
+	}
+	else {
+		hsv.h = (uint8_t)(171 + (43 * ((int16_t)rgb.r - rgb.g)) / delta);
+	}
+	return hsv;
 }
 
 /**
  * @brief Immediately show these colors on the LEDs
  *
  * This sets each LED color (use defines like RED, BLUE) and assigns their
- * toggle value to -1 which overrides any previously set on/off value
+ * toggle value to -1 which overrides any previously set on/off value. Any
+ * running animations are stopped.
  *
  * @param led3 
  * @param led2 
@@ -92,46 +612,104 @@ void ws2812_init(void) {
  * @param led0 
  */
 void leds_immediate(uint8_t led3, uint8_t led2, uint8_t led1, uint8_t led0) {
-	if (led0 < ARRAY_SIZE(colors)) set_pixel(led_states, 0, led0, -1);
-	if (led1 < ARRAY_SIZE(colors)) set_pixel(led_states, 1, led1, -1);
-	if (led2 < ARRAY_SIZE(colors)) set_pixel(led_states, 2, led2, -1);
-	if (led3 < ARRAY_SIZE(colors)) set_pixel(led_states, 3, led3, -1);
+	current_status = LED_STATUS_NONE;
+	ws2812_anim_stop_all();
+	if (led0 < ARRAY_SIZE(colors)) set_pixel(led_states, 0, colors[led0], -1);
+	if (led1 < ARRAY_SIZE(colors)) set_pixel(led_states, 1, colors[led1], -1);
+	if (led2 < ARRAY_SIZE(colors)) set_pixel(led_states, 2, colors[led2], -1);
+	if (led3 < ARRAY_SIZE(colors)) set_pixel(led_states, 3, colors[led3], -1);
 	ws2812_blit(strip, led_states, STRIP_NUM_PIXELS);
 }
 
-static uint16_t get_fasthash(const char *word)
+/* Must match color_slot() in utility/color_names_to_header.py */
+static uint8_t color_slot(uint32_t h, uint8_t d)
+{
+	uint32_t x = h ^ ((uint32_t)d * 0x9E3779B1u);
+
+	x ^= x >> 15;
+	x *= 0x2C1B3C6Du;
+	x ^= x >> 12;
+	return x & (COLOR_NAME_SLOTS - 1);
+}
+
+static int hex_nibble(char c)
 {
-	uint16_t sum = 0;
-	for (uint8_t i=0; i<strlen(word); i++) {
-		sum ^= (uint16_t) word[i];
+	if (c >= '0' && c <= '9') return c - '0';
+	c |= 0x20; /* lowercase */
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+static int color_from_hex(const char *hex, struct led_rgb *rgb)
+{
+	uint32_t val = 0;
+
+	/* A short string fails here on its NUL terminator */
+	for (uint8_t i=0; i<6; i++) {
+		int n = hex_nibble(hex[i]);
+		if (n < 0) return -EINVAL;
+		val = (val << 4) | n;
+	}
+	if (hex[6] != '\0') return -EINVAL;
+
+	rgb->r = (val >> 16) & 0xFF;
+	rgb->g = (val >> 8) & 0xFF;
+	rgb->b = val & 0xFF;
+	return 0;
+}
+
+/**
+ * @brief Look up a CSS color name or a "#rrggbb" hex string
+ *
+ * Names are case-insensitive. A single pass over the string lowercases it and
+ * computes the hash; the perfect hash then yields exactly one candidate which
+ * is compared to reject unknown names. No allocation, safe to call from
+ * Golioth callbacks.
+ *
+ * @param name  NUL-terminated color string
+ * @param rgb   receives the color on success
+ * @return 0 on success, -EINVAL if malformed, -ENOENT if not a known name
+ */
+int color_from_name(const char *name, struct led_rgb *rgb)
+{
+	char lower[COLOR_NAME_MAX_LEN + 1];
+	uint32_t h = COLOR_NAME_SEED;
+	uint8_t len;
+
+	if (name[0] == '#') {
+		return color_from_hex(name + 1, rgb);
 	}
-	return sum;
+
+	for (len = 0; name[len] != '\0'; len++) {
+		if (len >= COLOR_NAME_MAX_LEN) return -EINVAL;
+
+		char c = name[len];
+		if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+		lower[len] = c;
+		h = (h ^ (uint8_t)c) * 0x01000193u;
+	}
+	lower[len] = '\0';
+
+	uint8_t d = color_name_displace[h & (COLOR_NAME_BUCKETS - 1)];
+	uint8_t idx = color_name_slots[color_slot(h, d)];
+	if (idx == 0 || strcmp(color_names[idx - 1].name, lower) != 0) {
+		return -ENOENT;
+	}
+
+	rgb->r = (color_names[idx - 1].rgb >> 16) & 0xFF;
+	rgb->g = (color_names[idx - 1].rgb >> 8) & 0xFF;
+	rgb->b = color_names[idx - 1].rgb & 0xFF;
+	return 0;
 }
 
 void set_leds(uint8_t led_num, const char * l_color, int8_t l_state)
 {
-	uint8_t color;
-	switch(get_fasthash(l_color))
-	{
-		case (111):
-			LOG_INF("LED #%d is black!!!", led_num);
-			color = 0;
-			break;
-		case (115):
-			LOG_INF("LED #%d is red!!!", led_num);
-			color = 1;
-			break;
-		case (123):
-			LOG_INF("LED #%d is green!!!", led_num);
-			color = 2;
-			break;
-		case (30):
-			LOG_INF("LED #%d is blue!!!", led_num);
-			color = 3;
-			break;
-		default:
-			/* not a valid color name */
-			return;
+	struct led_rgb color;
+
+	if (color_from_name(l_color, &color) != 0) {
+		/* not a valid color name */
+		return;
 	}
+	LOG_INF("LED #%d is %s!!!", led_num, l_color);
 	set_pixel(led_states, led_num, color, l_state);
 }
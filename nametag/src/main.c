@@ -42,12 +42,31 @@ struct nametag_ctx nametag_ctx_arr[3] = {
 /* Golioth platform includes */
 #include <net/golioth/system_client.h>
 #include <samples/common/net_connect.h>
+#include <zephyr/data/json.h>
 #include <zephyr/net/coap.h>
 
+/* All three fields as one LightDB State object */
+#define NAMETAG_ENDPOINT	SETTINGS_ROOT
+#define NAMETAG_JSON_LEN	256
+
+struct nametag_json {
+	const char *name;
+	const char *title;
+	const char *handle;
+};
+
+/* Same order as nametag_ctx_arr, json_obj_parse() sets bit i for entry i */
+static const struct json_obj_descr nametag_json_descr[] = {
+	JSON_OBJ_DESCR_PRIM(struct nametag_json, name, JSON_TOK_STRING),
+	JSON_OBJ_DESCR_PRIM(struct nametag_json, title, JSON_TOK_STRING),
+	JSON_OBJ_DESCR_PRIM(struct nametag_json, handle, JSON_TOK_STRING),
+};
+
 /* MagTag specific hardware includes */
 #include "magtag-common/magtag_epaper.h"
 #include "magtag-common/ws2812_control.h"
 #include "magtag-common/buttons.h"
+#include "magtag-common/latency.h"
 
 /* Images for the epaper screen */
 #include "../golioth_nametag.h"
@@ -56,9 +75,6 @@ struct nametag_ctx nametag_ctx_arr[3] = {
 #include "../frame2.h"
 #include "../frame3.h"
 
-#define DEBOUNCE_MS	200
-volatile uint64_t debounce = 0;
-
 #define BUTTON_ACTION_ARRAY_SIZE	16
 #define BUTTON_ACTION_LEN		1
 K_MSGQ_DEFINE(button_action_msgq,
@@ -73,14 +89,19 @@ static K_SEM_DEFINE(user_update_choice, 0, 1);
 static K_SEM_DEFINE(wifi_control, 0, 1);
 static K_SEM_DEFINE(manual_get_complete, 0, 1);
 struct k_mutex epaper_mutex;
+/* Button presses from before this time happened during an ePaper write */
+static uint32_t screen_idle_since;
 
 /* Prototypes */
-bool process_update_and_store(char *new_data,
-		uint8_t len,
-		struct nametag_ctx ctx,
-		bool show_msgs);
 void refresh_delay_timer_handler(struct k_timer *dummy);
 
+/* End an ePaper write, presses that came in meanwhile will be ignored */
+static void epaper_unlock(void)
+{
+	screen_idle_since = k_uptime_get_32();
+	k_mutex_unlock(&epaper_mutex);
+}
+
 /* Timers */
 K_TIMER_DEFINE(refresh_delay_timer, refresh_delay_timer_handler, NULL);
 
@@ -115,11 +136,90 @@ struct settings_handler my_conf = {
 	.h_set = nametag_settings_set,
 };
 
-void remove_quotes(char *str_d, const char *str_s, uint8_t len_with_quotes) {
-	strcpy(str_d, str_s+1);
-	*(str_d+len_with_quotes-2) = '\0';
+/**
+ * @brief Parse a nametag object and apply all of its fields at once
+ *
+ * Fields missing from the object keep their value, nothing is applied if any
+ * field is too long. Runs on the system workqueue like the frame drawing, so
+ * a frame never shows a mix of old and new fields.
+ *
+ * @return number of fields changed, or a negative error code
+ */
+static int nametag_apply_json(char *json, size_t len)
+{
+	struct nametag_json doc;
+	int ret = json_obj_parse(json, len, nametag_json_descr,
+			ARRAY_SIZE(nametag_json_descr), &doc);
+
+	if (ret < 0) {
+		return ret;
+	}
+
+	const char *fields[] = { doc.name, doc.title, doc.handle };
+	uint32_t changed = 0;
+
+	for (uint8_t i=0; i<ARRAY_SIZE(fields); i++) {
+		if ((ret & BIT(i)) && strlen(fields[i]) >= NAME_SIZE) {
+			LOG_ERR("%s is too long", nametag_ctx_arr[i].key);
+			return -ENOMEM;
+		}
+	}
+
+	for (uint8_t i=0; i<ARRAY_SIZE(fields); i++) {
+		struct nametag_ctx *ctx = &nametag_ctx_arr[i];
+
+		if (!(ret & BIT(i)) || strcmp(fields[i], ctx->data) == 0) {
+			continue;
+		}
+		memset(ctx->data, 0, NAME_SIZE);
+		strcpy(ctx->data, fields[i]);
+		changed |= BIT(i);
+	}
+
+	/* Flash writes only after every field is in place */
+	for (uint8_t i=0; i<ARRAY_SIZE(fields); i++) {
+		struct nametag_ctx *ctx = &nametag_ctx_arr[i];
+
+		if (!(changed & BIT(i))) {
+			continue;
+		}
+		LOG_DBG("Saving: %s", ctx->end_p);
+		int err = settings_save_one(ctx->end_p, (const void *)ctx->data, NAME_SIZE);
+		if (err) {
+			LOG_DBG("failed to write: %s %d", ctx->data, strlen(ctx->data));
+		}
+	}
+	return POPCOUNT(changed);
+}
+
+/* Latest observed object, applied by nametag_update_work */
+static char _update_json[NAMETAG_JSON_LEN];
+static size_t _update_len;
+static struct k_spinlock update_lock;
+
+static void nametag_update_work_handler(struct k_work *work)
+{
+	char json[NAMETAG_JSON_LEN];
+
+	k_spinlock_key_t key = k_spin_lock(&update_lock);
+	size_t len = _update_len;
+
+	memcpy(json, _update_json, len);
+	k_spin_unlock(&update_lock, key);
+
+	int changed = nametag_apply_json(json, len);
+
+	if (changed < 0) {
+		LOG_ERR("Invalid nametag update: %d", changed);
+	}
+	else if (changed > 0) {
+		LOG_DBG("Successfully updated %d field(s)", changed);
+		k_timer_start(&refresh_delay_timer, K_MSEC(1500), K_NO_WAIT);
+	}
 }
 
+K_WORK_DEFINE(nametag_update_work, nametag_update_work_handler);
+
 static int update_handler(struct golioth_req_rsp *rsp)
 {
 	if (!k_sem_count_get(&manual_get_complete)) {
@@ -132,18 +232,23 @@ static int update_handler(struct golioth_req_rsp *rsp)
 		return rsp->err;
 	}
 
-	struct nametag_ctx *ctx = (struct nametag_ctx*)rsp->user_data;
 	LOG_HEXDUMP_INF(rsp->data, rsp->len, "Data");
-	LOG_DBG("Userdata: %s", ctx->key);
+	if (rsp->len >= NAMETAG_JSON_LEN) {
+		LOG_ERR("Nametag update too long: %zu", rsp->len);
+		return -ENOMEM;
+	}
+	if (rsp->len == 0 || rsp->data[0] != '{') {
+		/* "null" until the object is created on Golioth */
+		return 0;
+	}
 
-	/* hacks to deal with rsp->data being wrapped in quotes */
-	char nametag_data[NAME_SIZE];
-	remove_quotes(nametag_data, rsp->data, rsp->len);
+	/* Parse on the workqueue, where the frames are drawn */
+	k_spinlock_key_t key = k_spin_lock(&update_lock);
 
-	if (process_update_and_store(nametag_data, rsp->len, *ctx, false)) {
-		LOG_DBG("Successfully updated");
-		k_timer_start(&refresh_delay_timer, K_MSEC(1500), K_NO_WAIT);
-	}
+	memcpy(_update_json, rsp->data, rsp->len);
+	_update_len = rsp->len;
+	k_spin_unlock(&update_lock, key);
+	k_work_submit(&nametag_update_work);
 	return 0;
 }
 
@@ -151,96 +256,49 @@ static void golioth_on_connect(struct golioth_client *client)
 {
 	k_sem_give(&connected);
 
-	int err;
-
-	for (uint8_t i=0; i<ARRAY_SIZE(nametag_ctx_arr); i++) {
-		err = golioth_lightdb_observe_cb(client, nametag_ctx_arr[i].key,
-					 GOLIOTH_CONTENT_FORMAT_APP_JSON,
-					 update_handler, &nametag_ctx_arr[i]);
+	int err = golioth_lightdb_observe_cb(client, NAMETAG_ENDPOINT,
+				 GOLIOTH_CONTENT_FORMAT_APP_JSON,
+				 update_handler, NULL);
 
-		if (err) {
-			LOG_WRN("failed to observe lightdb path: %d", err);
-		}
+	if (err) {
+		LOG_WRN("failed to observe lightdb path: %d", err);
 	}
 }
 
-bool process_update_and_store(char *new_data,
-		uint8_t len,
-		struct nametag_ctx ctx,
-		bool show_msgs) {
+/* One get for all three fields */
+int fetch_nametag_from_golioth(void) {
+	uint8_t json[NAMETAG_JSON_LEN];
+	size_t len = sizeof(json);
 
-	int err = 0;
-	char line_buf[32];
-	snprintk(line_buf, sizeof(line_buf), "Fetching %s... Success!", ctx.key);
-	if (show_msgs) {
-		epaper_autowrite(line_buf, strlen(line_buf));
+	if (!golioth_is_connected(client)) {
+		return -ENETDOWN;
 	}
 
-	if (strcmp(new_data, ctx.data)==0) {
-		LOG_DBG("Local data already up-to-date");
-		if (show_msgs) {
-			epaper_autowrite("No change", 9);
-		}
-	}
-	else {
-		memcpy(ctx.data, new_data, NAME_SIZE);
+	LOG_INF("Fetching nametag information from Golioth LightDB State");
+	int err = golioth_lightdb_get(client,
+				NAMETAG_ENDPOINT,
+				GOLIOTH_CONTENT_FORMAT_APP_JSON,
+				json,
+				&len);
 
-		LOG_DBG("Saving: %s", ctx.end_p);
-		err = settings_save_one(ctx.end_p, (const void *)ctx.data, NAME_SIZE);
-		if (err) {
-			LOG_DBG("failed to write: %s %d", ctx.data, strlen(ctx.data));
-		}
-		else {
-			LOG_DBG("Saved to flash");
-			if (show_msgs) {
-				epaper_autowrite("Saved to flash", 14);
-			}
-		}
-		return true;
+	if (err) {
+		LOG_ERR("Unable to fetch name information from Golioth: %d", err);
+		return err;
 	}
-	return false;
-}
 
-int fetch_name_from_golioth(struct nametag_ctx ctx) {
-	int err = 0;
-	static uint8_t row_idx = 1;
-
-	if (!golioth_is_connected(client)) {
-		err = -ENETDOWN;
+	if (len == 0 || json[0] != '{') {
+		LOG_INF("Endpoint doesn't exist: %s", NAMETAG_ENDPOINT);
+		return 0;
 	}
-	else {
-		LOG_INF("Fetching %s information from Golioth LightDB State", ctx.key);
-		uint8_t name_update[NAME_SIZE];
-		size_t len = NAME_SIZE;
-		int err = golioth_lightdb_get(client,
-					ctx.key,
-					GOLIOTH_CONTENT_FORMAT_APP_JSON,
-					name_update,
-					&len);
 
-		if (err) {
-			LOG_ERR("Unable to fetch name information from Golioth: %d", err);
-			epaper_Write("Unable to fetch", 15, (row_idx++)*2, FULL_WIDTH, 2);
-			return err;
-		}
+	int changed = nametag_apply_json((char *)json, len);
 
-		if (strncmp(name_update, "null", 4)==0) {
-			epaper_autowrite("Endpoint missing on Golioth", 27);
-			LOG_INF("Endpoint doesn't exist: %s", ctx.key);
-		}
-		else {
-			/* hack to remove quotes received with JSON string */
-			char nametag_data[NAME_SIZE];
-			remove_quotes(nametag_data, name_update, len);
-
-			LOG_INF("Received %s: %s", ctx.key, nametag_data);
-			process_update_and_store(nametag_data,
-					strlen(nametag_data),
-					ctx,
-					true);
-		}
+	if (changed < 0) {
+		LOG_ERR("Invalid nametag information: %d", changed);
+		return changed;
 	}
-	return err;
+	LOG_INF("Received nametag, %d field(s) changed", changed);
+	return 0;
 }
 
 enum nametag_colors{
@@ -253,10 +311,10 @@ enum nametag_colors{
 
 void led_color_changer(enum nametag_colors n_color) {
 	if (n_color == RAINBOW) {
-		led_states[0].color = RED;
-		led_states[1].color = GREEN;
-		led_states[2].color = BLUE;
-		led_states[3].color = YELLOW;
+		led_states[0].color = colors[RED];
+		led_states[1].color = colors[GREEN];
+		led_states[2].color = colors[BLUE];
+		led_states[3].color = colors[YELLOW];
 		ws2812_blit(strip, led_states, STRIP_NUM_PIXELS);
 		return;
 	}
@@ -280,7 +338,7 @@ void led_color_changer(enum nametag_colors n_color) {
 	}
 
 	for (uint8_t i=0; i<4; i++) {
-		led_states[i].color = preset;
+		led_states[i].color = colors[preset];
 	}
 	ws2812_blit(strip, led_states, STRIP_NUM_PIXELS);
 }
@@ -298,7 +356,7 @@ void nametag_blue(void) {
 	epaper_WriteInverted("my name is", 10, 4, CENTER, 1);
 	epaper_Write(_myname, strlen(_myname), 8, CENTER, 4);
 
-	k_mutex_unlock(&epaper_mutex);
+	epaper_unlock();
 }
 
 void nametag_green(void) {
@@ -346,7 +404,7 @@ void nametag_green(void) {
 	epaper_Write(firstname, strlen(firstname), 5, 216, 4);
 	epaper_Write(lastname, strlen(lastname), 10, 216, 4);
 
-	k_mutex_unlock(&epaper_mutex);
+	epaper_unlock();
 }
 
 void nametag_red(void) {
@@ -363,7 +421,7 @@ void nametag_red(void) {
 	epaper_Write(_myname, strlen(_myname), 6, CENTER, 4);
 	epaper_Write(_handle, strlen(_handle), 13, 204, 2);
 
-	k_mutex_unlock(&epaper_mutex);
+	epaper_unlock();
 }
 
 /**
@@ -387,7 +445,7 @@ void nametag_training_challenge(void) {
 	epaper_WriteInverted(_title, strlen(_title), 11, CENTER, 2);
 	epaper_WriteInverted(_handle, strlen(_handle), 13, CENTER, 2);
 
-	k_mutex_unlock(&epaper_mutex);
+	epaper_unlock();
 }
 
 void nametag_yellow(void) {
@@ -403,7 +461,7 @@ void nametag_yellow(void) {
 	epaper_WriteInverted(_title, strlen(_title), 11, CENTER, 2);
 	epaper_WriteInverted(_handle, strlen(_handle), 13, CENTER, 2);
 
-	k_mutex_unlock(&epaper_mutex);
+	epaper_unlock();
 }
 
 void nametag_rainbow(void) {
@@ -414,31 +472,51 @@ void nametag_rainbow(void) {
 
 	LOG_INF("Fetching data");
 
+	/* Rainbow LEDs while fetching, the display only changes once it's done */
 	led_color_changer(RAINBOW);
 
-	epaper_FullClear();
-	epaper_autowrite("Fetching name from Golioth", 26);
-
-	int err;
-	for (uint8_t i=0; i<ARRAY_SIZE(nametag_ctx_arr); i++) {
-		err = fetch_name_from_golioth(nametag_ctx_arr[i]);
-		if (err != 0) {
-			if (err == -ENETDOWN) {
-				epaper_autowrite("Err: Not connected to Golioth", 29);
-			}
-			else {
-				epaper_autowrite("Unknown error", 13);
-			}
-			k_mutex_unlock(&epaper_mutex);
-			return;
+	int err = fetch_nametag_from_golioth();
+	if (err != 0) {
+		if (err == -ENETDOWN) {
+			epaper_autowrite("Err: Not connected to Golioth", 29);
 		}
+		else {
+			epaper_autowrite("Unable to fetch", 15);
+		}
+		epaper_unlock();
+		return;
 	}
-	k_mutex_unlock(&epaper_mutex);
+	epaper_unlock();
 	k_sem_give(&manual_get_complete);
 	nametag_yellow();
 }
 
 void button_action_work_handler(struct k_work *work) {
+	struct button_event evt;
+	bool tracking = false;
+
+	/* Queue a frame change for each button press */
+	while (buttons_get_event(&evt, K_NO_WAIT) == 0) {
+		if (evt.type != BUTTON_EVT_PRESS) {
+			continue;
+		}
+		if (epaper_mutex.lock_count > 0 ||
+				(int32_t)(evt.timestamp - screen_idle_since) < 0) {
+			/* ePaper write was in progress, ignore this press */
+			continue;
+		}
+
+		if (!tracking) {
+			/* Measure latency from the first press in this batch */
+			latency_begin(evt.cycles, BIT(LATENCY_EPD_REFRESH_START) |
+					BIT(LATENCY_EPD_REFRESH_DONE));
+			tracking = true;
+		}
+
+		LOG_INF("Button %c pressed", 'A'+evt.button);
+		k_msgq_put(&button_action_msgq, &evt.button, K_NO_WAIT);
+	}
+
 	while (k_msgq_num_used_get(&button_action_msgq)) {
 		uint8_t i;
 		k_msgq_get(&button_action_msgq, &i, K_NO_WAIT);
@@ -455,7 +533,7 @@ void button_action_work_handler(struct k_work *work) {
 				led_color_changer(RAINBOW);
 				if (k_mutex_lock(&epaper_mutex, K_SECONDS(1))==0) {
 					epaper_Write("Starting WiFi...", 16, 0, 160, 2);
-					k_mutex_unlock(&epaper_mutex);
+					epaper_unlock();
 				}
 				k_sem_give(&wifi_control);
 				k_sem_give(&user_update_choice);
@@ -488,54 +566,6 @@ void button_action_work_handler(struct k_work *work) {
 
 K_WORK_DEFINE(button_action_work, button_action_work_handler);
 
-/**
- * @brief Handle button presses and update LEDs
- *
- * This function will update the on/off state of the LED by setting turning the
- * actual LED on or off and writing the new value to LightDB state
- *
- * @param dev 	device struct
- * @param cb 	callback struct
- * @param pins 	pinmask representing buttons that are pressed
- */
-void button_pressed(const struct device *dev, struct gpio_callback *cb,
-		uint32_t pins)
-{
-	if (debounce > k_uptime_ticks())
-	{
-		/* too soon to register another button press */
-		return;
-	}
-	else if (epaper_mutex.lock_count > 0) {
-		/* ePaper write is in progress, disable button presses */
-		return;
-	}
-	else
-	{
-		/* register the timeout value for the next press */
-		debounce = sys_clock_timeout_end_calc(K_MSEC(DEBOUNCE_MS));
-	}
-
-	/* Array to check which button was pressed */
-	uint32_t button_result[] = {
-		pins & BIT(button0.pin),
-		pins & BIT(button1.pin),
-		pins & BIT(button2.pin),
-		pins & BIT(button3.pin)
-	};
-
-	/* Process each button press that was detected */
-	for (uint8_t i=0; i<4; i++) {
-		if (button_result[i] != 0)
-		{
-			LOG_INF("Button %c pressed", 'A'+i);
-			k_msgq_put(&button_action_msgq, &i, K_NO_WAIT);
-		}
-	}
-
-	k_work_submit(&button_action_work);
-}
-
 void refresh_delay_timer_handler(struct k_timer *dummy)
 {
 	uint8_t new_frame = DEFAULT_FRAME;
@@ -563,14 +593,14 @@ void main(void)
 	settings_load();
 
 	ws2812_init();
-	led_states[0].color = BLUE; led_states[0].state = 1;
-	led_states[1].color = BLUE; led_states[1].state = 1;
-	led_states[2].color = BLACK; led_states[2].state = 1;
-	led_states[3].color = BLACK; led_states[3].state = 1;
+	led_states[0].color = colors[BLUE]; led_states[0].state = 1;
+	led_states[1].color = colors[BLUE]; led_states[1].state = 1;
+	led_states[2].color = colors[BLACK]; led_states[2].state = 1;
+	led_states[3].color = colors[BLACK]; led_states[3].state = 1;
 	ws2812_blit(strip, led_states, STRIP_NUM_PIXELS);
 
 	/* buttons */
-	buttons_init(button_pressed);
+	buttons_init(&button_action_work);
 
 	epaper_hardware_init();
 	epaper_FullClear();
@@ -12,40 +12,46 @@ LOG_MODULE_REGISTER(golioth_magtag, LOG_LEVEL_DBG);
 /* MagTag specific hardware includes */
 #include "magtag-common/magtag_epaper.h"
 #include "magtag-common/ws2812_control.h"
+#include "magtag-common/json-helper.h"
+#include "magtag-common/startup.h"
 
 /* Golioth platform includes */
 #include <net/golioth/system_client.h>
 #include <net/golioth/rpc.h>
-#include <samples/common/net_connect.h>
 #include <qcbor/qcbor.h>
 #include <qcbor/qcbor_spiffy_decode.h>
 #include <zephyr/net/coap.h>
+#include <zephyr/net/buf.h>
+#include <zephyr/sys/base64.h>
 
 static struct golioth_client *client = GOLIOTH_SYSTEM_CLIENT_GET();
-static K_SEM_DEFINE(connected, 0, 1);
 static struct coap_reply coap_replies[1];
 #define LEDS_ENDPOINT		"leds"
 #define LEDS_DEFAULT_MASK	15
+#define REGION_ENDPOINT		"epaper_region"
 uint8_t led_bitmask;
 
-#define LINE_ARRAY_SIZE		16
-#define LINE_STRING_LEN		28	/* must be a multiple of 4!! */
-K_MSGQ_DEFINE(line_msgq, LINE_STRING_LEN, LINE_ARRAY_SIZE, 4);
+/*
+ * Display messages are sized to fit in one shared pool. Callbacks fill a
+ * buffer once and pass it by reference to the display worker, which frees it.
+ */
+#define MSG_POOL_COUNT		16
+#define MSG_POOL_BYTES		1024
+#define LINE_CHARS		(EPD_2IN9D_HEIGHT / 10)	/* 10x16 font */
+NET_BUF_POOL_VAR_DEFINE(msg_pool, MSG_POOL_COUNT, MSG_POOL_BYTES, 0, NULL);
+static K_FIFO_DEFINE(msg_fifo);
 
 /*
- * Work handler to read strings from a message queue and write them to the
- * ePaper display
+ * Work handler to take messages from the FIFO and write them to the ePaper
+ * display, wrapping long ones over several lines
  */
 void write_screen_from_buffer_work_handler(struct k_work *work) {
-	char str[LINE_STRING_LEN];
-	while(k_msgq_num_used_get(&line_msgq)) {
-		int err = k_msgq_get(&line_msgq, &str, K_NO_WAIT);
-		if (err) {
-			LOG_ERR("Error reading from message queue: %d", err);
-		}
-		else {
-			epaper_autowrite(str, strlen(str));
+	struct net_buf *buf;
+	while ((buf = net_buf_get(&msg_fifo, K_NO_WAIT)) != NULL) {
+		for (uint16_t off = 0; off < buf->len; off += LINE_CHARS) {
+			epaper_autowrite(buf->data + off, MIN(buf->len - off, LINE_CHARS));
 		}
+		net_buf_unref(buf);
 	}
 }
 K_WORK_DEFINE(write_screen_from_buffer_work, write_screen_from_buffer_work_handler);
@@ -65,18 +71,155 @@ void led_work_handler(struct k_work *work) {
 K_WORK_DEFINE(led_work, led_work_handler);
 
 /*
- * Helper function adds text strings to the ePaper message queue and calls the
- * work handler for the display
+ * Get a message buffer with room for len characters, NULL if the pool can't
+ * fit it right now
  */
-void write_to_screen(char *str, uint8_t len) {
-	if (k_msgq_put(&line_msgq, str, K_NO_WAIT) != 0) {
-		LOG_ERR("Message buffer is full, skipping ePaper write");
+static struct net_buf *screen_msg_alloc(size_t len) {
+	struct net_buf *buf = net_buf_alloc_len(&msg_pool, len, K_NO_WAIT);
+	if (!buf) {
+		LOG_ERR("Message pool is full, skipping ePaper write");
 	}
-	else {
+	return buf;
+}
+
+/*
+ * Hand a filled message to the display worker. Messages sent while the
+ * display is still being brought up are written by connected_work.
+ */
+static void screen_msg_send(struct net_buf *buf) {
+	net_buf_put(&msg_fifo, buf);
+	if (startup_wait_local(K_NO_WAIT) == 0) {
 		k_work_submit(&write_screen_from_buffer_work);
 	}
 }
 
+/*
+ * Helper function copies text into a message buffer and sends it to the
+ * display
+ */
+void write_to_screen(const char *str, size_t len) {
+	struct net_buf *buf = screen_msg_alloc(len);
+	if (buf) {
+		net_buf_add_mem(buf, str, len);
+		screen_msg_send(buf);
+	}
+}
+
+/*
+ * Format a message straight into a buffer sized to fit it
+ */
+static void screen_printf(const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	int len = vsnprintk(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	/* Room for the terminator vsnprintk() always writes */
+	struct net_buf *buf = screen_msg_alloc(len + 1);
+	if (!buf) {
+		return;
+	}
+	va_start(ap, fmt);
+	vsnprintk(net_buf_tail(buf), len + 1, fmt, ap);
+	va_end(ap);
+	net_buf_add(buf, len);
+	screen_msg_send(buf);
+}
+
+/*
+ * Display regions rendered by the backend (see utility/epaper_rle.py). The
+ * compressed data is copied or base64 decoded into the pool once, then
+ * decoded straight into the display's partial window by region_work.
+ */
+#define REGION_POOL_COUNT	4
+#define REGION_POOL_BYTES	6144	/* one full screen, even uncompressible */
+
+struct region {
+	uint16_t x;
+	uint16_t y;
+	uint16_t w;
+	uint16_t h;
+};
+NET_BUF_POOL_VAR_DEFINE(region_pool, REGION_POOL_COUNT, REGION_POOL_BYTES,
+		sizeof(struct region), NULL);
+static K_FIFO_DEFINE(region_fifo);
+
+void region_work_handler(struct k_work *work) {
+	struct net_buf *buf;
+	while ((buf = net_buf_get(&region_fifo, K_NO_WAIT)) != NULL) {
+		struct region *r = net_buf_user_data(buf);
+		epaper_DrawRle(buf->data, buf->len, r->x, r->y, r->w, r->h);
+		net_buf_unref(buf);
+	}
+}
+K_WORK_DEFINE(region_work, region_work_handler);
+
+/*
+ * Queue a region for the display. x, y, w, h are in display RAM coordinates,
+ * data is a CBOR byte string of PackBits data or a text string of it in
+ * base64, as JSON from the Golioth console can't carry bytes.
+ */
+static int queue_region(const uint64_t xywh[4], const QCBORItem *data) {
+	struct region r;
+	size_t len = data->val.string.len;
+
+	for (uint8_t i = 0; i < 4; i++) {
+		if (xywh[i] > UINT16_MAX) {
+			return -EINVAL;
+		}
+	}
+	r = (struct region){ xywh[0], xywh[1], xywh[2], xywh[3] };
+
+	if (data->uDataType == QCBOR_TYPE_TEXT_STRING) {
+		len = len / 4 * 3;
+	}
+	else if (data->uDataType != QCBOR_TYPE_BYTE_STRING) {
+		return -EINVAL;
+	}
+
+	struct net_buf *buf = net_buf_alloc_len(&region_pool, len, K_NO_WAIT);
+	if (!buf) {
+		LOG_ERR("Region pool is full, skipping ePaper update");
+		return -ENOMEM;
+	}
+
+	if (data->uDataType == QCBOR_TYPE_TEXT_STRING) {
+		size_t olen;
+		if (base64_decode(net_buf_tail(buf), net_buf_tailroom(buf), &olen,
+				data->val.string.ptr, data->val.string.len)) {
+			net_buf_unref(buf);
+			return -EINVAL;
+		}
+		net_buf_add(buf, olen);
+	}
+	else {
+		net_buf_add_mem(buf, data->val.string.ptr, len);
+	}
+
+	/* Reject bad data now, while the sender can still be told */
+	if (epaper_CheckRle(buf->data, buf->len, r.x, r.y, r.w, r.h)) {
+		net_buf_unref(buf);
+		return -EINVAL;
+	}
+
+	*(struct region *)net_buf_user_data(buf) = r;
+	net_buf_put(&region_fifo, buf);
+	if (startup_wait_local(K_NO_WAIT) == 0) {
+		k_work_submit(&region_work);
+	}
+	return 0;
+}
+
+/*
+ * Runs once, after both the first connection and the display bring-up
+ */
+void connected_work_handler(struct k_work *work) {
+	write_to_screen("Connected to Golioth!", 21);
+	k_work_submit(&region_work);
+}
+K_WORK_DEFINE(connected_work, connected_work_handler);
+
 /*
  * Callback function to display error messages when setting values on LightDB
  */
@@ -94,36 +237,45 @@ static int lightdb_set_handler(struct golioth_req_rsp *rsp) {
  */
 static int observe_handler(struct golioth_req_rsp *rsp) {
 	int err;
-	uint8_t payload_len = rsp->len;
-	char str[16] = {0};
 
 	if (rsp->err) {
 		LOG_ERR("Failed to receive observed data: %d", rsp->err);
 		return rsp->err;
 	}
 
-	if (payload_len + 1 > ARRAY_SIZE(str)) {
-		payload_len = ARRAY_SIZE(str) - 1;
-	}
+	if (rsp->len > 0 && rsp->data[0] == '{') {
+		/* JSON object: set colors and states of all LEDs in one go */
+		char json[LED_SETTINGS_JSON_LEN];
 
-	memcpy(str, rsp->data, payload_len);
-	str[payload_len] = '\0';
+		if (rsp->len >= sizeof(json)) {
+			LOG_ERR("LED settings too long: %zu", rsp->len);
+			return -ENOMEM;
+		}
+		/* Parsing is done in place, so work on a copy */
+		memcpy(json, rsp->data, rsp->len);
+		json[rsp->len] = '\0';
+
+		err = led_settings_apply_json(json, rsp->len);
+		screen_printf(err ? "Invalid LED settings" : "new LED settings");
+		return 0;
+	}
 
-	LOG_DBG("payload: %s", str);
+	/* The payload is not NUL terminated, work on it where it is */
+	LOG_HEXDUMP_DBG(rsp->data, rsp->len, "payload");
 
-	if (strcmp(str,"null") == 0) {
+	if (rsp->len == 4 && memcmp(rsp->data, "null", 4) == 0) {
 		/* If endpoint is missing on Golioth Cloud, set it up here */
 		LOG_INF("Payload is null; initializing cloud endpoint: %s = %d",
 				LEDS_ENDPOINT,
 				LEDS_DEFAULT_MASK);
-		snprintk(str, 6, "%d", LEDS_DEFAULT_MASK);
 
 		/* Use async set because you cannot call a synchronous set from inside
 		 * of a callback */
 		err = golioth_lightdb_set_cb(client,
 				LEDS_ENDPOINT,
 				GOLIOTH_CONTENT_FORMAT_APP_JSON,
-				str, strlen(str),
+				STRINGIFY(LEDS_DEFAULT_MASK),
+				strlen(STRINGIFY(LEDS_DEFAULT_MASK)),
 				lightdb_set_handler, NULL);
 
 		if (err) {
@@ -134,18 +286,22 @@ static int observe_handler(struct golioth_req_rsp *rsp) {
 		return 0;
 	}
 
-	/* Process the received payload */
-	char *ptr;
-	long ret;
-	uint8_t sbuf[LINE_STRING_LEN] = {0};
+	/* Convert the decimal payload to a number */
+	long ret = rsp->len > 0 ? 0 : -1;
+	for (size_t i = 0; i < rsp->len && ret >= 0 && ret <= 15; i++) {
+		if (rsp->data[i] < '0' || rsp->data[i] > '9') {
+			ret = -1;
+		}
+		else {
+			ret = ret * 10 + (rsp->data[i] - '0');
+		}
+	}
 
-	/* Convert string to a number */
-	ret = strtol(str, &ptr, 10);
 	if (ret < 0 || ret > 15) {
 		/* Test for bounded value */
 		LOG_DBG("Payload was not a number in range [0..15]");
 		/* Write message to display that value is not valid */
-		snprintk(sbuf, LINE_STRING_LEN, "Invalid bitmask: %s", str);
+		screen_printf("Invalid bitmask: %.*s", (int)rsp->len, (const char *)rsp->data);
 	}
 	else
 	{
@@ -154,9 +310,8 @@ static int observe_handler(struct golioth_req_rsp *rsp) {
 		k_work_submit(&led_work);
 
 		/* Write message to ePaper display about new led_bitmask */
-		snprintk(sbuf, LINE_STRING_LEN, "new led_bitmask: %d", led_bitmask);
+		screen_printf("new led_bitmask: %d", led_bitmask);
 	}
-	write_to_screen(sbuf, strlen(sbuf));
 
 	return 0;
 }
@@ -180,18 +335,74 @@ static enum golioth_rpc_status on_epaper(QCBORDecodeContext *request_params_arra
 		return GOLIOTH_RPC_INVALID_ARGUMENT;
 	}
 
-	/* Write message to ePaper display about new led_bitmask */
-	uint8_t sbuf[LINE_STRING_LEN];
-	uint8_t cbor_len = (uint8_t)rpc_string.len+1;	/* Add room for a null terminator */
-	uint8_t len = LINE_STRING_LEN >= cbor_len ? cbor_len : LINE_STRING_LEN;
-	snprintk(sbuf, len, "%s", (char *)rpc_string.ptr);
-	if (k_msgq_put(&line_msgq, sbuf, K_NO_WAIT) != 0) {
-		LOG_ERR("Message buffer is full, skipping ePaper write");
+	/* Copy the string out of the request once, straight into a message */
+	write_to_screen(rpc_string.ptr, rpc_string.len);
+	return GOLIOTH_RPC_OK;
+}
+
+/*
+ * Callback for the region RPC, params are [x, y, w, h, data]. Draws a
+ * compressed region of the display, see queue_region().
+ */
+static enum golioth_rpc_status on_epaper_region(QCBORDecodeContext *request_params_array,
+										 QCBOREncodeContext *response_detail_map,
+										 void *callback_arg)
+{
+	uint64_t xywh[4];
+	QCBORItem data;
+	QCBORError qerr;
+
+	for (uint8_t i = 0; i < ARRAY_SIZE(xywh); i++) {
+		QCBORDecode_GetUInt64(request_params_array, &xywh[i]);
 	}
-	else {
-		k_work_submit(&write_screen_from_buffer_work);
+	QCBORDecode_VGetNext(request_params_array, &data);
+	qerr = QCBORDecode_GetError(request_params_array);
+	if (qerr != QCBOR_SUCCESS) {
+		LOG_ERR("Failed to decode array items: %d (%s)", qerr, qcbor_err_to_str(qerr));
+		return GOLIOTH_RPC_INVALID_ARGUMENT;
 	}
-	return GOLIOTH_RPC_OK;
+
+	int err = queue_region(xywh, &data);
+	if (err == -ENOMEM) {
+		return GOLIOTH_RPC_RESOURCE_EXHAUSTED;
+	}
+	return err ? GOLIOTH_RPC_INVALID_ARGUMENT : GOLIOTH_RPC_OK;
+}
+
+/*
+ * Same region update written to LightDB State as {x, y, w, h, rle}
+ */
+static int region_observe_handler(struct golioth_req_rsp *rsp) {
+	static const char *keys[] = { "x", "y", "w", "h" };
+	QCBORDecodeContext dc;
+	QCBORItem data;
+	uint64_t xywh[4];
+	QCBORError qerr;
+
+	if (rsp->err) {
+		LOG_ERR("Failed to receive observed data: %d", rsp->err);
+		return rsp->err;
+	}
+
+	QCBORDecode_Init(&dc, (UsefulBufC){ rsp->data, rsp->len }, QCBOR_DECODE_MODE_NORMAL);
+	QCBORDecode_EnterMap(&dc, NULL);
+	for (uint8_t i = 0; i < ARRAY_SIZE(xywh); i++) {
+		QCBORDecode_GetUInt64InMapSZ(&dc, keys[i], &xywh[i]);
+	}
+	QCBORDecode_GetItemInMapSZ(&dc, "rle", QCBOR_TYPE_ANY, &data);
+	QCBORDecode_ExitMap(&dc);
+	qerr = QCBORDecode_Finish(&dc);
+	if (qerr != QCBOR_SUCCESS) {
+		/* null until a region is written */
+		LOG_DBG("No region at %s: %d (%s)", REGION_ENDPOINT, qerr, qcbor_err_to_str(qerr));
+		return 0;
+	}
+
+	int err = queue_region(xywh, &data);
+	if (err) {
+		LOG_WRN("Invalid region at %s: %d", REGION_ENDPOINT, err);
+	}
+	return 0;
 }
 
 /*
@@ -203,13 +414,19 @@ static void golioth_on_connect(struct golioth_client *client)
 {
 	int err;
 
-	k_sem_give(&connected);
+	/* turn LEDs green to indicate connection until the observed value arrives */
+	leds_immediate(GREEN, GREEN, GREEN, GREEN);
 
 	err = golioth_rpc_register(client, "epaper", on_epaper, NULL);
 	if (err) {
 		LOG_ERR("Failed to register RPC: %d", err);
 	}
 
+	err = golioth_rpc_register(client, "epaper_region", on_epaper_region, NULL);
+	if (err) {
+		LOG_ERR("Failed to register RPC: %d", err);
+	}
+
 	/*
 	 * Observe the data stored at `/leds` in LightDB. When that data is
 	 * updated, the `observe_handler` callback will be called. This will get
@@ -223,6 +440,15 @@ static void golioth_on_connect(struct golioth_client *client)
 	if (err) {
 		LOG_WRN("failed to observe LightDB path: %d", err);
 	}
+
+	err = golioth_lightdb_observe_cb(client,
+			REGION_ENDPOINT,
+			GOLIOTH_CONTENT_FORMAT_APP_CBOR,
+			region_observe_handler, NULL);
+
+	if (err) {
+		LOG_WRN("failed to observe LightDB path: %d", err);
+	}
 }
 
 void main(void)
@@ -231,22 +457,15 @@ void main(void)
 
 	/* Initialize MagTag hardware */
 	ws2812_init();
-	/* show two blue pixels to show until we connect to Golioth */
-	leds_immediate(BLACK, BLUE, BLUE, BLACK);
-	epaper_init();
-	if (IS_ENABLED(CONFIG_GOLIOTH_SAMPLES_COMMON)) {
-		net_connect();
-	}
+	/* breathe two blue pixels until we connect to Golioth */
+	ws2812_status(LED_STATUS_CONNECTING);
 
-	client->on_connect = golioth_on_connect;
-	golioth_system_client_start();
+	/* clear the display while the network comes up */
+	startup_run(epaper_init);
+	startup_network(client, golioth_on_connect);
 
-	/* wait until we've connected to Golioth */
-	k_sem_take(&connected, K_FOREVER);
-
-	/* turn LEDs green to indicate connection */
-	leds_immediate(GREEN, GREEN, GREEN, GREEN);
-	write_to_screen("Connected to Golioth!", 21);
+	/* say so on the display once both are up */
+	startup_when_connected(&connected_work);
 
 	/*
 	 * No need for a while(1) loop. Callbacks and System Workqueue will handle
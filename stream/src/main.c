@@ -13,22 +13,83 @@ LOG_MODULE_REGISTER(golioth_magtag, LOG_LEVEL_DBG);
 #include "magtag-common/magtag_epaper.h"
 #include "magtag-common/ws2812_control.h"
 #include "magtag-common/accel.h"
+#include "magtag-common/accel_stats.h"
+#include "magtag-common/accel_batch.h"
+#include "magtag-common/accel_rate.h"
+#include "magtag-common/accel_codec.h"
+#include "magtag-common/orientation.h"
+#include "magtag-common/sample_ring.h"
+#include "magtag-common/startup.h"
+#include "magtag-common/metrics.h"
 
 /* Golioth platform includes */
 #include <net/golioth/system_client.h>
 #include <net/golioth/settings.h>
-#include <samples/common/net_connect.h>
 #include <zephyr/net/coap.h>
+#include <qcbor/qcbor.h>
 
 static struct golioth_client *client = GOLIOTH_SYSTEM_CLIENT_GET();
-static K_SEM_DEFINE(connected, 0, 1);
 
-static int32_t _loop_delay_s = 5;
-static k_tid_t _system_thread = 0;
+/* Sample rate while moving and time between reports while still */
+static struct accel_rate rate;
 
-static struct sensor_value accel[3];
+static struct accel_stats_acc accel_acc;
 
-struct k_mutex epaper_mutex;
+/* Wakes the uploader: a summary is buffered, the connection is back or the delay changed */
+K_SEM_DEFINE(upload_sem, 0, 1);
+/* Send whatever is buffered, even if no batch is due yet */
+static atomic_t flush_requested;
+
+/* Summaries waiting to be sent, about 5 hours of motion at 5 s windows */
+#define ACCEL_RING_RECORDS	4096
+SAMPLE_RING_DEFINE(accel_ring, sizeof(struct accel_stats), ACCEL_RING_RECORDS,
+		SAMPLE_RING_OVERWRITE);
+
+/* Raw samples taken while moving, about 5 minutes at 25 Hz */
+#define RAW_RING_RECORDS	8192
+#define RAW_BATCH		128
+SAMPLE_RING_DEFINE(raw_ring, sizeof(struct accel_sample), RAW_RING_RECORDS,
+		SAMPLE_RING_OVERWRITE);
+
+/* Raw sample resolution in milli-g, 1 is lossless */
+static uint16_t _raw_scale_mg = 1;
+
+K_MUTEX_DEFINE(epaper_mutex);
+
+/* Last text shown, drawn again after a rotation clears the display */
+static char epaper_text[160];
+static atomic_t rotation_queued;
+
+/* Nothing may draw until the startup thread has brought the display up */
+static int epaper_lock(k_timeout_t timeout)
+{
+	int err = startup_wait_local(timeout);
+
+	if (err) {
+		return err;
+	}
+	return k_mutex_lock(&epaper_mutex, timeout);
+}
+
+/* Write the next line of text, call with epaper_mutex held */
+static void epaper_show(const char *str)
+{
+	strncpy(epaper_text, str, sizeof(epaper_text) - 1);
+	epaper_autowrite(epaper_text, strlen(epaper_text));
+}
+
+/* Numeric settings must be whole numbers in range [min, max] */
+static enum golioth_settings_status int_setting(const struct golioth_settings_value *value,
+		int64_t min, int64_t max)
+{
+	if (value->type != GOLIOTH_SETTINGS_VALUE_TYPE_INT64) {
+		return GOLIOTH_SETTINGS_VALUE_FORMAT_NOT_VALID;
+	}
+	if (value->i64 < min || value->i64 > max) {
+		return GOLIOTH_SETTINGS_VALUE_OUTSIDE_RANGE;
+	}
+	return GOLIOTH_SETTINGS_SUCCESS;
+}
 
 enum golioth_settings_status on_setting(
 		const char *key,
@@ -36,28 +97,78 @@ enum golioth_settings_status on_setting(
 {
 	LOG_DBG("Received setting: key = %s, type = %d", key, value->type);
 	if (strcmp(key, "LOOP_DELAY_S") == 0) {
-		/* This setting is expected to be numeric, return an error if it's not */
-		if (value->type != GOLIOTH_SETTINGS_VALUE_TYPE_INT64) {
-			return GOLIOTH_SETTINGS_VALUE_FORMAT_NOT_VALID;
-		}
-
-		/* This setting must be in range [1, 100], return an error if it's not */
-		if (value->i64 < 1 || value->i64 > 100) {
-			return GOLIOTH_SETTINGS_VALUE_OUTSIDE_RANGE;
+		/* This setting must be a number in range [1, 100] */
+		enum golioth_settings_status status = int_setting(value, 1, 100);
+		if (status != GOLIOTH_SETTINGS_SUCCESS) {
+			return status;
 		}
 
-		/* Setting has passed all checks, so apply it to the loop delay */
-		_loop_delay_s = (int32_t)value->i64;
+		/* Setting has passed all checks, so apply it to the shortest still wait */
+		rate.min_interval_s = (uint32_t)value->i64;
+		rate.interval_s = rate.min_interval_s;
 		char sbuf[32];
-		snprintk(sbuf, 32, "New loop delay: %d ", _loop_delay_s);
+		snprintk(sbuf, 32, "New loop delay: %u ", rate.min_interval_s);
 		LOG_INF("%s", sbuf);
 
-		if (k_mutex_lock(&epaper_mutex, K_SECONDS(1))==0) {
-			epaper_autowrite(sbuf, strlen(sbuf));
+		if (epaper_lock(K_SECONDS(1))==0) {
+			epaper_show(sbuf);
 			k_mutex_unlock(&epaper_mutex);
 		}
 
-		k_wakeup(_system_thread);
+		/* Cut the current wait short so the new delay applies now */
+		k_sem_give(&upload_sem);
+		return GOLIOTH_SETTINGS_SUCCESS;
+	}
+
+	if (strcmp(key, "LOOP_DELAY_MAX_S") == 0) {
+		/* Still reports back off exponentially up to this */
+		enum golioth_settings_status status = int_setting(value, 1, 3600);
+		if (status == GOLIOTH_SETTINGS_SUCCESS) {
+			rate.max_interval_s = (uint32_t)value->i64;
+			k_sem_give(&upload_sem);
+		}
+		return status;
+	}
+
+	if (strcmp(key, "SAMPLE_HZ_MIN") == 0) {
+		enum golioth_settings_status status = int_setting(value, 1, 400);
+		if (status == GOLIOTH_SETTINGS_SUCCESS) {
+			rate.min_hz = (uint16_t)value->i64;
+		}
+		return status;
+	}
+
+	if (strcmp(key, "SAMPLE_HZ_MAX") == 0) {
+		/* Rate used as soon as a window shows activity */
+		enum golioth_settings_status status = int_setting(value, 1, 400);
+		if (status == GOLIOTH_SETTINGS_SUCCESS) {
+			rate.max_hz = (uint16_t)value->i64;
+		}
+		return status;
+	}
+
+	if (strcmp(key, "RAW_SCALE_MG") == 0) {
+		enum golioth_settings_status status = int_setting(value, 1, 100);
+		if (status != GOLIOTH_SETTINGS_SUCCESS) {
+			return status;
+		}
+
+		/* Coarser steps give smaller deltas and fewer bytes per sample */
+		_raw_scale_mg = (uint16_t)value->i64;
+		LOG_INF("Raw samples rounded to %u milli-g", _raw_scale_mg);
+		return GOLIOTH_SETTINGS_SUCCESS;
+	}
+
+	if (strcmp(key, "BUFFER_OVERWRITE") == 0) {
+		if (value->type != GOLIOTH_SETTINGS_VALUE_TYPE_BOOL) {
+			return GOLIOTH_SETTINGS_VALUE_FORMAT_NOT_VALID;
+		}
+
+		/* When false, keep the oldest summaries and drop new ones once full */
+		sample_ring_set_policy(&accel_ring, value->b ?
+				SAMPLE_RING_OVERWRITE : SAMPLE_RING_BACKPRESSURE);
+		LOG_INF("Offline buffer %s when full",
+				value->b ? "overwrites oldest" : "drops newest");
 		return GOLIOTH_SETTINGS_SUCCESS;
 	}
 
@@ -67,105 +178,277 @@ enum golioth_settings_status on_setting(
 
 static void golioth_on_connect(struct golioth_client *client)
 {
-	k_sem_give(&connected);
-	
 	int err = golioth_settings_register_callback(client, on_setting);
 
 	if (err) {
 		LOG_ERR("Failed to register settings callback: %d", err);
 	}
+
+	/* Summaries buffered while offline go out now, not with the next one */
+	atomic_set(&flush_requested, 1);
+	k_sem_give(&upload_sem);
 }
 
-static int lightdb_stream_handler(struct golioth_req_rsp *rsp)
+/* Never waits for an upload, the uploader is woken to send it */
+static void buffer_summary(const struct accel_stats *summary)
 {
-	if (rsp->err) {
-		LOG_WRN("Failed to stream sensor data: %d", rsp->err);
-		return rsp->err;
+	if (sample_ring_put(&accel_ring, summary->start, summary)) {
+		LOG_WRN("Offline buffer full, dropped accel summary");
 	}
-	return 0;
+	k_sem_give(&upload_sem);
 }
 
-static int record_accelerometer(const struct device *sensor)
+/* Turn the display to match the way the board is being held */
+static void apply_orientation(void)
 {
-	/* Call sensor library to take sensor reading */
-	fetch_and_display(sensor, accel);
-
-	/* Turn sensor data into a string */
-	char str[160];
-	snprintk(str, sizeof(str) - 1,
-			"{\"x\":%f,\"y\":%f,\"z\":%f}",
-			sensor_value_to_double(&accel[0]),
-			sensor_value_to_double(&accel[1]),
-			sensor_value_to_double(&accel[2])
-			);
-
-	int err = golioth_stream_push_cb(client, "accel",
-				GOLIOTH_CONTENT_FORMAT_APP_JSON,
-				str, strlen(str),
-				lightdb_stream_handler, NULL);
-	if (err) {
-		return err;
+	atomic_clear(&rotation_queued);
+
+	/* Display is busy, the next sample batch tries again */
+	if (k_mutex_lock(&epaper_mutex, K_NO_WAIT)) {
+		return;
 	}
-	return 0;
+	epaper_set_orientation(orientation_get());
+	epaper_FullClear();
+	if (epaper_text[0] != '\0') {
+		epaper_autowrite(epaper_text, strlen(epaper_text));
+	}
+	k_mutex_unlock(&epaper_mutex);
 }
 
-void main(void)
+/* A full refresh takes seconds, so it goes to the startup thread */
+static void orientation_work_handler(struct k_work *work)
 {
-	LOG_DBG("Start MagTag LightDB Stream demo");
+	if (!atomic_set(&rotation_queued, 1)) {
+		if (startup_run(apply_orientation)) {
+			atomic_clear(&rotation_queued);
+		}
+	}
+}
 
-	/* Get system thread id so loop delay change event can wake main */
-	_system_thread = k_current_get();
+K_WORK_DEFINE(orientation_work, orientation_work_handler);
 
-	/* Initialize MagTag hardware */
-	ws2812_init();
-	/* show two blue pixels to show until we connect to Golioth */
-	leds_immediate(BLACK, BLUE, BLUE, BLACK);
+/* Feed FIFO samples into the window statistics, buffer each finished window */
+static void accel_work_handler(struct k_work *work)
+{
+	struct accel_sample batch[16];
+	struct accel_stats summary;
+	size_t n;
+
+	while ((n = accel_get_samples(batch, ARRAY_SIZE(batch))) > 0) {
+		for (size_t i=0; i<n; i++) {
+			sample_ring_put(&raw_ring, batch[i].timestamp, &batch[i]);
+			orientation_update(&batch[i]);
+			if (accel_stats_feed(&accel_acc, &batch[i],
+					CONFIG_MAGTAG_ACCEL_STATS_WINDOW_MS, &summary)) {
+				buffer_summary(&summary);
+				accel_set_sample_rate(accel_rate_window(&rate, &summary));
+			}
+		}
+	}
 
-	k_mutex_init(&epaper_mutex);
-	k_mutex_lock(&epaper_mutex, K_FOREVER);
-	epaper_init();
-	if (IS_ENABLED(CONFIG_GOLIOTH_SAMPLES_COMMON)) {
-		net_connect();
+	if (!accel_is_moving() && accel_acc.count > 0) {
+		/* Motion stopped, send the partial window now */
+		accel_stats_finish(&accel_acc, &summary);
+		accel_stats_reset(&accel_acc);
+		buffer_summary(&summary);
 	}
 
-	client->on_connect = golioth_on_connect;
-	golioth_system_client_start();
+	/* Also retries a rotation the display was too busy for */
+	if (orientation_get() != epaper_get_orientation()) {
+		k_work_submit(&orientation_work);
+	}
+}
 
-	/* wait until we've connected to golioth */
-	k_sem_take(&connected, K_FOREVER);
+K_WORK_DEFINE(accel_work, accel_work_handler);
 
-	/* turn LEDs green to indicate connection */
-	leds_immediate(GREEN, GREEN, GREEN, GREEN);
-	epaper_autowrite("Connected to Golioth!", 21);
-	k_mutex_unlock(&epaper_mutex);
+/* Runs on the startup thread, a refresh would stall the accelerometer work */
+static void show_connected(void)
+{
+	/* Not epaper_lock(), that would wait for this very step to finish */
+	if (k_mutex_lock(&epaper_mutex, K_SECONDS(1)) == 0) {
+		epaper_show("Connected to Golioth!");
+		k_mutex_unlock(&epaper_mutex);
+	}
+}
+
+/* Runs once, after both the first connection and the display bring-up */
+static void connected_work_handler(struct k_work *work)
+{
+	/* chase green around the LEDs while streaming */
+	ws2812_status(LED_STATUS_STREAMING);
+	startup_run(show_connected);
+}
+
+K_WORK_DEFINE(connected_work, connected_work_handler);
+
+/* A batch is due once it is full or its oldest summary has waited long enough */
+static bool accel_batch_due(void)
+{
+	uint32_t seq;
+	uint32_t oldest;
+
+	if (sample_ring_used(&accel_ring) >= CONFIG_MAGTAG_ACCEL_BATCH_COUNT) {
+		return true;
+	}
+	return sample_ring_peek(&accel_ring, &seq, &oldest, NULL, 1) == 1 &&
+		k_uptime_get_32() - oldest >= CONFIG_MAGTAG_ACCEL_BATCH_MS;
+}
+
+/**
+ * Send buffered summaries oldest first, one CBOR batch per push
+ *
+ * @return number of summaries sent, the newest goes in *newest
+ */
+static int drain_accel_ring(struct accel_stats *newest)
+{
+	static struct accel_stats items[CONFIG_MAGTAG_ACCEL_BATCH_COUNT];
+	static uint8_t buf[ACCEL_BATCH_BUF_SIZE];
+	uint32_t seq;
+	size_t n;
+	int sent = 0;
+
+	while (golioth_is_connected(client)) {
+		n = sample_ring_peek(&accel_ring, &seq, NULL, items, ARRAY_SIZE(items));
+		if (n == 0) {
+			return sent;
+		}
+
+		int len = accel_batch_encode(items, n, buf, sizeof(buf));
+		if (len < 0) {
+			return len;
+		}
+
+		int err = golioth_stream_push(client, "accel",
+				GOLIOTH_CONTENT_FORMAT_APP_CBOR,
+				buf, len);
+		if (err) {
+			return err;
+		}
+		sample_ring_consume(&accel_ring, seq + n);
+		*newest = items[n-1];
+		sent += n;
+	}
+	return -ENOTCONN;
+}
+
+/* Send raw samples packed by accel_codec_encode(), RAW_BATCH per push */
+static int drain_raw_ring(void)
+{
+	static struct accel_sample samples[RAW_BATCH];
+	static uint8_t packed[ACCEL_CODEC_MAX_BYTES(RAW_BATCH)];
+	static uint8_t buf[ACCEL_CODEC_MAX_BYTES(RAW_BATCH) + 32];
+	QCBOREncodeContext ec;
+	UsefulBufC out;
+	uint32_t seq;
+	size_t n;
+
+	while (golioth_is_connected(client)) {
+		n = sample_ring_peek(&raw_ring, &seq, NULL, samples, ARRAY_SIZE(samples));
+		if (n == 0) {
+			return 0;
+		}
+
+		int len = accel_codec_encode(samples, n, _raw_scale_mg, packed, sizeof(packed));
+		if (len < 0) {
+			return len;
+		}
+
+		QCBOREncode_Init(&ec, UsefulBuf_FROM_BYTE_ARRAY(buf));
+		QCBOREncode_OpenMap(&ec);
+		QCBOREncode_AddUInt64ToMap(&ec, "age", k_uptime_get_32() - samples[0].timestamp);
+		QCBOREncode_AddBytesToMap(&ec, "raw", (UsefulBufC){ packed, len });
+		QCBOREncode_CloseMap(&ec);
+		if (QCBOREncode_Finish(&ec, &out) != QCBOR_SUCCESS) {
+			return -ENOMEM;
+		}
+
+		int err = golioth_stream_push(client, "accel_raw",
+				GOLIOTH_CONTENT_FORMAT_APP_CBOR,
+				out.ptr, out.len);
+		if (err) {
+			return err;
+		}
+		sample_ring_consume(&raw_ring, seq + n);
+	}
+	return -ENOTCONN;
+}
+
+void main(void)
+{
+	LOG_DBG("Start MagTag LightDB Stream demo");
+
+	/* Health records, starting before the network so its up time is counted */
+	metrics_init(client);
+
+	/* Initialize MagTag hardware */
+	ws2812_init();
+	/* breathe two blue pixels until we connect to Golioth */
+	ws2812_status(LED_STATUS_CONNECTING);
+
+	/* Clear the display and connect while sampling starts, summaries are buffered */
+	startup_run(epaper_init);
+	startup_network(client, golioth_on_connect);
+	startup_when_connected(&connected_work);
 
 	/* Accelerometer */
+	accel_rate_init(&rate);
 	accelerometer_init();
+	accel_fifo_init(&accel_work);
+	orientation_init(&orientation_work);
 
 	int err;
+	struct accel_stats summary;
 	while (true) {
-		/* Send accelerometer data to the Golioth Cloud */
-		LOG_INF("Sending accel data");
+		/* Sleep until a window of motion is buffered, or report in while still */
+		if (k_sem_take(&upload_sem, K_SECONDS(accel_rate_interval(&rate)))) {
+			struct accel_stats_acc still;
+			struct accel_sample sample;
 
-		err = record_accelerometer(sensor);
+			if (accel_read_sample(&sample)) {
+				/* Moving, the window just hasn't closed yet */
+				continue;
+			}
+			accel_rate_still(&rate);
+			accel_stats_reset(&still);
+			accel_stats_add(&still, &sample);
+			accel_stats_finish(&still, &summary);
+			buffer_summary(&summary);
+		}
+
+		/* Send everything buffered once a batch is due */
+		if (!atomic_clear(&flush_requested) && !accel_batch_due()) {
+			continue;
+		}
+
+		int sent = drain_accel_ring(&summary);
+
+		err = sent < 0 ? sent : drain_raw_ring();
 		if (err) {
-			LOG_WRN("Failed to accel data to LightDB stream: %d", err);
+			struct sample_ring_stats stats;
+
+			sample_ring_get_stats(&accel_ring, &stats);
+			LOG_WRN("Failed to send accel data to LightDB stream: %d, "
+					"%u/%u buffered (peak %u, %u overwritten, %u dropped)",
+					err, stats.used, stats.capacity, stats.high_water,
+					stats.overwritten, stats.rejected);
+			/* Not an error while still waiting for the first connection */
+			ws2812_status(startup_is_connected() ?
+					LED_STATUS_ERROR : LED_STATUS_CONNECTING);
 		}
-		else
+		else if (sent > 0)
 		{
+			ws2812_status(LED_STATUS_STREAMING);
+			/* Mean g per axis of the newest summary sent */
 			char str[160];
-			snprintk(str, sizeof(str) -1,
-						"%.4f %.4f %.4f",
-						sensor_value_to_double(&accel[0]),
-						sensor_value_to_double(&accel[1]),
-						sensor_value_to_double(&accel[2])
-						);
-			if (k_mutex_lock(&epaper_mutex, K_MSEC(100))==0) {
-				epaper_autowrite(str, strlen(str));
+			char g[3][12];
+			for (uint8_t i=0; i<3; i++) {
+				accel_fmt_fixed(g[i], sizeof(g[i]), summary.axis[i].mean, 3);
+			}
+			snprintk(str, sizeof(str) -1, "%s %s %s", g[0], g[1], g[2]);
+			if (epaper_lock(K_MSEC(100))==0) {
+				epaper_show(str);
 				k_mutex_unlock(&epaper_mutex);
 			}
 		}
-
-		k_sleep(K_SECONDS(_loop_delay_s));
 	}
 }
@@ -0,0 +1,81 @@
+import sys
+import base64
+import binascii
+
+'''
+Decode accelerometer samples packed by accel_codec_encode() in
+magtag-common/accelerometer/accel_codec.c and print them as CSV.
+
+The packed bytes can be given as a file, a hex string or a base64 string
+(as shown for CBOR byte strings in the Golioth console):
+
+    python3 utility/accel_decode.py raw.bin
+    python3 utility/accel_decode.py 0302a0...
+    python3 utility/accel_decode.py AwKg...
+'''
+
+def read_varint(data, pos):
+    value = 0
+    shift = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        value |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            return value, pos
+
+def unzigzag(v):
+    return (v >> 1) ^ -(v & 1)
+
+def decode(data):
+    '''
+    Return (scale, [(timestamp_ms, x_mg, y_mg, z_mg), ...])
+    '''
+    count, pos = read_varint(data, 0)
+    scale, pos = read_varint(data, pos)
+
+    samples = []
+    t = 0
+    xyz = [0, 0, 0]
+    for _ in range(count):
+        dt, pos = read_varint(data, pos)
+        t = (t + dt) & 0xFFFFFFFF
+        for a in range(3):
+            d, pos = read_varint(data, pos)
+            xyz[a] += unzigzag(d)
+        samples.append((t, xyz[0] * scale, xyz[1] * scale, xyz[2] * scale))
+    if pos != len(data):
+        raise ValueError("{} trailing bytes".format(len(data) - pos))
+    return scale, samples
+
+def load(arg):
+    try:
+        with open(arg, "rb") as f:
+            return f.read()
+    except OSError:
+        pass
+    try:
+        return bytes.fromhex(arg)
+    except ValueError:
+        return base64.b64decode(arg, validate=True)
+
+def main(argv):
+    if len(sys.argv) != 2:
+        print("\nUsage: python3 accel_decode.py <file|hex|base64>\n")
+        print("\tDecode packed accelerometer samples to CSV (ms, milli-g)\n")
+        return
+
+    try:
+        scale, samples = decode(load(sys.argv[1]))
+    except (IndexError, ValueError, binascii.Error) as e:
+        print("Failed to decode: {}".format(e))
+        return
+
+    print("# scale {} milli-g".format(scale))
+    print("timestamp_ms,x_mg,y_mg,z_mg")
+    for s in samples:
+        print("{},{},{},{}".format(*s))
+
+if __name__ == "__main__":
+   main(sys.argv[1:])
@@ -0,0 +1,94 @@
+import sys
+import json
+import base64
+
+from xbm_to_header import rotate_ccw, reverse_endian_array
+
+'''
+Compress a 296x128 .xbm image (or the part of it that changed) for the
+"epaper_region" RPC handled by epaper_DrawRle() in
+magtag-common/epaper/epaper_rle.c, and print the RPC parameters:
+
+    python3 utility/epaper_rle.py dashboard.xbm
+    python3 utility/epaper_rle.py dashboard.xbm --since previous.xbm
+
+The region is given in display RAM coordinates: x and w across the 128 pixel
+side (multiples of 8), y and h along the 296 pixel side.
+'''
+
+RAM_STRIDE = 16
+RAM_ROWS = 296
+
+def load(xbm_filename):
+    # Display RAM order, MSB leftmost, 1 is black
+    return reverse_endian_array(rotate_ccw(xbm_filename))
+
+def changed_region(old, new):
+    '''
+    Return (x, y, w, h) around every byte that differs, None if nothing did
+    '''
+    cols = set()
+    rows = set()
+    for row in range(RAM_ROWS):
+        for col in range(RAM_STRIDE):
+            i = row * RAM_STRIDE + col
+            if old[i] != new[i]:
+                cols.add(col)
+                rows.add(row)
+    if not rows:
+        return None
+    return (min(cols) * 8, min(rows),
+            (max(cols) - min(cols) + 1) * 8, max(rows) - min(rows) + 1)
+
+def crop(ram, x, y, w, h):
+    out = []
+    for row in range(y, y + h):
+        start = row * RAM_STRIDE + x // 8
+        out.extend(ram[start:start + w // 8])
+    return out
+
+def packbits(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        run = 1
+        while i + run < len(data) and run < 128 and data[i + run] == data[i]:
+            run += 1
+        if run > 1:
+            out += bytes([257 - run, data[i]])
+            i += run
+            continue
+
+        # Literals until the next run of at least two
+        start = i
+        while (i < len(data) and i - start < 128 and
+                not (i + 1 < len(data) and data[i + 1] == data[i])):
+            i += 1
+        if i == start:
+            i += 1
+        out += bytes([i - start - 1]) + bytes(data[start:i])
+    return bytes(out)
+
+def main(argv):
+    if len(argv) not in (1, 3) or (len(argv) == 3 and argv[1] != "--since"):
+        print("\nUsage: python3 epaper_rle.py image.xbm [--since previous.xbm]\n")
+        print("\tPrint the epaper_region RPC parameters for a 296x128 .xbm image\n")
+        print("\t--since sends only the region that differs from previous.xbm\n")
+        return
+
+    new = load(argv[0])
+    region = (0, 0, RAM_STRIDE * 8, RAM_ROWS)
+    if len(argv) == 3:
+        region = changed_region(load(argv[2]), new)
+        if region is None:
+            print("No change")
+            return
+
+    x, y, w, h = region
+    rle = packbits(crop(new, x, y, w, h))
+    print("Region {}x{} at {},{}: {} bytes, {} compressed".format(
+        w, h, x, y, w // 8 * h, len(rle)), file=sys.stderr)
+    print(json.dumps([x, y, w, h, base64.b64encode(rle).decode()]))
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
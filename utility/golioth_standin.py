@@ -0,0 +1,566 @@
+import sys
+import json
+import time
+import base64
+import random
+import struct
+import asyncio
+import argparse
+
+'''
+Local stand-in for the Golioth cloud, for offline integration and load tests
+of the MagTag apps. Plain CoAP over UDP (no DTLS), Python standard library
+only:
+
+    python3 utility/golioth_standin.py --record pushes.jsonl
+
+It serves what the apps use:
+
+    hello                GET, replies "Hello <psk-id>"
+    .d/<path>            LightDB State get/set/delete/observe, JSON or CBOR
+    .s/<path>            LightDB Stream push, counted and optionally recorded
+    .c  .c/status        Settings observe and status report
+    .rpc  .rpc/status    RPC observe and result
+    .logs                Log messages, printed
+
+Type commands on stdin while it runs (help lists them), for example:
+
+    set leds 5
+    setting LOOP_DELAY_S 10
+    rpc epaper "Hello from the laptop"
+    drop 30
+    stats
+
+Block-wise transfers are not supported, keep payloads within one datagram.
+'''
+
+# CoAP (RFC 7252, RFC 7641)
+CON, NON, ACK, RST = range(4)
+GET, POST, PUT, DELETE = 1, 2, 3, 4
+CREATED, DELETED, CHANGED, CONTENT = 65, 66, 68, 69
+BAD_REQUEST, NOT_FOUND, METHOD_NOT_ALLOWED, UNSUPPORTED_FORMAT = 128, 132, 133, 143
+
+OPT_OBSERVE = 6
+OPT_URI_PATH = 11
+OPT_CONTENT_FORMAT = 12
+OPT_URI_QUERY = 15
+OPT_ACCEPT = 17
+
+FMT_TEXT = 0
+FMT_JSON = 50
+FMT_CBOR = 60
+
+def code_str(code):
+    return "%d.%02d" % (code >> 5, code & 0x1F)
+
+class Message:
+    def __init__(self, mtype=ACK, code=0, mid=0, token=b'', options=None, payload=b''):
+        self.mtype = mtype
+        self.code = code
+        self.mid = mid
+        self.token = token
+        self.options = options or []
+        self.payload = payload
+
+    def opt(self, number):
+        return [v for n, v in self.options if n == number]
+
+    def opt_uint(self, number):
+        values = self.opt(number)
+        if not values:
+            return None
+        return int.from_bytes(values[0], 'big')
+
+    def path(self):
+        return '/'.join(v.decode() for v in self.opt(OPT_URI_PATH))
+
+def parse(data):
+    if len(data) < 4 or data[0] >> 6 != 1:
+        raise ValueError("not CoAP")
+    tkl = data[0] & 0x0F
+    msg = Message((data[0] >> 4) & 3, data[1], struct.unpack('>H', data[2:4])[0],
+            bytes(data[4:4 + tkl]))
+    pos = 4 + tkl
+    number = 0
+    while pos < len(data):
+        if data[pos] == 0xFF:
+            msg.payload = bytes(data[pos + 1:])
+            break
+        delta, length = data[pos] >> 4, data[pos] & 0x0F
+        pos += 1
+        values = []
+        for v in (delta, length):
+            if v == 13:
+                v = data[pos] + 13
+                pos += 1
+            elif v == 14:
+                v = struct.unpack('>H', data[pos:pos + 2])[0] + 269
+                pos += 2
+            values.append(v)
+        number += values[0]
+        msg.options.append((number, bytes(data[pos:pos + values[1]])))
+        pos += values[1]
+    return msg
+
+def uint_opt(value):
+    return value.to_bytes((value.bit_length() + 7) // 8, 'big')
+
+def serialize(msg):
+    out = bytearray([0x40 | (msg.mtype << 4) | len(msg.token), msg.code])
+    out += struct.pack('>H', msg.mid) + msg.token
+    number = 0
+    for n, v in sorted(msg.options, key=lambda o: o[0]):
+        fields = []
+        for x in (n - number, len(v)):
+            if x < 13:
+                fields.append((x, b''))
+            elif x < 269:
+                fields.append((13, bytes([x - 13])))
+            else:
+                fields.append((14, struct.pack('>H', x - 269)))
+        out.append((fields[0][0] << 4) | fields[1][0])
+        out += fields[0][1] + fields[1][1] + v
+        number = n
+    if msg.payload:
+        out += b'\xFF' + msg.payload
+    return bytes(out)
+
+# Minimal CBOR (RFC 8949), definite lengths only
+def cbor_decode(data, pos=0):
+    ib = data[pos]
+    major, info = ib >> 5, ib & 0x1F
+    pos += 1
+    if major == 7:
+        if info == 20:
+            return False, pos
+        if info == 21:
+            return True, pos
+        if info in (22, 23):
+            return None, pos
+        if info == 25:
+            return struct.unpack('>e', data[pos:pos + 2])[0], pos + 2
+        if info == 26:
+            return struct.unpack('>f', data[pos:pos + 4])[0], pos + 4
+        if info == 27:
+            return struct.unpack('>d', data[pos:pos + 8])[0], pos + 8
+        raise ValueError("unsupported simple value %d" % info)
+    if info < 24:
+        arg = info
+    elif info <= 27:
+        size = 1 << (info - 24)
+        arg = int.from_bytes(data[pos:pos + size], 'big')
+        pos += size
+    else:
+        raise ValueError("indefinite lengths are not supported")
+    if major == 0:
+        return arg, pos
+    if major == 1:
+        return -1 - arg, pos
+    if major == 2:
+        return bytes(data[pos:pos + arg]), pos + arg
+    if major == 3:
+        return data[pos:pos + arg].decode(), pos + arg
+    if major == 4:
+        items = []
+        for _ in range(arg):
+            item, pos = cbor_decode(data, pos)
+            items.append(item)
+        return items, pos
+    if major == 5:
+        items = {}
+        for _ in range(arg):
+            key, pos = cbor_decode(data, pos)
+            items[key], pos = cbor_decode(data, pos)
+        return items, pos
+    # Tag, keep the tagged item
+    return cbor_decode(data, pos)
+
+def cbor_head(major, arg):
+    if arg < 24:
+        return bytes([(major << 5) | arg])
+    for info, size in ((24, 1), (25, 2), (26, 4), (27, 8)):
+        if arg < 1 << (8 * size):
+            return bytes([(major << 5) | info]) + arg.to_bytes(size, 'big')
+    raise ValueError("integer too large")
+
+def cbor_encode(value):
+    if value is None:
+        return b'\xF6'
+    if value is True:
+        return b'\xF5'
+    if value is False:
+        return b'\xF4'
+    if isinstance(value, int):
+        return cbor_head(0, value) if value >= 0 else cbor_head(1, -1 - value)
+    if isinstance(value, float):
+        return b'\xFB' + struct.pack('>d', value)
+    if isinstance(value, bytes):
+        return cbor_head(2, len(value)) + value
+    if isinstance(value, str):
+        raw = value.encode()
+        return cbor_head(3, len(raw)) + raw
+    if isinstance(value, (list, tuple)):
+        return cbor_head(4, len(value)) + b''.join(cbor_encode(v) for v in value)
+    if isinstance(value, dict):
+        return cbor_head(5, len(value)) + b''.join(
+                cbor_encode(k) + cbor_encode(v) for k, v in value.items())
+    raise TypeError("can't encode %r" % type(value))
+
+def to_json(value):
+    '''JSON for display and recording, byte strings become base64'''
+    return json.dumps(value, default=lambda b: base64.b64encode(b).decode())
+
+def decode_payload(payload, fmt):
+    if fmt == FMT_CBOR:
+        return cbor_decode(payload)[0]
+    if fmt == FMT_TEXT:
+        return payload.decode()
+    return json.loads(payload)
+
+def encode_payload(value, fmt):
+    if fmt == FMT_CBOR:
+        return cbor_encode(value)
+    return to_json(value).encode()
+
+class Stats:
+    def __init__(self):
+        self.start = time.monotonic()
+        self.paths = {}
+
+    def add(self, method, path, nbytes):
+        key = "%s %s" % (method, path)
+        count, total = self.paths.get(key, (0, 0))
+        self.paths[key] = (count + 1, total + nbytes)
+
+    def report(self):
+        elapsed = max(time.monotonic() - self.start, 1e-6)
+        lines = ["%-28s %8s %10s %10s %10s" % ("request", "count", "bytes", "req/s", "B/s")]
+        for key in sorted(self.paths):
+            count, total = self.paths[key]
+            lines.append("%-28s %8d %10d %10.2f %10.1f" % (key, count, total,
+                    count / elapsed, total / elapsed))
+        lines.append("over %.1f s" % elapsed)
+        return '\n'.join(lines)
+
+class Observer:
+    def __init__(self, addr, token, path, fmt):
+        self.addr = addr
+        self.token = token
+        self.path = path
+        self.fmt = fmt
+        self.seq = 2
+
+class StandIn(asyncio.DatagramProtocol):
+    def __init__(self, args):
+        self.args = args
+        self.state = {}
+        self.settings = {}
+        self.settings_version = int(time.time())
+        self.observers = []
+        self.pending_rpc = {}
+        self.recent = {}
+        self.stats = Stats()
+        self.drop_until = 0
+        self.mid = random.randrange(0x10000)
+        self.record = open(args.record, 'a') if args.record else None
+        if args.state:
+            with open(args.state) as f:
+                self.state = json.load(f)
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def log(self, text):
+        print(text, flush=True)
+
+    # LightDB State tree
+    def lookup(self, path):
+        node = self.state
+        for part in filter(None, path.split('/')):
+            if not isinstance(node, dict) or part not in node:
+                return None
+            node = node[part]
+        return node
+
+    def store(self, path, value):
+        parts = [p for p in path.split('/') if p]
+        if not parts:
+            if not isinstance(value, dict):
+                raise ValueError("root must be an object")
+            self.state = value
+        else:
+            node = self.state
+            for part in parts[:-1]:
+                if not isinstance(node.get(part), dict):
+                    node[part] = {}
+                node = node[part]
+            node[parts[-1]] = value
+        self.notify_lightdb(path)
+
+    def remove(self, path):
+        parts = [p for p in path.split('/') if p]
+        parent = self.lookup('/'.join(parts[:-1])) if parts else None
+        if isinstance(parent, dict):
+            parent.pop(parts[-1], None)
+        self.notify_lightdb(path)
+
+    def notify_lightdb(self, path):
+        path = path.strip('/')
+        for obs in list(self.observers):
+            if not obs.path.startswith('.d/'):
+                continue
+            watched = obs.path[3:].strip('/')
+            related = (watched == path or watched.startswith(path + '/') or
+                    path.startswith(watched + '/') or not watched or not path)
+            if related:
+                self.notify(obs, encode_payload(self.lookup(watched), obs.fmt))
+
+    def notify(self, obs, payload):
+        obs.seq = (obs.seq + 1) & 0xFFFFFF
+        self.mid = (self.mid + 1) & 0xFFFF
+        msg = Message(NON, CONTENT, self.mid, obs.token,
+                [(OPT_OBSERVE, uint_opt(obs.seq)), (OPT_CONTENT_FORMAT, uint_opt(obs.fmt))],
+                payload)
+        self.transport.sendto(serialize(msg), obs.addr)
+
+    def notify_path(self, path, value):
+        for obs in self.observers:
+            if obs.path == path:
+                self.notify(obs, cbor_encode(value))
+
+    # Settings and RPC pushed to the device
+    def settings_doc(self):
+        return {"version": self.settings_version, "settings": self.settings}
+
+    def set_setting(self, key, value):
+        self.settings[key] = value
+        self.settings_version += 1
+        self.notify_path('.c', self.settings_doc())
+
+    def call_rpc(self, method, params):
+        rpc_id = "%08x" % random.getrandbits(32)
+        self.pending_rpc[rpc_id] = (method, time.monotonic())
+        self.notify_path('.rpc', {"id": rpc_id, "method": method, "params": params})
+        return rpc_id
+
+    # Request handling
+    def datagram_received(self, data, addr):
+        if time.monotonic() < self.drop_until or random.random() < self.args.loss:
+            return
+        try:
+            msg = parse(data)
+        except (ValueError, IndexError) as e:
+            self.log("%s: bad datagram: %s" % (addr, e))
+            return
+
+        if msg.mtype == RST:
+            self.observers = [o for o in self.observers
+                    if not (o.addr == addr and o.token == msg.token)]
+            return
+        if msg.code == 0:
+            if msg.mtype == CON:
+                # CoAP ping
+                self.transport.sendto(serialize(Message(RST, 0, msg.mid)), addr)
+            return
+        if msg.code >= 32:
+            # A response, only ever an ACK to a notification
+            return
+
+        key = (addr, msg.mid)
+        if msg.mtype == CON and key in self.recent:
+            # Retransmission, the answer was lost
+            self.transport.sendto(self.recent[key], addr)
+            return
+
+        rsp = self.handle(msg, addr)
+        rsp.mtype = ACK if msg.mtype == CON else NON
+        if rsp.mtype == NON:
+            self.mid = (self.mid + 1) & 0xFFFF
+            rsp.mid = self.mid
+        else:
+            rsp.mid = msg.mid
+        rsp.token = msg.token
+        raw = serialize(rsp)
+        if msg.mtype == CON:
+            self.recent[key] = raw
+            if len(self.recent) > 256:
+                self.recent.pop(next(iter(self.recent)))
+
+        if self.args.delay_ms:
+            asyncio.get_running_loop().call_later(self.args.delay_ms / 1000,
+                    self.transport.sendto, raw, addr)
+        else:
+            self.transport.sendto(raw, addr)
+
+    def handle(self, msg, addr):
+        path = msg.path()
+        method = {GET: "GET", POST: "POST", PUT: "PUT", DELETE: "DELETE"}.get(msg.code, "?")
+        self.stats.add(method, path, len(msg.payload))
+        if self.args.verbose:
+            self.log("%s %s %s %d bytes" % (addr[0], method, path, len(msg.payload)))
+
+        fmt = msg.opt_uint(OPT_CONTENT_FORMAT)
+        accept = msg.opt_uint(OPT_ACCEPT)
+        accept = accept if accept is not None else (fmt if fmt is not None else FMT_JSON)
+        try:
+            if path == 'hello' and msg.code == GET:
+                return Message(code=CONTENT, options=[(OPT_CONTENT_FORMAT, b'')],
+                        payload=b'Hello ' + self.device_id(msg).encode())
+            if path.startswith('.d/') or path == '.d':
+                return self.handle_lightdb(msg, addr, path[3:], fmt, accept)
+            if path.startswith('.s/') and msg.code in (POST, PUT):
+                return self.handle_stream(msg, path[3:], fmt)
+            if path in ('.c', '.rpc') and msg.code == GET:
+                return self.handle_observe_only(msg, addr, path)
+            if path == '.c/status' and msg.code in (POST, PUT):
+                self.log("settings status: %s" % to_json(decode_payload(msg.payload, FMT_CBOR)))
+                return Message(code=CHANGED)
+            if path == '.rpc/status' and msg.code in (POST, PUT):
+                return self.handle_rpc_status(msg)
+            if path.startswith('.logs') and msg.code in (POST, PUT):
+                self.log("device log: %s" % to_json(decode_payload(msg.payload, fmt or FMT_CBOR)))
+                return Message(code=CHANGED)
+        except (ValueError, IndexError, UnicodeDecodeError) as e:
+            self.log("%s %s: %s" % (method, path, e))
+            return Message(code=BAD_REQUEST)
+        return Message(code=NOT_FOUND)
+
+    def device_id(self, msg):
+        for q in msg.opt(OPT_URI_QUERY):
+            name, _, value = q.decode().partition('=')
+            if value:
+                return value
+        return "device"
+
+    def observe(self, msg, addr, path, fmt):
+        flag = msg.opt_uint(OPT_OBSERVE)
+        self.observers = [o for o in self.observers
+                if not (o.addr == addr and o.token == msg.token)]
+        if flag == 0:
+            self.observers.append(Observer(addr, msg.token, path, fmt))
+            return [(OPT_OBSERVE, uint_opt(2))]
+        return []
+
+    def handle_lightdb(self, msg, addr, path, fmt, accept):
+        if msg.code == GET:
+            options = self.observe(msg, addr, '.d/' + path, accept)
+            options.append((OPT_CONTENT_FORMAT, uint_opt(accept)))
+            return Message(code=CONTENT, options=options,
+                    payload=encode_payload(self.lookup(path), accept))
+        if msg.code in (POST, PUT):
+            if fmt not in (None, FMT_JSON, FMT_CBOR):
+                return Message(code=UNSUPPORTED_FORMAT)
+            self.store(path, decode_payload(msg.payload, fmt or FMT_JSON))
+            return Message(code=CHANGED)
+        if msg.code == DELETE:
+            self.remove(path)
+            return Message(code=DELETED)
+        return Message(code=METHOD_NOT_ALLOWED)
+
+    def handle_stream(self, msg, path, fmt):
+        if self.record:
+            value = decode_payload(msg.payload, fmt or FMT_JSON)
+            self.record.write(to_json({"time": time.time(), "path": path, "data": value}) + '\n')
+            self.record.flush()
+        return Message(code=CREATED)
+
+    def handle_observe_only(self, msg, addr, path):
+        options = self.observe(msg, addr, path, FMT_CBOR)
+        options.append((OPT_CONTENT_FORMAT, uint_opt(FMT_CBOR)))
+        # Settings are sent on observe, RPCs only when called
+        value = self.settings_doc() if path == '.c' else None
+        payload = cbor_encode(value) if value is not None else b''
+        return Message(code=CONTENT, options=options, payload=payload)
+
+    def handle_rpc_status(self, msg):
+        status = decode_payload(msg.payload, FMT_CBOR)
+        method, started = self.pending_rpc.pop(status.get("id"), ("?", time.monotonic()))
+        self.log("rpc %s -> status %s in %.0f ms %s" % (method, status.get("statusCode"),
+                (time.monotonic() - started) * 1000, to_json(status.get("detail", {}))))
+        return Message(code=CHANGED)
+
+    # Console
+    def command(self, line):
+        words = line.split(None, 2)
+        if not words:
+            return
+        cmd, rest = words[0], words[1:]
+        try:
+            if cmd == 'get':
+                self.log(to_json(self.lookup(rest[0] if rest else '')))
+            elif cmd == 'set' and len(rest) == 2:
+                self.store(rest[0], json.loads(rest[1]))
+            elif cmd == 'delete' and rest:
+                self.remove(rest[0])
+            elif cmd == 'setting' and len(rest) == 2:
+                self.set_setting(rest[0], json.loads(rest[1]))
+            elif cmd == 'rpc' and rest:
+                params = json.loads('[' + rest[1] + ']') if len(rest) > 1 else []
+                self.log("rpc id %s" % self.call_rpc(rest[0], params))
+            elif cmd == 'drop' and rest:
+                self.drop_until = time.monotonic() + float(rest[0])
+                self.log("dropping everything for %s s" % rest[0])
+            elif cmd == 'stats':
+                self.log(self.stats.report())
+            elif cmd == 'observers':
+                for o in self.observers:
+                    self.log("%s:%d %s" % (o.addr[0], o.addr[1], o.path))
+            else:
+                self.log("commands: get [path] | set <path> <json> | delete <path> | "
+                        "setting <key> <json> | rpc <method> [json params, ...] | "
+                        "drop <seconds> | stats | observers")
+        except (ValueError, IndexError) as e:
+            self.log("error: %s" % e)
+
+async def console(standin):
+    loop = asyncio.get_running_loop()
+    reader = asyncio.StreamReader()
+    await loop.connect_read_pipe(lambda: asyncio.StreamReaderProtocol(reader), sys.stdin)
+    while True:
+        line = await reader.readline()
+        if not line:
+            return
+        standin.command(line.decode().strip())
+
+async def periodic_stats(standin, interval):
+    while True:
+        await asyncio.sleep(interval)
+        standin.log(standin.stats.report())
+
+async def serve(args):
+    loop = asyncio.get_running_loop()
+    transport, standin = await loop.create_datagram_endpoint(
+            lambda: StandIn(args), local_addr=(args.host, args.port))
+    standin.log("Golioth stand-in on %s:%d" % (args.host, args.port))
+    tasks = []
+    if args.stats_interval:
+        tasks.append(asyncio.create_task(periodic_stats(standin, args.stats_interval)))
+    try:
+        if not args.no_console:
+            await console(standin)
+        await asyncio.Event().wait()
+    finally:
+        for t in tasks:
+            t.cancel()
+        standin.log(standin.stats.report())
+        transport.close()
+
+def main(argv):
+    parser = argparse.ArgumentParser(description="Local CoAP stand-in for Golioth")
+    parser.add_argument('--host', default='0.0.0.0')
+    parser.add_argument('--port', type=int, default=5683)
+    parser.add_argument('--state', help="JSON file with the initial LightDB State")
+    parser.add_argument('--record', help="append stream pushes to this JSON lines file")
+    parser.add_argument('--delay-ms', type=float, default=0, help="delay every response")
+    parser.add_argument('--loss', type=float, default=0, help="drop this fraction of requests")
+    parser.add_argument('--stats-interval', type=float, default=0, help="print stats every N s")
+    parser.add_argument('--no-console', action='store_true', help="don't read commands from stdin")
+    parser.add_argument('-v', '--verbose', action='store_true')
+    args = parser.parse_args(argv)
+    try:
+        asyncio.run(serve(args))
+    except KeyboardInterrupt:
+        pass
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
@@ -99,10 +99,48 @@ def rotate_invert_flipendian(xbm_filename):
     print("Generating: " + headerfile)
     write_headerfile(arr, headerfile, filename_stub)
 
+def read_xbm(xbm_filename):
+    '''
+    Return (width, height, bytes) of an .xbm image
+    '''
+    with open(xbm_filename) as f:
+        content = f.read()
+
+    width = int(content.split("_width")[1].split()[0])
+    height = int(content.split("_height")[1].split()[0])
+    array = [int(x, 16) for x in content.replace('\n', "").strip().split("{")[1].split("}")[0].split(",") if x.strip()]
+    return width, height, array
+
+def unrotated(xbm_filename):
+    '''
+    Keep the image as drawn for epaper_DrawBitmap(), which rotates it to the
+    display orientation at runtime (needs CONFIG_MAGTAG_ORIENTATION). Width and
+    height must be multiples of 8.
+    XBM is already row-major with 1 for black, only the bit order changes.
+    '''
+    width, height, arr = read_xbm(xbm_filename)
+    if width % 8 or height % 8:
+        raise ValueError("Image must be a multiple of 8 pixels in each direction")
+
+    arr = reverse_endian_array(arr)
+    filename_stub=Path(xbm_filename).stem
+    headerfile = os.path.join(os.getcwd(),filename_stub + '.h')
+    print("Generating: " + headerfile)
+    write_headerfile(arr, headerfile, filename_stub)
+    with open(headerfile, "a") as f:
+        f.write('#define {}_width {}\n'.format(filename_stub, width))
+        f.write('#define {}_height {}\n'.format(filename_stub, height))
+
 def main(argv):
-    if len(sys.argv) != 2:
-        print("\nUsage: python3 xbm_to_header.py filename.xbm\n")
+    if len(sys.argv) == 3 and sys.argv[1] == "--no-rotate":
+        try:
+            unrotated(sys.argv[2])
+        except Exception as e:
+            print(e)
+    elif len(sys.argv) != 2:
+        print("\nUsage: python3 xbm_to_header.py [--no-rotate] filename.xbm\n")
         print("\tConvert a 296x128 .xbm image file to a header file for the magtag\n")
+        print("\t--no-rotate keeps any size image as drawn, for epaper_DrawBitmap()\n")
     else:
         try:
             filename = sys.argv[1]